@@ -1,6 +1,7 @@
 #include "rencoder.h"
 #include "Mixer.h"
 #include "SoundPool.h"
+#include "Encoder.h"
 #include "Error.h"
 #include "rparser.h"
 #include <iostream>
@@ -123,6 +124,7 @@ bool REncoder::Encode()
     return false;
   }
 
+  bool is_written = false;
   {
     // mixing prepare
     SoundInfo sinfo(1, sound_bps_, sound_ch_, sound_rate_);
@@ -142,17 +144,30 @@ bool REncoder::Encode()
     // set volume
     soundpool.SetVolume(0.8f);
 
-    // do mixing
-    soundpool.RecordToSound(out);
-    OnUpdateProgress(0.6);
-  }
-
-  // effector if necessary.
-  if (tempo_length_ != 1.0 || pitch_ != 1.0)
-  {
-    RMIXER_ASSERT(out.Effect(pitch_, tempo_length_, 1.0));
+    // do mixing, with pitch/tempo variant if necessary.
+    // WAV is written while mixing, so long render won't stay in memory.
+    if (enc_signature == "WAV" && pitch_ == 1.0 && tempo_length_ == 1.0)
+    {
+      WAVWriter writer;
+      auto &md = c->GetMetaData();
+      if (!md.title.empty())
+        writer.AddInfo("ISBJ", md.title);
+      if (!md.artist.empty())
+        writer.AddInfo("IART", md.artist);
+      bool r = writer.Open(filename_out_, sinfo) && soundpool.RecordToWAV(writer);
+      r = writer.Close() && r;
+      if (!r)
+      {
+        std::cerr << "Failed to write sound file." << std::endl;
+        s.Close();
+        return false;
+      }
+      is_written = true;
+    }
+    else
+      soundpool.RecordToSound(out, pitch_, tempo_length_);
+    OnUpdateProgress(0.75);
   }
-  OnUpdateProgress(0.75);
 
   // save file
   std::map<std::string, std::string> metadata;
@@ -163,11 +178,14 @@ bool REncoder::Encode()
   metadata["SUBARTIST"] = md.subartist;
   // TODO: write albumart data.
   // TODO: write to STDOUT if necessary.
-  out.Save(
-    filename_out_,
-    metadata,
-    quality_
-  );
+  if (!is_written)
+  {
+    out.Save(
+      filename_out_,
+      metadata,
+      quality_
+    );
+  }
   OnUpdateProgress(1.0);
 
   // is it necessary to export chart html?
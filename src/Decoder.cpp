@@ -1,9 +1,18 @@
 #include "Decoder.h"
+#include <memory.h>
+#include <thread>
+#include <algorithm>
+#include <atomic>
 
 namespace rmixer
 {
 
-Decoder::Decoder() {}
+/* minimum frames for each worker of parallel decoding (30sec in 44.1kHz). */
+constexpr uint64_t kParallelDecodeMinFrame = 44100 * 30;
+
+static std::atomic<unsigned> default_thread_count(1);
+
+Decoder::Decoder() : arena_(nullptr), thread_count_(default_thread_count) {}
 
 Decoder::~Decoder() {}
 
@@ -27,6 +36,102 @@ uint32_t Decoder::read(char** p)
 
 const SoundInfo& Decoder::get_info() { return info_; }
 
+uint32_t Decoder::borrow(const char** /* p */, const SoundInfo& /* info */)
+{
+  return 0;
+}
+
+uint64_t Decoder::get_frame_count()
+{
+  return 0;
+}
+
+uint64_t Decoder::estimate_frame_count(size_t /* len */, size_t /* source_len */)
+{
+  // length is in header for most formats.
+  return get_frame_count();
+}
+
+bool Decoder::probe(SoundProbeInfo &out, size_t len, size_t source_len)
+{
+  if (info_.rate == 0 || info_.channels == 0)
+    return false;
+  out.info = info_;
+  out.frame_count = source_len > len ?
+    estimate_frame_count(len, source_len) : get_frame_count();
+  out.byte_size = (size_t)out.frame_count * GetByteFromFrame(1, info_);
+  out.duration = (float)((double)out.frame_count / info_.rate * 1000);
+  return true;
+}
+
+void Decoder::set_arena(SoundArena *arena) { arena_ = arena; }
+
+SoundArena* Decoder::get_arena() { return arena_; }
+
+char* Decoder::allocate_buffer(size_t size)
+{
+  if (arena_)
+    return (char*)arena_->Allocate(size);
+  return (char*)malloc(size);
+}
+
+void Decoder::release_buffer(char *p, size_t size)
+{
+  if (arena_)
+    arena_->Release((int8_t*)p, size);
+  else
+    free(p);
+}
+
+void Decoder::set_thread_count(unsigned thread_count)
+{
+  thread_count_ = std::max(thread_count, 1u);
+}
+
+void Decoder::SetDefaultThreadCount(unsigned thread_count)
+{
+  default_thread_count = std::max(thread_count, 1u);
+}
+
+unsigned Decoder::GetDefaultThreadCount()
+{
+  return default_thread_count;
+}
+
+unsigned Decoder::get_worker_count(uint64_t framecount) const
+{
+  const uint64_t n = std::min<uint64_t>(thread_count_, framecount / kParallelDecodeMinFrame);
+  return n > 1 ? (unsigned)n : 1;
+}
+
+void Decoder::RunWorkers(unsigned worker_count, const std::function<void(unsigned)> &func)
+{
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < worker_count; ++i)
+    threads.emplace_back(func, i);
+  func(0);
+  for (auto &t : threads)
+    t.join();
+}
+
+char* Decoder::shrink_buffer(char *p, size_t size)
+{
+  if (size == 0)
+  {
+    free(p);
+    return nullptr;
+  }
+  if (arena_)
+  {
+    char *r = (char*)arena_->Allocate(size);
+    memcpy(r, p, size);
+    free(p);
+    return r;
+  }
+  char *r = (char*)realloc(p, size);
+  return r ? r : p;
+}
+
 
 #if 0
 
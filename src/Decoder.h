@@ -2,6 +2,7 @@
 #define RMIXER_DECODER_H
 
 #include <stdint.h>
+#include <functional>
 #include "rparser.h" /* due to rutil module */
 #include "Sound.h"
 
@@ -29,8 +30,61 @@ public:
   uint32_t readWithFormat(char** p, const SoundInfo& info);
   const SoundInfo& get_info();
 
+  /**
+   * @brief refer PCM data in opened source directly, without decoding.
+   * only possible if source stores PCM exactly in given format.
+   * @param p pointer to PCM data in source memory (valid while source is alive)
+   * @return frame count, 0 if not possible.
+   */
+  virtual uint32_t borrow(const char** p, const SoundInfo& info);
+
+  /* @brief total frame count of opened stream from its header, 0 if unknown. */
+  virtual uint64_t get_frame_count();
+
+  /* @brief frame count of whole stream (source_len byte of audio) when only
+   * its head (first len byte of opened data) and tail is opened.
+   * estimated if length is not in header. */
+  virtual uint64_t estimate_frame_count(size_t len, size_t source_len);
+
+  /* @brief fill format and length of opened stream without decoding.
+   * source_len is audio size of whole stream if only part of it is opened,
+   * and len is size of its head at start of opened data. */
+  bool probe(SoundProbeInfo &out, size_t len = 0, size_t source_len = 0);
+
+  /**
+   * @brief set arena which decoded buffer is allocated from.
+   * if not set, decoded buffer is malloc'd and caller should free() it.
+   */
+  void set_arena(SoundArena *arena);
+  SoundArena* get_arena();
+
+  /* @brief buffer allocation for decoded PCM (from arena if set). */
+  char* allocate_buffer(size_t size);
+  void release_buffer(char *p, size_t size);
+
+  /* @brief move malloc'd buffer into exactly sized decoded PCM buffer. */
+  char* shrink_buffer(char *p, size_t size);
+
+  /**
+   * @brief decode long stream with multiple threads, by splitting it into
+   * independent frame ranges. only for decoders supporting it (WAV, FLAC).
+   * default is set by SetDefaultThreadCount (1 if not set).
+   */
+  void set_thread_count(unsigned thread_count);
+  static void SetDefaultThreadCount(unsigned thread_count);
+  static unsigned GetDefaultThreadCount();
+
 protected:
   SoundInfo info_;
+  SoundArena *arena_;
+  unsigned thread_count_;
+
+  /* @brief worker count for decoding given frames (at least 1). */
+  unsigned get_worker_count(uint64_t framecount) const;
+
+  /* @brief call func(i) for i in [0, worker_count) concurrently.
+   * func(0) is called in current thread. */
+  static void RunWorkers(unsigned worker_count, const std::function<void(unsigned)> &func);
   virtual uint32_t read_internal(char** p, bool read_raw) = 0;
 };
 
@@ -42,6 +96,8 @@ public:
   virtual bool open(rutil::FileData &fd);
   virtual bool open(const char* p, size_t len);
   virtual void close();
+  virtual uint32_t borrow(const char** p, const SoundInfo& info);
+  virtual uint64_t get_frame_count();
   uint32_t readAsS32(char **p); // deprecated
 private:
   virtual uint32_t read_internal(char** p, bool read_raw);
@@ -58,6 +114,8 @@ public:
   virtual bool open(rutil::FileData &fd);
   virtual bool open(const char* p, size_t len);
   virtual void close();
+  virtual uint64_t get_frame_count();
+  virtual uint64_t estimate_frame_count(size_t len, size_t source_len);
 private:
   virtual uint32_t read_internal(char** p, bool read_raw);
   void *pContext;
@@ -73,6 +131,8 @@ public:
   virtual bool open(rutil::FileData &fd);
   virtual bool open(const char* p, size_t len);
   virtual void close();
+  virtual uint64_t get_frame_count();
+  virtual uint64_t estimate_frame_count(size_t len, size_t source_len);
 private:
   virtual uint32_t read_internal(char** p, bool read_raw);
   void *pContext_;
@@ -86,12 +146,21 @@ public:
   virtual bool open(rutil::FileData &fd);
   virtual bool open(const char* p, size_t len);
   virtual void close();
+  virtual uint64_t get_frame_count();
 
   rutil::FileData& get_fd();
   SoundInfo& info();
+
+  /* @brief writes interleaved PCM of output format from decoded FLAC frame. */
+  typedef void (*WriteFunc)(uint8_t *dst, const int32_t * const buffer[],
+                            unsigned channels, unsigned framecount, unsigned bps);
+
+  SoundInfo source_info_;
   uint64_t total_samples_;
   uint8_t* buffer_;
+  size_t buffer_size_;
   size_t buffer_pos_;
+  WriteFunc write_func_;
 
 private:
   virtual uint32_t read_internal(char** p, bool read_raw);
@@ -1,6 +1,7 @@
 #include "Decoder.h"
 #include <iostream>
 #include <memory.h>
+#include <vector>
 
 #define FLAC__NO_DLL
 #include "FLAC/stream_decoder.h"
@@ -56,29 +57,71 @@ FLAC__bool eof_cb(const FLAC__StreamDecoder *decoder, void *client_data)
   return fd.IsEOF();
 }
 
-FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data)
+/* conversion of FLAC integer sample (with source bps) into output format */
+
+template <typename T> struct FLACSample;
+template <> struct FLACSample<uint8_t>
 {
-  // get decoded PCM here.
-  Decoder_FLAC* f = ((Decoder_FLAC*)client_data);
-  const auto real_bps = frame->header.bits_per_sample;
-  const auto bps = f->info().bitsize;
-  const auto byps = bps / 8;
-  uint32_t offset = 0;
-  size_t channelcnt = f->info().channels;
-  const size_t shift_byte_size = 4 - byps;
+  static uint8_t from(int32_t v, unsigned bps)
+  { return (uint8_t)((bps >= 8 ? v >> (bps - 8) : v << (8 - bps)) + 128); }
+};
+template <> struct FLACSample<int16_t>
+{
+  static int16_t from(int32_t v, unsigned bps)
+  { return (int16_t)(bps >= 16 ? v >> (bps - 16) : v << (16 - bps)); }
+};
+template <> struct FLACSample<int32_t>
+{
+  static int32_t from(int32_t v, unsigned bps)
+  { return (int32_t)((uint32_t)v << (32 - bps)); }
+};
+template <> struct FLACSample<float>
+{
+  static float from(int32_t v, unsigned bps)
+  { return (float)v / (float)(1u << (bps - 1)); }
+};
 
+template <typename T>
+static void WriteFLACSamples(uint8_t *dst, const int32_t * const buffer[],
+                             unsigned channels, unsigned framecount, unsigned bps)
+{
   // make interleaved PCM data here
-  for (unsigned ch = 0; ch < channelcnt; ch++) {
+  T *out = (T*)dst;
+  for (unsigned ch = 0; ch < channels; ch++) {
     const int32_t* p = buffer[ch];
-    offset = f->buffer_pos_ + byps * ch;
-    for (unsigned i = 0; i < frame->header.blocksize; i++) {
-      //memcpy(f->buffer_ + offset, (int8_t*)(p + i) + shift_byte_size, byps);  // Big Endian (XXX: need to reverse byte order?)
-      memcpy(f->buffer_ + offset, (int8_t*)(p + i), byps);    // Little Endian
-      offset += byps * channelcnt;
-    }
+    T *o = out + ch;
+    for (unsigned i = 0; i < framecount; i++, o += channels)
+      *o = FLACSample<T>::from(p[i], bps);
   }
+}
 
-  f->buffer_pos_ += frame->header.blocksize * channelcnt * byps;
+/* @brief select sample writer for output format. nullptr if not supported. */
+static Decoder_FLAC::WriteFunc GetFLACWriteFunc(const SoundInfo &info)
+{
+  if (info.is_signed == 0 && info.bitsize == 8) return &WriteFLACSamples<uint8_t>;
+  if (info.is_signed == 1 && info.bitsize == 16) return &WriteFLACSamples<int16_t>;
+  if (info.is_signed == 1 && info.bitsize == 32) return &WriteFLACSamples<int32_t>;
+  if (info.is_signed == 2 && info.bitsize == 32) return &WriteFLACSamples<float>;
+  return nullptr;
+}
+
+FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data)
+{
+  // get decoded PCM here, converting into output format directly.
+  Decoder_FLAC* f = ((Decoder_FLAC*)client_data);
+  const size_t channelcnt = f->info().channels;
+  const size_t frame_byte = GetByteFromFrame(1, f->info());
+  if (!f->buffer_ || !f->write_func_)
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+  // ignore frames exceeding buffer (total samples, or decoding range).
+  unsigned framecount = frame->header.blocksize;
+  if (f->buffer_pos_ + framecount * frame_byte > f->buffer_size_)
+    framecount = (unsigned)((f->buffer_size_ - f->buffer_pos_) / frame_byte);
+
+  f->write_func_(f->buffer_ + f->buffer_pos_, buffer, (unsigned)channelcnt,
+                 framecount, frame->header.bits_per_sample);
+  f->buffer_pos_ += framecount * frame_byte;
   return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
@@ -94,16 +137,17 @@ void meta_cb(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *met
     uint64_t total_samples = metadata->data.stream_info.total_samples * channels;
 
     /* no 24bit */
-    if (bps == 24)
+    if (bps > 16)
       bps = 32;
+    else if (bps > 8)
+      bps = 16;
+    else
+      bps = 8;
 
     Decoder_FLAC* f = ((Decoder_FLAC*)client_data);
     f->info() = SoundInfo((uint8_t)is_signed, (uint8_t)bps, (uint8_t)channels, sample_rate);
+    f->source_info_ = f->info();
     f->total_samples_ = total_samples;
-
-    // allocate buffer here
-    const size_t total_size = (size_t)(total_samples * (bps / 8));
-    f->buffer_ = (uint8_t*)malloc(total_size);
   }
 }
 
@@ -113,7 +157,9 @@ void error_cb(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus
 }
 /** internal stream decoder functions end */
 
-Decoder_FLAC::Decoder_FLAC() : total_samples_(0), buffer_(0), pContext_(0)
+Decoder_FLAC::Decoder_FLAC()
+  : total_samples_(0), buffer_(0), buffer_size_(0), buffer_pos_(0), write_func_(nullptr),
+    pContext_(0)
 {
 }
 
@@ -143,6 +189,11 @@ bool Decoder_FLAC::open(const char* p, size_t len)
   if (init_status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
     return false;
 
+  // read stream info first, so sound info is available before decoding.
+  if (!FLAC__stream_decoder_process_until_end_of_metadata(decoder) ||
+      total_samples_ == 0)
+    return false;
+
   return true;
 }
 
@@ -159,9 +210,10 @@ void Decoder_FLAC::close()
   }
   if (buffer_)
   {
-    free(buffer_);
+    release_buffer((char*)buffer_, GetByteFromSample((uint32_t)total_samples_, info_));
     buffer_ = 0;
   }
+  total_samples_ = 0;
 }
 
 uint32_t Decoder_FLAC::read_internal(char **p, bool read_raw)
@@ -169,20 +221,86 @@ uint32_t Decoder_FLAC::read_internal(char **p, bool read_raw)
   if (!pContext_)
     return 0;
 
-  // custom format reading is not supported.
+  // custom format only changes sample format; channel and rate remain as source.
   if (!read_raw)
+  {
+    info_.channels = source_info_.channels;
+    info_.rate = source_info_.rate;
+  }
+  write_func_ = GetFLACWriteFunc(info_);
+  if (!write_func_)
     return 0;
 
+  // allocate buffer here
+  const size_t buffer_size = GetByteFromSample((uint32_t)total_samples_, info_);
+  const size_t frame_byte = GetByteFromFrame(1, info_);
+  const uint64_t framecount = total_samples_ / info_.channels;
+  const unsigned worker_count = get_worker_count(framecount);
+  buffer_ = (uint8_t*)allocate_buffer(buffer_size);
+  buffer_size_ = buffer_size;
   buffer_pos_ = 0;
-  bool r = FLAC__stream_decoder_process_until_end_of_stream((FLAC__StreamDecoder*)pContext_);
+  bool r;
+
+  if (worker_count == 1)
+  {
+    r = FLAC__stream_decoder_process_until_end_of_stream((FLAC__StreamDecoder*)pContext_);
+  }
+  else
+  {
+    // each worker seeks to its own frame range with separated decoder
+    // and decodes into disjoint region of the output buffer.
+    std::vector<uint64_t> readcount(worker_count, 0);
+    RunWorkers(worker_count, [&](unsigned i) {
+      const uint64_t start = framecount * i / worker_count;
+      const uint64_t end = framecount * (i + 1) / worker_count;
+      Decoder_FLAC w;
+      if (!w.open((const char*)fd_.p, fd_.len))
+        return;
+      FLAC__StreamDecoder *decoder = (FLAC__StreamDecoder*)w.pContext_;
+      w.info() = info_;
+      w.write_func_ = write_func_;
+      w.buffer_ = buffer_ + start * frame_byte;
+      w.buffer_size_ = (size_t)(end - start) * frame_byte;
+      w.buffer_pos_ = 0;
+      if (start == 0 || FLAC__stream_decoder_seek_absolute(decoder, start))
+      {
+        while (w.buffer_pos_ < w.buffer_size_ &&
+               FLAC__stream_decoder_get_state(decoder) != FLAC__STREAM_DECODER_END_OF_STREAM &&
+               FLAC__stream_decoder_process_single(decoder));
+      }
+      readcount[i] = w.buffer_pos_ / frame_byte;
+      w.buffer_ = 0;  /* region of our buffer; not to be released */
+    });
+
+    // stops at the first incomplete range.
+    for (unsigned i = 0; i < worker_count; ++i)
+    {
+      const uint64_t start = framecount * i / worker_count;
+      const uint64_t end = framecount * (i + 1) / worker_count;
+      buffer_pos_ = (size_t)(start + readcount[i]) * frame_byte;
+      if (start + readcount[i] < end)
+        break;
+    }
+    r = buffer_pos_ > 0;
+  }
 
   if (r)
   {
     *p = (char*)buffer_;
     buffer_ = 0;
-    return (uint32_t)(total_samples_ / info_.channels);
+    return (uint32_t)(buffer_pos_ / frame_byte);
   }
-  else return 0;
+  else
+  {
+    release_buffer((char*)buffer_, buffer_size);
+    buffer_ = 0;
+    return 0;
+  }
+}
+
+uint64_t Decoder_FLAC::get_frame_count()
+{
+  return info_.channels ? total_samples_ / info_.channels : 0;
 }
 
 rutil::FileData& Decoder_FLAC::get_fd()
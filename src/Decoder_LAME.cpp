@@ -46,38 +46,99 @@ void Decoder_LAME::close()
   }
 }
 
-uint32_t Decoder_LAME::read_internal(char **p, bool read_raw)
+uint64_t Decoder_LAME::get_frame_count()
 {
   if (!pContext_)
     return 0;
+  return drmp3_get_pcm_frame_count((drmp3*)pContext_);
+}
 
-  // custom format reading is not supported.
-  if (!read_raw)
+uint64_t Decoder_LAME::estimate_frame_count(size_t len, size_t source_len)
+{
+  // MP3 has no length in header; scale frames in head by audio length
+  // (exact for CBR). only head is counted, as tail after it is not continuous.
+  if (!pContext_ || len == 0)
+    return 0;
+  drmp3 *head = (drmp3*)malloc(sizeof(drmp3));
+  uint64_t framecount = 0;
+  if (drmp3_init_memory(head, ((drmp3*)pContext_)->memory.pData, len, 0))
+  {
+    framecount = drmp3_get_pcm_frame_count(head);
+    drmp3_uninit(head);
+  }
+  free(head);
+  return framecount * source_len / len;
+}
+
+/* @brief read PCM frames as S16 or F32, depending on output format. */
+static uint64_t ReadMP3Frames(drmp3 &mp3, uint64_t framecount, char *p, bool is_float)
+{
+  if (is_float)
+    return drmp3_read_pcm_frames_f32(&mp3, framecount, (float*)p);
+  else
+    return drmp3_read_pcm_frames_s16(&mp3, framecount, (int16_t*)p);
+}
+
+uint32_t Decoder_LAME::read_internal(char **p, bool read_raw)
+{
+  if (!pContext_)
     return 0;
 
   drmp3 &mp3 = *(drmp3*)pContext_;
+
+  // custom format reading is only supported for S16 and F32,
+  // while channel and rate remain as source.
+  if (!read_raw)
+  {
+    if (!(info_.is_signed == 1 && info_.bitsize == 16) &&
+        !(info_.is_signed == 2 && info_.bitsize == 32))
+      return 0;
+    info_.channels = (uint8_t)mp3.channels;
+    info_.rate = mp3.sampleRate;
+  }
+
+  const bool is_float = info_.is_signed == 2;
+  const size_t frame_byte = GetByteFromFrame(1, info_);
+
+  /* if total length is known, decode into an exact-sized buffer at once. */
+  const uint64_t total_frame_count = drmp3_get_pcm_frame_count(&mp3);
+  if (total_frame_count > 0)
+  {
+    const size_t buffer_size = (size_t)total_frame_count * frame_byte;
+    char *buffer = allocate_buffer(buffer_size);
+    RMIXER_ASSERT(buffer);
+    const uint64_t framecount = ReadMP3Frames(mp3, total_frame_count, buffer, is_float);
+    if (framecount == 0)
+    {
+      release_buffer(buffer, buffer_size);
+      *p = nullptr;
+      return 0;
+    }
+    *p = buffer;
+    return (uint32_t)framecount;
+  }
+
   uint64_t framecount = 0;
   uint64_t readframecount = 0;
   size_t current_buffer_bytesize = kMP3DefaultPCMBufferSize;
-  int16_t *buffer = (int16_t*)malloc(current_buffer_bytesize);
-  constexpr auto kBps = 2;  /* Byte Per Sample (16bit) */
-  const uint32_t frames_to_read_at_once = current_buffer_bytesize / kBps / mp3.channels;
+  char *buffer = (char*)malloc(current_buffer_bytesize);
+  const uint32_t frames_to_read_at_once = current_buffer_bytesize / frame_byte;
 
   do {
-    readframecount = drmp3_read_pcm_frames_s16(&mp3, frames_to_read_at_once, buffer + framecount * mp3.channels);
+    readframecount = ReadMP3Frames(mp3, frames_to_read_at_once, buffer + framecount * frame_byte, is_float);
     framecount += readframecount;
     // check is_realloc_necessary
-    if ((framecount + frames_to_read_at_once) * kBps * mp3.channels > current_buffer_bytesize)
+    if ((framecount + frames_to_read_at_once) * frame_byte > current_buffer_bytesize)
     {
       current_buffer_bytesize *= 2;
-      buffer = (int16_t*)realloc(buffer, current_buffer_bytesize);
+      buffer = (char*)realloc(buffer, current_buffer_bytesize);
       RMIXER_ASSERT(buffer);
     }
   } while (readframecount > 0);
 
   // - done -
-  *p = (char*)buffer;
+  *p = shrink_buffer(buffer, (size_t)framecount * frame_byte);
   return (uint32_t)framecount;
 }
 
-}
\ No newline at end of file
+}
@@ -2,6 +2,12 @@
 #include "Error.h"
 #include "vorbis/vorbisfile.h"
 #include <memory.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 /** https://svn.xiph.org/trunk/vorbis/examples/decoder_example.c */
 
@@ -23,6 +29,36 @@ struct OGGDecodeContext
 
 constexpr auto kOGGDecodeBufferSize = 8192u;
 constexpr auto kOGGDefaultPCMBufferSize = 1024 * 1024 * 1u;  /* default allocating memory size for PCM decoding */
+constexpr auto kOGGMaxFramePerByte = 64u;  /* sanity limit for granule position of last page */
+
+/* @brief total frame count of the stream from granule position of its last page.
+ * source_len is size of whole stream, used for sanity check.
+ * returns 0 if unknown (no page found or corrupted granule). */
+static uint64_t GetOGGTotalFrameCount(const OGGDecodeContext &c, size_t source_len)
+{
+  const uint8_t *data = c.fdd.p;
+  const size_t len = c.fdd.len;
+  if (!data || len < 27)
+    return 0;
+  for (size_t i = len - 27 + 1; i > 0; --i)
+  {
+    const uint8_t *h = data + (i - 1);
+    if (h[0] != 'O' || h[1] != 'g' || h[2] != 'g' || h[3] != 'S' || h[4] != 0)
+      continue;
+    uint32_t serialno = 0;
+    int64_t granulepos = 0;
+    for (int b = 3; b >= 0; --b)
+      serialno = (serialno << 8) | h[14 + b];
+    for (int b = 7; b >= 0; --b)
+      granulepos = (int64_t)(((uint64_t)granulepos << 8) | h[6 + b]);
+    if ((int)serialno != c.os.serialno || granulepos < 0)
+      continue;
+    if ((uint64_t)granulepos > (uint64_t)source_len * kOGGMaxFramePerByte)
+      return 0;
+    return (uint64_t)granulepos;
+  }
+  return 0;
+}
 
 Decoder_OGG::Decoder_OGG()
   : pContext(0), buffer(0), bytes(0) {}
@@ -114,7 +150,187 @@ void Decoder_OGG::close()
   pContext = 0;
 }
 
-#define DISABLE_CLIPFLAG 0
+uint64_t Decoder_OGG::get_frame_count()
+{
+  if (!pContext)
+    return 0;
+  const OGGDecodeContext &c = *(OGGDecodeContext*)pContext;
+  return GetOGGTotalFrameCount(c, c.fdd.len);
+}
+
+uint64_t Decoder_OGG::estimate_frame_count(size_t /* len */, size_t source_len)
+{
+  // last page is in the opened tail.
+  if (!pContext)
+    return 0;
+  return GetOGGTotalFrameCount(*(OGGDecodeContext*)pContext, source_len);
+}
+
+/* float sample conversion to each output format (with clipping) */
+
+static inline float clip(float v) { return v > 1.0f ? 1.0f : (v < -1.0f ? -1.0f : v); }
+
+template <typename T> struct OGGSample;
+template <> struct OGGSample<uint8_t>
+{
+  static uint8_t from(float v) { return (uint8_t)lrintf(clip(v) * 127.f + 128.f); }
+};
+template <> struct OGGSample<int8_t>
+{
+  static int8_t from(float v) { return (int8_t)lrintf(clip(v) * 127.f); }
+};
+template <> struct OGGSample<uint16_t>
+{
+  static uint16_t from(float v) { return (uint16_t)lrintf(clip(v) * 32767.f + 32768.f); }
+};
+template <> struct OGGSample<int16_t>
+{
+  static int16_t from(float v) { return (int16_t)lrintf(clip(v) * 32767.f); }
+};
+template <> struct OGGSample<uint32_t>
+{
+  static uint32_t from(float v) { return (uint32_t)llrint(clip(v) * 2147483647.0 + 2147483648.0); }
+};
+template <> struct OGGSample<int32_t>
+{
+  static int32_t from(float v) { return (int32_t)lrint(clip(v) * 2147483647.0); }
+};
+template <> struct OGGSample<float>
+{
+  static float from(float v) { return v; }
+};
+template <> struct OGGSample<double>
+{
+  static double from(float v) { return v; }
+};
+
+typedef void (*OGGInterleaveFunc)(char *dst, float **pcm, int channels, int framecount);
+
+/* @brief convert planar float PCM from libvorbis into interleaved output format. */
+template <typename T>
+static void InterleaveOGG(char *dst, float **pcm, int channels, int framecount)
+{
+  T *out = (T*)dst;
+  for (int i = 0; i < channels; ++i)
+  {
+    const float *mono = pcm[i];
+    T *p = out + i;
+    for (int j = 0; j < framecount; ++j, p += channels)
+      *p = OGGSample<T>::from(mono[j]);
+  }
+}
+
+#ifdef USE_SSE2
+/* SIMD kernels: return processed frame count (remaining frames are done by scalar loop) */
+
+/* @brief load 4 samples, clip and convert into s32 with s16 scale. */
+static inline __m128i LoadS16_SIMD(const float *p)
+{
+  const __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+  return _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(32767.f)));
+}
+
+static int InterleaveOGG_S16_SIMD(int16_t *out, float **pcm, int channels, int framecount)
+{
+  int j = 0;
+  if (channels == 1)
+  {
+    const float *m = pcm[0];
+    for (; j + 8 <= framecount; j += 8)
+    {
+      __m128i a = LoadS16_SIMD(m + j);
+      __m128i b = LoadS16_SIMD(m + j + 4);
+      _mm_storeu_si128((__m128i*)(out + j), _mm_packs_epi32(a, b));
+    }
+  }
+  else if (channels == 2)
+  {
+    const float *l = pcm[0], *r = pcm[1];
+    for (; j + 8 <= framecount; j += 8)
+    {
+      __m128i l16 = _mm_packs_epi32(LoadS16_SIMD(l + j), LoadS16_SIMD(l + j + 4));
+      __m128i r16 = _mm_packs_epi32(LoadS16_SIMD(r + j), LoadS16_SIMD(r + j + 4));
+      _mm_storeu_si128((__m128i*)(out + j * 2), _mm_unpacklo_epi16(l16, r16));
+      _mm_storeu_si128((__m128i*)(out + j * 2 + 8), _mm_unpackhi_epi16(l16, r16));
+    }
+  }
+  return j;
+}
+
+static int InterleaveOGG_F32_SIMD(float *out, float **pcm, int channels, int framecount)
+{
+  int j = 0;
+  if (channels == 1)
+  {
+    memcpy(out, pcm[0], framecount * sizeof(float));
+    j = framecount;
+  }
+  else if (channels == 2)
+  {
+    const float *l = pcm[0], *r = pcm[1];
+    for (; j + 4 <= framecount; j += 4)
+    {
+      __m128 vl = _mm_loadu_ps(l + j);
+      __m128 vr = _mm_loadu_ps(r + j);
+      _mm_storeu_ps(out + j * 2, _mm_unpacklo_ps(vl, vr));
+      _mm_storeu_ps(out + j * 2 + 4, _mm_unpackhi_ps(vl, vr));
+    }
+  }
+  return j;
+}
+
+template <>
+void InterleaveOGG<int16_t>(char *dst, float **pcm, int channels, int framecount)
+{
+  int16_t *out = (int16_t*)dst;
+  int j = Sound::is_simd_enabled() ? InterleaveOGG_S16_SIMD(out, pcm, channels, framecount) : 0;
+  for (; j < framecount; ++j)
+    for (int i = 0; i < channels; ++i)
+      out[j * channels + i] = OGGSample<int16_t>::from(pcm[i][j]);
+}
+
+template <>
+void InterleaveOGG<float>(char *dst, float **pcm, int channels, int framecount)
+{
+  float *out = (float*)dst;
+  int j = Sound::is_simd_enabled() ? InterleaveOGG_F32_SIMD(out, pcm, channels, framecount) : 0;
+  for (; j < framecount; ++j)
+    for (int i = 0; i < channels; ++i)
+      out[j * channels + i] = pcm[i][j];
+}
+#endif
+
+/* @brief select conversion kernel for output format. nullptr if not supported. */
+static OGGInterleaveFunc GetOGGInterleaveFunc(const SoundInfo &info)
+{
+  switch (info.is_signed)
+  {
+  case 0:
+    switch (info.bitsize)
+    {
+    case 8: return &InterleaveOGG<uint8_t>;
+    case 16: return &InterleaveOGG<uint16_t>;
+    case 32: return &InterleaveOGG<uint32_t>;
+    }
+    break;
+  case 1:
+    switch (info.bitsize)
+    {
+    case 8: return &InterleaveOGG<int8_t>;
+    case 16: return &InterleaveOGG<int16_t>;
+    case 32: return &InterleaveOGG<int32_t>;
+    }
+    break;
+  case 2:
+    switch (info.bitsize)
+    {
+    case 32: return &InterleaveOGG<float>;
+    case 64: return &InterleaveOGG<double>;
+    }
+    break;
+  }
+  return nullptr;
+}
 
 uint32_t Decoder_OGG::read_internal(char **p, bool read_raw)
 {
@@ -126,21 +342,23 @@ uint32_t Decoder_OGG::read_internal(char **p, bool read_raw)
   const size_t byte_per_sample = info_.bitsize / 8;
   int eos = 0;
   int result = 0;
-  int convframesize = kOGGDecodeBufferSize / byte_per_sample / c.vi.channels;
-  char convbuffer[kOGGDecodeBufferSize];
-  int sample_offset = 0;
-  size_t pcm_buffer_size = kOGGDefaultPCMBufferSize;
-  char* pcm_buffer = (char*)malloc(pcm_buffer_size);
-  //sound().Set(16, vi.channels, sample_total_count, vi.rate);
-
-  uint16_t u16;
-  uint32_t u32;
-  int16_t s16;
-  int32_t s32;
-
-  if (byte_per_sample % 2 == 1)
+  size_t sample_offset = 0;
+
+  const OGGInterleaveFunc interleave = GetOGGInterleaveFunc(info_);
+  if (!interleave)
     return 0;
 
+  /* if total length is known, decode into an exact-sized buffer at once.
+   * decoded frames beyond the last granule position are trimmed. */
+  const uint64_t total_frame_count = GetOGGTotalFrameCount(c, c.fdd.len);
+  const bool is_exact = total_frame_count > 0;
+  size_t pcm_buffer_size = is_exact ?
+    (size_t)total_frame_count * c.vi.channels * byte_per_sample :
+    kOGGDefaultPCMBufferSize;
+  char* pcm_buffer = is_exact ?
+    allocate_buffer(pcm_buffer_size) : (char*)malloc(pcm_buffer_size);
+  RMIXER_ASSERT(pcm_buffer);
+
   if (vorbis_synthesis_init(&c.vd, &c.vi) == 0)
   {
     vorbis_block_init(&c.vd, &c.vb);
@@ -167,100 +385,27 @@ uint32_t Decoder_OGG::read_internal(char **p, bool read_raw)
                 vorbis_synthesis_blockin(&c.vd, &c.vb);
 
               while ((frames = vorbis_synthesis_pcmout(&c.vd, &pcm)) > 0) {
-                int j;
-                int clipflag = 0;
-                int bout = (frames < convframesize ? frames : convframesize);
-                for (int i = 0; i < c.vi.channels; i++) {
-                  char *ptr = convbuffer + i * byte_per_sample;
-                  float *mono = pcm[i];
-                  for (j = 0; j < bout; j++) {
-
-                    switch (info_.is_signed)
-                    {
-                    case 0:
-                      switch (info_.bitsize)
-                      {
-                      case 8:
-                        u16 = (uint16_t)floor((mono[j] + 1.0f) * 127.f + .5f);
-                        if (u16 > 255) { clipflag = 1; u16 = 255; }
-                        else { clipflag = 0; }
-                        *(uint8_t*)ptr = (uint8_t)u16;
-                        break;
-                      case 16:
-                        u32 = (uint32_t)floor((mono[j] + 1.0f) * 32767.f + .5f);
-                        if (u32 > 65535) { clipflag = 1; u32 = 65535; }
-                        *(uint16_t*)ptr = (uint16_t)u32;
-                        break;
-                      case 32:
-                        *(uint32_t*)ptr = (uint32_t)floor((mono[j] + 1.0f) * 2147483647.f + .5f);
-                        break;
-                      default:
-                        RMIXER_ASSERT(0);
-                      }
-                      break;
-                    case 1:
-                      switch (info_.bitsize)
-                      {
-                      case 8:
-                        s16 = (int16_t)floor(mono[j] * 127.f + .5f);
-                        if (s16 > 127) { clipflag = 1; s16 = 127; }
-                        else { clipflag = 0; }
-                        *(int8_t*)ptr = (int8_t)s16;
-                        break;
-                      case 16:
-                        s32 = (int32_t)floor(mono[j] * 32767.f + .5f);
-                        if (s32 > 32767) { clipflag = 1; s32 = 32767; }
-                        else if (s32 < -32768) { clipflag = 1; s32 = -32768; }
-                        *(int16_t*)ptr = (int16_t)s32;
-                        break;
-                      case 32:
-                        *(int32_t*)ptr = (int32_t)floor(mono[j] * 2147483647.f + .5f);
-                        break;
-                      default:
-                        RMIXER_ASSERT(0);
-                      }
-                      break;
-                    case 2:
-                      switch (info_.bitsize)
-                      {
-                      case 32:
-                        *(float*)ptr = mono[j];
-                        //*(float*)ptr = mono[j] > 1.0f ? 1.0f : (mono[j] < -1.0f ? -1.0f : mono[j]);
-                        break;
-                      case 64:
-                        *(double*)ptr = mono[j];
-                        break;
-                      default:
-                        RMIXER_ASSERT(0);
-                      }
-                      break;
-                    default:
-                      RMIXER_ASSERT(0);
-                    }
-
-                    ptr += c.vi.channels * byte_per_sample;
-                  }
-                }
-                /** optional: print cerr for clipflag */
-
-                // reallocate memory before writing
+                int bout = frames;
                 const size_t sample_offset_delta = bout * c.vi.channels;
                 const size_t required_pcm_buffer_size = (sample_offset + sample_offset_delta) * byte_per_sample;
                 if (pcm_buffer_size < required_pcm_buffer_size)
                 {
-                  while (pcm_buffer_size < required_pcm_buffer_size)
-                    pcm_buffer_size *= 2;
-                  pcm_buffer = (char*)realloc(pcm_buffer, pcm_buffer_size);
-                  RMIXER_ASSERT(pcm_buffer);
+                  if (is_exact)
+                  {
+                    bout = (int)((pcm_buffer_size / byte_per_sample - sample_offset) / c.vi.channels);
+                  }
+                  else
+                  {
+                    while (pcm_buffer_size < required_pcm_buffer_size)
+                      pcm_buffer_size *= 2;
+                    pcm_buffer = (char*)realloc(pcm_buffer, pcm_buffer_size);
+                    RMIXER_ASSERT(pcm_buffer);
+                  }
                 }
 
-                // write binary
-                memcpy(pcm_buffer + sample_offset * byte_per_sample,
-                  convbuffer,
-                  sample_offset_delta * byte_per_sample);
-                sample_offset += sample_offset_delta;
-
-                vorbis_synthesis_read(&c.vd, bout); // tell libvorbis consumed sample count.
+                interleave(pcm_buffer + sample_offset * byte_per_sample, pcm, c.vi.channels, bout);
+                sample_offset += bout * c.vi.channels;
+                vorbis_synthesis_read(&c.vd, frames); // tell libvorbis consumed sample count.
               }
             }
           }
@@ -280,8 +425,15 @@ uint32_t Decoder_OGG::read_internal(char **p, bool read_raw)
   }
 
   // resize PCM data and give it to sound object
-  pcm_buffer = (char*)realloc(pcm_buffer, sample_offset * byte_per_sample);
-  *p = pcm_buffer;
+  if (!is_exact)
+    *p = shrink_buffer(pcm_buffer, sample_offset * byte_per_sample);
+  else if (sample_offset == 0)
+  {
+    release_buffer(pcm_buffer, pcm_buffer_size);
+    *p = nullptr;
+  }
+  else
+    *p = pcm_buffer;  /* might be slightly larger than decoded when stream is truncated */
   return sample_offset / c.vi.channels; /* frame_count */
 }
 
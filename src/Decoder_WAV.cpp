@@ -1,5 +1,6 @@
 #include "Decoder.h"
 #include <iostream>
+#include <algorithm>
 
 #include "dr_wav.h"
 
@@ -44,10 +45,18 @@ bool Decoder_WAV::open(const char* p, size_t len)
       dWav->translatedFormatTag == DR_WAVE_FORMAT_DVI_ADPCM)
   {
     is_compressed_ = true;
+    // compressed data is decoded as signed PCM.
+    info_.is_signed = 1;
+    info_.bitsize = info_.bitsize <= 16 ? 16 : 32;
   }
   return true;
 }
 
+uint64_t Decoder_WAV::get_frame_count()
+{
+  return pWav_ ? ((drwav*)pWav_)->totalPCMFrameCount : 0;
+}
+
 void Decoder_WAV::close()
 {
   if (pWav_)
@@ -57,6 +66,32 @@ void Decoder_WAV::close()
   }
 }
 
+/* @brief read PCM frames from current position in output format. */
+static uint64_t ReadWAVFrames(drwav* dWav, uint64_t framecount, char *p,
+                              const SoundInfo &info, bool read_raw)
+{
+  if (read_raw)
+    return drwav_read_pcm_frames(dWav, framecount, p);
+
+  switch (info.is_signed)
+  {
+  case 1:
+    switch (info.bitsize)
+    {
+    case 16:
+      return drwav_read_pcm_frames_s16(dWav, framecount, (int16_t*)p);
+    case 32:
+      return drwav_read_pcm_frames_s32(dWav, framecount, (int32_t*)p);
+    }
+    break;
+  case 2:
+    if (info.bitsize == 32)
+      return drwav_read_pcm_frames_f32(dWav, framecount, (float*)p);
+    break;
+  }
+  return 0;
+}
+
 uint32_t Decoder_WAV::read_internal(char** p, bool read_raw)
 {
   if (!pWav_)
@@ -66,63 +101,87 @@ uint32_t Decoder_WAV::read_internal(char** p, bool read_raw)
   uint32_t r = 0;
 
   // if is compressed, then it cannot be read by raw.
+  // (decoded PCM format is already set when opened)
   if (is_compressed_ && read_raw)
-  {
-    if (info_.bitsize < 16)
-      info_.bitsize = 16;
-    else if (info_.bitsize < 32)
-      info_.bitsize = 32;
-    info_.is_signed = 1;
     return read_internal(p, false);
-  }
 
-  *p = (char*)malloc(GetByteFromFrame((uint32_t)dWav->totalPCMFrameCount, info_));
-  if (read_raw)
+  // check output format is supported
+  if (!read_raw && !(info_.is_signed == 1 && (info_.bitsize == 16 || info_.bitsize == 32)) &&
+      !(info_.is_signed == 2 && info_.bitsize == 32))
+    return 0;
+
+  const uint64_t framecount = dWav->totalPCMFrameCount;
+  const size_t frame_byte = GetByteFromFrame(1, info_);
+  const size_t buffer_size = (size_t)framecount * frame_byte;
+  *p = allocate_buffer(buffer_size);
+
+  // compressed stream cannot seek efficiently, so decoded in single thread.
+  const unsigned worker_count = is_compressed_ ? 1 : get_worker_count(framecount);
+  if (worker_count == 1)
   {
-    r = (uint32_t)drwav_read_pcm_frames(dWav, dWav->totalPCMFrameCount, *p);
+    r = (uint32_t)ReadWAVFrames(dWav, framecount, *p, info_, read_raw);
   }
   else
   {
-    switch (info_.is_signed)
+    // each worker opens its own reader and decodes disjoint frame range.
+    std::vector<uint64_t> readcount(worker_count, 0);
+    const drwav__memory_stream &ms = dWav->memoryStream;
+    char *out = *p;
+    const SoundInfo info = info_;
+    RunWorkers(worker_count, [&](unsigned i) {
+      const uint64_t start = framecount * i / worker_count;
+      const uint64_t end = framecount * (i + 1) / worker_count;
+      drwav* w = drwav_open_memory(ms.data, ms.dataSize);
+      if (!w) return;
+      if (drwav_seek_to_pcm_frame(w, start))
+        readcount[i] = ReadWAVFrames(w, end - start, out + start * frame_byte, info, read_raw);
+      drwav_close(w);
+    });
+
+    // stops at the first incomplete range.
+    for (unsigned i = 0; i < worker_count; ++i)
     {
-    case 0:
-      break;
-    case 1:
-      switch (info_.bitsize)
-      {
-      case 16:
-        r = (uint32_t)drwav_read_pcm_frames_s16(dWav, dWav->totalPCMFrameCount, (int16_t*)*p);
-        break;
-      case 32:
-        r = (uint32_t)drwav_read_pcm_frames_s32(dWav, dWav->totalPCMFrameCount, (int32_t*)*p);
-        break;
-      default:
+      const uint64_t start = framecount * i / worker_count;
+      const uint64_t end = framecount * (i + 1) / worker_count;
+      r = (uint32_t)(start + readcount[i]);
+      if (start + readcount[i] < end)
         break;
-      }
-      break;
-    case 2:
-      switch (info_.bitsize)
-      {
-      case 32:
-        r = (uint32_t)drwav_read_pcm_frames_f32(dWav, dWav->totalPCMFrameCount, (float*)*p);
-        break;
-        break;
-      default:
-        break;
-      }
-      break;
-    default:
-      break;
     }
   }
 
   if (r == 0)
   {
-    free(*p);
+    release_buffer(*p, buffer_size);
     *p = 0;
   }
 
-  return r / dWav->channels;
+  return r;
+}
+
+uint32_t Decoder_WAV::borrow(const char** p, const SoundInfo& info)
+{
+  if (!pWav_ || is_compressed_ || info_ != info)
+    return 0;
+
+  drwav* dWav = (drwav*)pWav_;
+  const size_t frame_byte = GetByteFromFrame(1, info_);
+  const size_t align = info_.bitsize == 24 ? 1 : info_.bitsize / 8;
+  if ((dWav->translatedFormatTag != DR_WAVE_FORMAT_PCM &&
+       dWav->translatedFormatTag != DR_WAVE_FORMAT_IEEE_FLOAT) ||
+      info_.bitsize % 8 != 0 || dWav->fmt.blockAlign != frame_byte)
+    return 0;
+
+  // data chunk must be inside of memory and aligned to sample type.
+  const drwav__memory_stream &ms = dWav->memoryStream;
+  const uint64_t framecount = std::min<uint64_t>(dWav->totalPCMFrameCount,
+                                                 dWav->dataChunkDataSize / frame_byte);
+  if (!ms.data || framecount == 0 ||
+      dWav->dataChunkDataPos + framecount * frame_byte > ms.dataSize ||
+      (uintptr_t)(ms.data + dWav->dataChunkDataPos) % align != 0)
+    return 0;
+
+  *p = (const char*)ms.data + dWav->dataChunkDataPos;
+  return (uint32_t)framecount;
 }
 
 // @DEPRECIATED
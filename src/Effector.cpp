@@ -4,9 +4,7 @@
 #include <memory.h>
 #include <algorithm>
 #include <math.h>
-
-#ifndef _M_IX86_FP
-#endif
+#include <limits>
 
 #if defined(__SSE__) || defined(_M_IX86_FP) || defined(_M_X64)
 #define USE_SSE
@@ -15,6 +13,7 @@
 #endif
 
 #include <xmmintrin.h>
+#include <emmintrin.h>
 
 namespace rmixer
 {
@@ -30,250 +29,138 @@ constexpr int kSOLASegmentFrameCount = 2048;
  * \warn  Should be multiply of 8 */
 constexpr int kSOLAOverlapFrameCount = 32;
 
+/* Range of frames to search the best overlapping position,
+ * centered at the position expected by time. */
+constexpr int kSOLASearchFrameCount = 512;
+
+/* Frame step of coarse search. Fine search is done around the best
+ * coarse position with step 1. */
+constexpr int kSOLASearchDecimation = 8;
+
 
 /* Enable SOLA overlapping method for high quality tempo resampling */
 #define SEARCH_SOLA
 
-//#define SEARCH_SOLA_SSE
-
-/** calcCrossCorr code is from SoundTouch audio processing library */
-
-////////////////////////////////////////////////////////////////////////////////
-//
-// License :
-//
-//  SoundTouch audio processing library
-//  Copyright (c) Olli Parviainen
-//
-//  This library is free software; you can redistribute it and/or
-//  modify it under the terms of the GNU Lesser General Public
-//  License as published by the Free Software Foundation; either
-//  version 2.1 of the License, or (at your option) any later version.
-//
-//  This library is distributed in the hope that it will be useful,
-//  but WITHOUT ANY WARRANTY; without even the implied warranty of
-//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-//  Lesser General Public License for more details.
-//
-//  You should have received a copy of the GNU Lesser General Public
-//  License along with this library; if not, write to the Free Software
-//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
-//
-////////////////////////////////////////////////////////////////////////////////
+/**
+ * Cross correlation between reference and compare window.
+ * Returns correlation normalized by the energy of compare window,
+ * so the result is comparable between compare windows.
+ * @param samplecount   sample count (not frame count) of each window
+ */
 
 template <typename T>
-double calcCrossCorr_SSE(const T *pV1, const T *pV2, double &anorm, int channels)
+double CalcCrossCorr(const T *ref, const T *cmp, size_t samplecount)
 {
-  int i;
-  const float *pVec1;
-  const __m128 *pVec2;
-  __m128 vSum, vNorm;
-  const size_t samplebytesize = sizeof(T);
-
-  // Note. It means a major slow-down if the routine needs to tolerate 
-  // unaligned __m128 memory accesses. It's way faster if we can skip 
-  // unaligned slots and use _mm_load_ps instruction instead of _mm_loadu_ps.
-  // This can mean up to ~ 10-fold difference (incl. part of which is
-  // due to skipping every second round for stereo sound though).
-  //
-  // Compile-time define SOUNDTOUCH_ALLOW_NONEXACT_SIMD_OPTIMIZATION is provided
-  // for choosing if this little cheating is allowed.
-
-#ifdef SOUNDTOUCH_ALLOW_NONEXACT_SIMD_OPTIMIZATION
-  // Little cheating allowed, return valid correlation only for 
-  // aligned locations, meaning every second round for stereo sound.
-
-#define _MM_LOAD    _mm_load_ps
-
-  if (((ulongptr)pV1) & 15) return -1e50;    // skip unaligned locations
-
-#else
-  // No cheating allowed, use unaligned load & take the resulting
-  // performance hit.
-#define _MM_LOAD    _mm_loadu_ps
-#endif 
-
-  // ensure overlapLength is divisible by 8
-  static_assert(kSOLAOverlapFrameCount % 8 == 0,
-    "Overlap byte size must be divisible by 8.");
-
-  // Calculates the cross-correlation value between 'pV1' and 'pV2' vectors
-  // Note: pV2 _must_ be aligned to 16-bit boundary, pV1 need not.
-  pVec1 = (const float*)pV1;
-  pVec2 = (const __m128*)pV2;
-  vSum = vNorm = _mm_setzero_ps();
-
-  // Unroll the loop by factor of 4 * 4 operations. Use same routine for
-  // stereo & mono, for mono it just means twice the amount of unrolling.
-  for (i = 0; i < channels * kSOLAOverlapFrameCount * samplebytesize / 16; i++)
-  {
-    __m128 vTemp;
-    // vSum += pV1[0..3] * pV2[0..3]
-    vTemp = _MM_LOAD(pVec1);
-    vSum = _mm_add_ps(vSum, _mm_mul_ps(vTemp, pVec2[0]));
-    vNorm = _mm_add_ps(vNorm, _mm_mul_ps(vTemp, vTemp));
-
-    // vSum += pV1[4..7] * pV2[4..7]
-    vTemp = _MM_LOAD(pVec1 + 4);
-    vSum = _mm_add_ps(vSum, _mm_mul_ps(vTemp, pVec2[1]));
-    vNorm = _mm_add_ps(vNorm, _mm_mul_ps(vTemp, vTemp));
-
-    // vSum += pV1[8..11] * pV2[8..11]
-    vTemp = _MM_LOAD(pVec1 + 8);
-    vSum = _mm_add_ps(vSum, _mm_mul_ps(vTemp, pVec2[2]));
-    vNorm = _mm_add_ps(vNorm, _mm_mul_ps(vTemp, vTemp));
-
-    // vSum += pV1[12..15] * pV2[12..15]
-    vTemp = _MM_LOAD(pVec1 + 12);
-    vSum = _mm_add_ps(vSum, _mm_mul_ps(vTemp, pVec2[3]));
-    vNorm = _mm_add_ps(vNorm, _mm_mul_ps(vTemp, vTemp));
-
-    pVec1 += 16;
-    pVec2 += 4;
-  }
-
-  // return value = vSum[0] + vSum[1] + vSum[2] + vSum[3]
-  float *pvNorm = (float*)&vNorm;
-  float norm = (pvNorm[0] + pvNorm[1] + pvNorm[2] + pvNorm[3]);
-  anorm = norm;
-
-  float *pvSum = (float*)&vSum;
-  return (double)(pvSum[0] + pvSum[1] + pvSum[2] + pvSum[3]) / sqrt(norm < 1e-9 ? 1.0 : norm);
-
-  /* This is approximately corresponding routine in C-language yet without normalization:
-  double corr, norm;
-  uint i;
-
-  // Calculates the cross-correlation value between 'pV1' and 'pV2' vectors
-  corr = norm = 0.0;
-  for (i = 0; i < channels * overlapLength / 16; i ++)
-  {
-      corr += pV1[0] * pV2[0] +
-              pV1[1] * pV2[1] +
-              pV1[2] * pV2[2] +
-              pV1[3] * pV2[3] +
-              pV1[4] * pV2[4] +
-              pV1[5] * pV2[5] +
-              pV1[6] * pV2[6] +
-              pV1[7] * pV2[7] +
-              pV1[8] * pV2[8] +
-              pV1[9] * pV2[9] +
-              pV1[10] * pV2[10] +
-              pV1[11] * pV2[11] +
-              pV1[12] * pV2[12] +
-              pV1[13] * pV2[13] +
-              pV1[14] * pV2[14] +
-              pV1[15] * pV2[15];
-
-  for (j = 0; j < 15; j ++) norm += pV1[j] * pV1[j];
-
-      pV1 += 16;
-      pV2 += 16;
-  }
-  return corr / sqrt(norm);
-  */
+  double corr = 0, norm = 0;
+  for (size_t i = 0; i < samplecount; ++i)
+  {
+    corr += (double)ref[i] * cmp[i];
+    norm += (double)cmp[i] * cmp[i];
+  }
+  return corr / sqrt(norm < 1e-9 ? 1.0 : norm);
 }
 
-template <typename T>
-double calcCrossCorrAccumulate_SSE(const T *pV1, const T *pV2, double &norm, int channels)
+static inline float HorizontalSum(__m128 v)
 {
-  // call usual calcCrossCorr function because SSE does not show big benefit of 
-  // accumulating "norm" value, and also the "norm" rolling algorithm would get 
-  // complicated due to SSE-specific alignment-vs-nonexact correlation rules.
-  return calcCrossCorr_SSE(pV1, pV2, norm, channels);
+  __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
 }
 
-// just a constant to prevent integer overflow...
-constexpr int overlapDividerBitsNorm = 2;
-
-template <typename T> T overlapDivide(T v);
-template <> int8_t overlapDivide(int8_t v) { return v; }
-template <> int16_t overlapDivide(int16_t v) { return v; }
-template <> int32_t overlapDivide(int32_t v) { return v >> overlapDividerBitsNorm; }
-template <> uint8_t overlapDivide(uint8_t v) { return v; }
-template <> uint16_t overlapDivide(uint16_t v) { return v; }
-template <> uint32_t overlapDivide(uint32_t v) { return v >> overlapDividerBitsNorm; }
-template <> float overlapDivide(float v) { return v * 1024; }
-template <> double overlapDivide(double v) { return v * 1024; }
-
-template <typename T>
-double calcCrossCorr_BASIC(const T *mixingPos, const T *compare, double &norm, int channels)
+static double CalcCrossCorr(const int16_t *ref, const int16_t *cmp, size_t samplecount)
 {
-  long corr;
-  unsigned long lnorm;
-  int i;
-
-  corr = lnorm = 0;
-
-  // only will support unrolling method
-  RMIXER_ASSERT(channels * kSOLAOverlapFrameCount % 4 == 0);
-
-  // Same routine for stereo and mono. For stereo, unroll loop for better
-  // efficiency and gives slightly better resolution against rounding. 
-  // For mono it same routine, just  unrolls loop by factor of 4
-  for (i = 0; i < channels * kSOLAOverlapFrameCount; i += 4)
+  size_t i = 0;
+  __m128 vcorr = _mm_setzero_ps(), vnorm = _mm_setzero_ps();
+  if (Sound::is_simd_enabled())
   {
-    corr += (long)overlapDivide((mixingPos[i] * compare[i] +
-      mixingPos[i + 1] * compare[i + 1]));    // notice: do intermediate division here to avoid integer overflow
-    corr += (long)overlapDivide((mixingPos[i + 2] * compare[i + 2] +
-      mixingPos[i + 3] * compare[i + 3]));
-    lnorm += (unsigned long)overlapDivide((mixingPos[i] * mixingPos[i] +
-      mixingPos[i + 1] * mixingPos[i + 1]));  // notice: do intermediate division here to avoid integer overflow
-    lnorm += (unsigned long)overlapDivide((mixingPos[i + 2] * mixingPos[i + 2] +
-      mixingPos[i + 3] * mixingPos[i + 3]));
+    for (; i + 8 <= samplecount; i += 8)
+    {
+      __m128i a = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(ref + i)), 1);
+      __m128i b = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(cmp + i)), 1);
+      vcorr = _mm_add_ps(vcorr, _mm_cvtepi32_ps(_mm_madd_epi16(a, b)));
+      vnorm = _mm_add_ps(vnorm, _mm_cvtepi32_ps(_mm_madd_epi16(b, b)));
+    }
   }
-
-  // Normalize result by dividing by sqrt(norm) - this step is easiest 
-  // done using floating point operation
-  norm = (double)lnorm;
-  return (double)corr / sqrt((norm < 1e-9) ? 1.0 : norm);
+  double corr = HorizontalSum(vcorr);
+  double norm = HorizontalSum(vnorm);
+  for (; i < samplecount; ++i)
+  {
+    corr += (double)(ref[i] >> 1) * (cmp[i] >> 1);
+    norm += (double)(cmp[i] >> 1) * (cmp[i] >> 1);
+  }
+  return corr / sqrt(norm < 1e-9 ? 1.0 : norm);
 }
 
-template <typename T>
-double calcCrossCorrAccumulate_BASIC(const T *mixingPos, const T *compare, double &norm, int channels)
+static double CalcCrossCorr(const float *ref, const float *cmp, size_t samplecount)
 {
-  long corr;
-  unsigned long lnorm;
-  int i;
-
-  // cancel first normalizer tap from previous round
-  lnorm = 0;
-  for (i = 1; i <= channels; i++)
+  size_t i = 0;
+  __m128 vcorr = _mm_setzero_ps(), vnorm = _mm_setzero_ps();
+  if (Sound::is_simd_enabled())
   {
-    lnorm -= (unsigned long)overlapDivide((mixingPos[-i] * mixingPos[-i]));
+    for (; i + 4 <= samplecount; i += 4)
+    {
+      __m128 a = _mm_loadu_ps(ref + i);
+      __m128 b = _mm_loadu_ps(cmp + i);
+      vcorr = _mm_add_ps(vcorr, _mm_mul_ps(a, b));
+      vnorm = _mm_add_ps(vnorm, _mm_mul_ps(b, b));
+    }
   }
-
-  corr = 0;
-  // Same routine for stereo and mono. For stereo, unroll loop for better
-  // efficiency and gives slightly better resolution against rounding. 
-  // For mono it same routine, just  unrolls loop by factor of 4
-  for (i = 0; i < channels * kSOLAOverlapFrameCount; i += 4)
+  double corr = HorizontalSum(vcorr);
+  double norm = HorizontalSum(vnorm);
+  for (; i < samplecount; ++i)
   {
-    corr += (long)overlapDivide((mixingPos[i] * compare[i] +
-      mixingPos[i + 1] * compare[i + 1]));  // notice: do intermediate division here to avoid integer overflow
-    corr += (long)overlapDivide((mixingPos[i + 2] * compare[i + 2] +
-      mixingPos[i + 3] * compare[i + 3]));
+    corr += (double)ref[i] * cmp[i];
+    norm += (double)cmp[i] * cmp[i];
   }
+  return corr / sqrt(norm < 1e-9 ? 1.0 : norm);
+}
 
-  // update normalizer with last samples of this round
-  for (int j = 0; j < channels; j++)
+/**
+ * @brief search best overlapping position using coarse-to-fine method.
+ * @param ref         reference window (previous segment's tail)
+ * @param src         source buffer
+ * @param search_begin  first candidate frame position
+ * @param search_end    last candidate frame position (inclusive)
+ * @return best frame position
+ */
+template <typename T>
+size_t SearchBestOverlapPosition(const T *ref, const T *src, size_t channelcount,
+                                 size_t search_begin, size_t search_end)
+{
+  const size_t samplecount = kSOLAOverlapFrameCount * channelcount;
+  size_t best_pos = search_begin;
+  double best_corr = -1e50;
+
+  // coarse search
+  for (size_t pos = search_begin; pos <= search_end; pos += kSOLASearchDecimation)
   {
-    i--;
-    lnorm += (unsigned long)overlapDivide((mixingPos[i] * mixingPos[i]));
+    double corr = CalcCrossCorr(ref, src + pos * channelcount, samplecount);
+    if (corr > best_corr)
+    {
+      best_corr = corr;
+      best_pos = pos;
+    }
   }
 
-  norm += (double)lnorm;
+  // fine search around coarse result
+  const size_t fine_begin = best_pos > search_begin + kSOLASearchDecimation
+    ? best_pos - kSOLASearchDecimation + 1 : search_begin;
+  const size_t fine_end = std::min(best_pos + kSOLASearchDecimation - 1, search_end);
+  const size_t coarse_pos = best_pos;
+  for (size_t pos = fine_begin; pos <= fine_end; ++pos)
+  {
+    if (pos == coarse_pos) continue;
+    double corr = CalcCrossCorr(ref, src + pos * channelcount, samplecount);
+    if (corr > best_corr)
+    {
+      best_corr = corr;
+      best_pos = pos;
+    }
+  }
 
-  // Normalize result by dividing by sqrt(norm) - this step is easiest 
-  // done using floating point operation
-  return (double)corr / sqrt((norm < 1e-9) ? 1.0 : norm);
+  return best_pos;
 }
 
-#define calcCrossCorr calcCrossCorr_BASIC
-#define calcCrossCorrAccumulate calcCrossCorrAccumulate_BASIC
-
-/** calcCrossCorr code region end */
-
 #ifdef USE_SSE
 template <typename T>
 void Resample_Tempo_Mix_LinearInterpolate(T* dst, const T* src, size_t size, size_t channelcount, bool x)
@@ -305,6 +192,7 @@ size_t Resample_Tempo(T **dst, const T *src, const SoundInfo &info, size_t src_f
   size_t channelcount = info.channels;
   size_t src_expected_pos = 0;  // mixing src frame which is expected by time position
   size_t src_opt_pos = 0;       // mixing src frame which is most desired, smiliar wave form.
+  size_t src_tail_pos = 0;      // src frame which follows previous segment
   const size_t new_alloc_mem_size = sizeof(T) * new_framecount * channelcount;
   const T* orgsrc = src;
   T* orgdst = *dst = (T*)malloc(new_alloc_mem_size);
@@ -341,23 +229,22 @@ size_t Resample_Tempo(T **dst, const T *src, const SoundInfo &info, size_t src_f
     if (do_beginmix)
     {
 #ifdef SEARCH_SOLA
-      psrc = orgsrc + (src_expected_pos - kSOLAOverlapFrameCount) * channelcount;
-      if (psrc < orgsrc) psrc = orgsrc;
-      pdst = orgdst + current_frame * channelcount;
-      double norm;  // normalizer calculate for cross correlation
-      double corr;  // current corr
-      double bestCorr = calcCrossCorr(psrc, pdst, norm, channelcount);
-      int bestOffs = 0;
-      for (int i = 1; i < kSOLAOverlapFrameCount; ++i)
+      // compare with the source continuation of previous segment,
+      // which is faded out at the ending interpolation.
+      src_opt_pos = src_expected_pos;
+      if (src_framecount >= copytotalframesize &&
+          src_tail_pos + kSOLAOverlapFrameCount <= src_framecount)
       {
-        corr = calcCrossCorrAccumulate(psrc + i * channelcount, pdst + i * channelcount, norm, channelcount);
-        if (corr > bestCorr)
+        const size_t search_begin = src_expected_pos > kSOLASearchFrameCount / 2 ?
+          src_expected_pos - kSOLASearchFrameCount / 2 : 0;
+        const size_t search_end = std::min(src_expected_pos + kSOLASearchFrameCount / 2,
+          src_framecount - copytotalframesize);
+        if (search_begin <= search_end)
         {
-          bestCorr = corr;
-          bestOffs = i;
+          src_opt_pos = SearchBestOverlapPosition(orgsrc + src_tail_pos * channelcount,
+            orgsrc, channelcount, search_begin, search_end);
         }
       }
-      src_opt_pos = src_expected_pos + bestOffs;
 #else
       // don't search optimal pos ...
       src_opt_pos = src_expected_pos;
@@ -389,6 +276,8 @@ size_t Resample_Tempo(T **dst, const T *src, const SoundInfo &info, size_t src_f
       Resample_Tempo_Mix_LinearInterpolate(pdst, psrc, kSOLAOverlapFrameCount, channelcount, 1);
     }
 
+    src_tail_pos = src_opt_pos + do_beginmix * kSOLAOverlapFrameCount + copyframesize;
+
     /* update next frame position (up to ending interpolate) */
     current_frame += copytotalframesize - kSOLAOverlapFrameCount * do_endingmix;
   }
@@ -515,8 +404,10 @@ size_t Resample_Pitch(T **dst, const T *src, const SoundInfo& info, size_t frame
         a = 1 / (1 + exp(a - 0.5));
 #endif
         double b = 1.0 - a;
+        // last frames may be interpolated with frame past the end.
+        const size_t idx2 = std::min(idx + 1, frame_size_src - 1);
         double v = ip_y(ip_x((double)src[idx]) * b +
-                        ip_x((double)src[idx + 1]) * a);
+                        ip_x((double)src[idx2]) * a);
         (*dst)[id] = (T)v;
       }
       (*dst)[id] = src[frame_size_src - 1];
@@ -532,11 +423,12 @@ size_t Resample_Pitch(T **dst, const T *src, const SoundInfo& info, size_t frame
         a = 1 / (1 + exp(2 * (a - 0.5)));
 #endif
         double b = 1.0 - a;
+        const size_t idx2 = std::min(idx + 1, frame_size_src - 1);
         for (size_t ch = 0; ch < ch_cnt; ++ch)
         {
           const double v = ip_y(
             ip_x((double)src[idx * ch_cnt + ch]) * b +
-            ip_x((double)src[idx * ch_cnt + ch_cnt + ch]) * a);
+            ip_x((double)src[idx2 * ch_cnt + ch]) * a);
           (*dst)[id * ch_cnt + ch] = (T)v;
         }
       }
@@ -811,4 +703,421 @@ bool Effector::Resample(Sound &newsound)
   return true;
 }
 
+// ------------------------------ class StreamEffector
+
+template <typename T>
+struct StreamSampleTraits
+{
+  // signed integer types
+  static constexpr double kScale = (double)std::numeric_limits<T>::max() + 1.0;
+  static float to_float(T v) { return static_cast<float>(v / kScale); }
+  static T from_float(float v)
+  {
+    double r = v * kScale;
+    if (r >= kScale - 1) return std::numeric_limits<T>::max();
+    if (r <= -kScale) return std::numeric_limits<T>::min();
+    return static_cast<T>(r);
+  }
+};
+
+template <typename T>
+struct StreamUnsignedSampleTraits
+{
+  static constexpr double kScale = (double)(std::numeric_limits<T>::max() / 2) + 1.0;
+  static float to_float(T v) { return static_cast<float>((v - kScale) / kScale); }
+  static T from_float(float v)
+  {
+    double r = v * kScale + kScale;
+    if (r >= kScale * 2 - 1) return std::numeric_limits<T>::max();
+    if (r <= 0) return 0;
+    return static_cast<T>(r);
+  }
+};
+
+template <> struct StreamSampleTraits<uint8_t> : StreamUnsignedSampleTraits<uint8_t> {};
+template <> struct StreamSampleTraits<uint16_t> : StreamUnsignedSampleTraits<uint16_t> {};
+template <> struct StreamSampleTraits<uint32_t> : StreamUnsignedSampleTraits<uint32_t> {};
+
+template <> struct StreamSampleTraits<float>
+{
+  static float to_float(float v) { return v; }
+  static float from_float(float v) { return v; }
+};
+
+template <> struct StreamSampleTraits<double>
+{
+  static float to_float(double v) { return static_cast<float>(v); }
+  static double from_float(float v) { return v; }
+};
+
+template <typename T>
+void StreamToFloat(float *dst, const T *src, size_t samplecount)
+{
+  for (size_t i = 0; i < samplecount; ++i)
+    dst[i] = StreamSampleTraits<T>::to_float(src[i]);
+}
+
+template <typename T>
+void StreamFromFloat(T *dst, const float *src, size_t samplecount, float volume, bool mix)
+{
+  if (mix)
+  {
+    for (size_t i = 0; i < samplecount; ++i)
+      dst[i] = StreamSampleTraits<T>::from_float(
+        StreamSampleTraits<T>::to_float(dst[i]) + src[i] * volume);
+  }
+  else
+  {
+    for (size_t i = 0; i < samplecount; ++i)
+      dst[i] = StreamSampleTraits<T>::from_float(src[i] * volume);
+  }
+}
+
+StreamEffector::StreamEffector()
+  : tempo_(1.0), pitch_(1.0), volume_(1.0), flushed_(false),
+    input_pos_(0), stage_pos_(0), has_tail_(false), output_pos_(0) {}
+
+StreamEffector::StreamEffector(const SoundInfo &info) : StreamEffector()
+{
+  SetSoundInfo(info);
+}
+
+void StreamEffector::SetSoundInfo(const SoundInfo &info)
+{
+  info_ = info;
+  Clear();
+}
+
+const SoundInfo &StreamEffector::get_soundinfo() const
+{
+  return info_;
+}
+
+void StreamEffector::SetTempo(double tempo)
+{
+  RMIXER_ASSERT(tempo > 0);
+  tempo_ = tempo;
+}
+
+void StreamEffector::SetPitch(double pitch)
+{
+  RMIXER_ASSERT(pitch > 0);
+  pitch_ = pitch;
+}
+
+void StreamEffector::SetPitchConsistTempo(double length)
+{
+  SetTempo(length);
+  SetPitch(length);
+}
+
+void StreamEffector::SetVolume(double volume)
+{
+  volume_ = volume;
+}
+
+void StreamEffector::Push(const int8_t *p, size_t frame_count)
+{
+  RMIXER_ASSERT(!flushed_);
+  const size_t samplecount = frame_count * info_.channels;
+  const size_t offset = input_.size();
+  input_.resize(offset + samplecount);
+  float *dst = input_.data() + offset;
+
+  if (info_.is_signed == 0)
+  {
+    switch (info_.bitsize)
+    {
+    case 8:
+      StreamToFloat(dst, (const uint8_t*)p, samplecount);
+      break;
+    case 16:
+      StreamToFloat(dst, (const uint16_t*)p, samplecount);
+      break;
+    case 32:
+      StreamToFloat(dst, (const uint32_t*)p, samplecount);
+      break;
+    default:
+      RMIXER_THROW("Unsupported sound format for StreamEffector");
+    }
+  }
+  else if (info_.is_signed == 1)
+  {
+    switch (info_.bitsize)
+    {
+    case 8:
+      StreamToFloat(dst, (const int8_t*)p, samplecount);
+      break;
+    case 16:
+      StreamToFloat(dst, (const int16_t*)p, samplecount);
+      break;
+    case 32:
+      StreamToFloat(dst, (const int32_t*)p, samplecount);
+      break;
+    default:
+      RMIXER_THROW("Unsupported sound format for StreamEffector");
+    }
+  }
+  else if (info_.is_signed == 2)
+  {
+    switch (info_.bitsize)
+    {
+    case 32:
+      StreamToFloat(dst, (const float*)p, samplecount);
+      break;
+    case 64:
+      StreamToFloat(dst, (const double*)p, samplecount);
+      break;
+    default:
+      RMIXER_THROW("Unsupported sound format for StreamEffector");
+    }
+  }
+  else RMIXER_THROW("Unsupported sound format for StreamEffector");
+
+  ProcessPitch();
+}
+
+void StreamEffector::Flush()
+{
+  if (flushed_) return;
+  flushed_ = true;
+  ProcessPitch();
+}
+
+void StreamEffector::ProcessPitch()
+{
+  const size_t channelcount = info_.channels;
+  if (pitch_ == 1.0)
+  {
+    // no pitch resampling; pass whole input to next stage
+    stage_.insert(stage_.end(), input_.begin(), input_.end());
+    input_.clear();
+  }
+  else
+  {
+    // linear interpolation, keeping fractional read position between calls.
+    // last frame is interpolated with silence when flushed.
+    const size_t framecount = input_.size() / channelcount;
+    const size_t readable = flushed_ ? framecount : (framecount > 0 ? framecount - 1 : 0);
+    size_t idx;
+    while ((idx = static_cast<size_t>(input_pos_)) < readable)
+    {
+      const float a = static_cast<float>(input_pos_ - idx);
+      const float *p0 = input_.data() + idx * channelcount;
+      const float *p1 = p0 + channelcount;
+      const bool has_next = idx + 1 < framecount;
+      for (size_t c = 0; c < channelcount; ++c)
+        stage_.push_back(p0[c] * (1.0f - a) + (has_next ? p1[c] * a : 0.0f));
+      input_pos_ += pitch_;
+    }
+    const size_t consumed = std::min(static_cast<size_t>(input_pos_), framecount);
+    input_.erase(input_.begin(), input_.begin() + consumed * channelcount);
+    input_pos_ -= consumed;
+  }
+
+  ProcessTempo();
+}
+
+void StreamEffector::ProcessTempo()
+{
+  const size_t channelcount = info_.channels;
+  if (tempo_ == 1.0)
+  {
+    AppendOutput(stage_.data(), stage_.size());
+    stage_.clear();
+    return;
+  }
+
+  // SOLA: each step outputs (segment - overlap) frames, and
+  // advances source position by (segment - overlap) / length frames.
+  const size_t out_framecount = kSOLASegmentFrameCount - kSOLAOverlapFrameCount;
+  const double src_hop = out_framecount / tempo_;
+  const size_t search_half = kSOLASearchFrameCount / 2;
+  for (;;)
+  {
+    const size_t avail = stage_.size() / channelcount;
+    const size_t expected = static_cast<size_t>(stage_pos_);
+    const size_t search_begin = has_tail_ && expected > search_half ?
+      expected - search_half : expected;
+    size_t search_end = has_tail_ ? expected + search_half : expected;
+
+    if (avail < search_end + kSOLASegmentFrameCount)
+    {
+      if (!flushed_) break;
+      if (avail < search_begin + kSOLASegmentFrameCount)
+      {
+        // end of stream: fade in remaining frames and finish.
+        const float *src = stage_.data() + std::min(expected, avail) * channelcount;
+        size_t remain = avail > expected ? (avail - expected) * channelcount : 0;
+        if (has_tail_)
+        {
+          const size_t fade = std::min(remain, tail_.size());
+          for (size_t i = 0; i < fade; ++i)
+          {
+            const float a = (float)(i / channelcount + 1) / (kSOLAOverlapFrameCount + 1);
+            tail_[i] = tail_[i] * (1.0f - a) + src[i] * a;
+          }
+          AppendOutput(tail_.data(), tail_.size());
+          src += fade;
+          remain -= fade;
+        }
+        AppendOutput(src, remain);
+        stage_.clear();
+        tail_.clear();
+        has_tail_ = false;
+        stage_pos_ = 0;
+        break;
+      }
+      search_end = avail - kSOLASegmentFrameCount;
+    }
+
+    const size_t opt_pos = has_tail_ ?
+      SearchBestOverlapPosition(tail_.data(), stage_.data(), channelcount, search_begin, search_end) :
+      expected;
+    const float *src = stage_.data() + opt_pos * channelcount;
+
+    const size_t out_offset = output_.size();
+    output_.resize(out_offset + out_framecount * channelcount);
+    float *dst = output_.data() + out_offset;
+    size_t i = 0;
+    if (has_tail_)
+    {
+      for (; i < kSOLAOverlapFrameCount * channelcount; ++i)
+      {
+        const float a = (float)(i / channelcount + 1) / (kSOLAOverlapFrameCount + 1);
+        dst[i] = tail_[i] * (1.0f - a) + src[i] * a;
+      }
+    }
+    memcpy(dst + i, src + i, sizeof(float) * (out_framecount * channelcount - i));
+    tail_.assign(src + out_framecount * channelcount,
+                 src + (out_framecount + kSOLAOverlapFrameCount) * channelcount);
+    has_tail_ = true;
+
+    // drop frames which won't be searched anymore
+    stage_pos_ += src_hop;
+    size_t drop = static_cast<size_t>(stage_pos_);
+    drop = std::min(drop > search_half ? drop - search_half : 0, avail);
+    stage_.erase(stage_.begin(), stage_.begin() + drop * channelcount);
+    stage_pos_ -= drop;
+  }
+}
+
+void StreamEffector::AppendOutput(const float *p, size_t samplecount)
+{
+  if (output_pos_ > 0 && output_pos_ == output_.size())
+  {
+    output_.clear();
+    output_pos_ = 0;
+  }
+  output_.insert(output_.end(), p, p + samplecount);
+}
+
+size_t StreamEffector::Pull(int8_t *out, size_t frame_count)
+{
+  return PullInternal(out, frame_count, 1.0f, false);
+}
+
+size_t StreamEffector::Mix(int8_t *out, size_t frame_count, float volume)
+{
+  return PullInternal(out, frame_count, volume, true);
+}
+
+size_t StreamEffector::PullInternal(int8_t *out, size_t frame_count, float volume, bool mix)
+{
+  frame_count = std::min(frame_count, get_output_frame_count());
+  const size_t samplecount = frame_count * info_.channels;
+  const float *src = output_.data() + output_pos_;
+  volume *= static_cast<float>(volume_);
+
+  if (info_.is_signed == 0)
+  {
+    switch (info_.bitsize)
+    {
+    case 8:
+      StreamFromFloat((uint8_t*)out, src, samplecount, volume, mix);
+      break;
+    case 16:
+      StreamFromFloat((uint16_t*)out, src, samplecount, volume, mix);
+      break;
+    case 32:
+      StreamFromFloat((uint32_t*)out, src, samplecount, volume, mix);
+      break;
+    }
+  }
+  else if (info_.is_signed == 1)
+  {
+    switch (info_.bitsize)
+    {
+    case 8:
+      StreamFromFloat((int8_t*)out, src, samplecount, volume, mix);
+      break;
+    case 16:
+      StreamFromFloat((int16_t*)out, src, samplecount, volume, mix);
+      break;
+    case 32:
+      StreamFromFloat((int32_t*)out, src, samplecount, volume, mix);
+      break;
+    }
+  }
+  else if (info_.is_signed == 2)
+  {
+    switch (info_.bitsize)
+    {
+    case 32:
+      StreamFromFloat((float*)out, src, samplecount, volume, mix);
+      break;
+    case 64:
+      StreamFromFloat((double*)out, src, samplecount, volume, mix);
+      break;
+    }
+  }
+
+  output_pos_ += samplecount;
+  if (output_pos_ == output_.size())
+  {
+    output_.clear();
+    output_pos_ = 0;
+  }
+  return frame_count;
+}
+
+void StreamEffector::Clear()
+{
+  flushed_ = false;
+  input_.clear();
+  input_pos_ = 0;
+  stage_.clear();
+  stage_pos_ = 0;
+  tail_.clear();
+  has_tail_ = false;
+  output_.clear();
+  output_pos_ = 0;
+}
+
+size_t StreamEffector::get_output_frame_count() const
+{
+  if (info_.channels == 0) return 0;
+  return (output_.size() - output_pos_) / info_.channels;
+}
+
+bool StreamEffector::is_flushed() const
+{
+  return flushed_;
+}
+
+bool StreamEffector::is_finished() const
+{
+  return flushed_ && get_output_frame_count() == 0;
+}
+
+bool StreamEffector::is_bypass() const
+{
+  return tempo_ == 1.0 && pitch_ == 1.0 && volume_ == 1.0;
+}
+
+double StreamEffector::get_length_ratio() const
+{
+  return tempo_ / pitch_;
+}
+
 }
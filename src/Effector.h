@@ -1,15 +1,14 @@
 #ifndef RMIXER_EFFECTOR_H
 #define RMIXER_EFFECTOR_H
 
+#include "Sound.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <vector>
 
 namespace rmixer
 {
 
-class Sound;
-struct SoundInfo;
-
 class Effector
 {
 public:
@@ -28,6 +27,76 @@ private:
   double volume_;
 };
 
+/**
+ * @brief
+ * Stateful effector which processes PCM block-by-block.
+ * Push input frames and pull output frames when they are ready,
+ * so effect can be applied while playing or rendering.
+ * Pitch and tempo work same as Effector (pitch changes duration).
+ */
+class StreamEffector
+{
+public:
+  StreamEffector();
+  StreamEffector(const SoundInfo &info);
+
+  void SetSoundInfo(const SoundInfo &info);
+  const SoundInfo &get_soundinfo() const;
+  void SetTempo(double tempo);
+  void SetPitch(double pitch);
+  void SetPitchConsistTempo(double pitch);
+  void SetVolume(double volume);
+
+  /* @brief push input frames. should not be called after Flush(). */
+  void Push(const int8_t *p, size_t frame_count);
+
+  /* @brief notify end of input, so remaining frames are processed. */
+  void Flush();
+
+  /* @brief pull processed frames. returns pulled frame count. */
+  size_t Pull(int8_t *out, size_t frame_count);
+
+  /* @brief same as Pull(), but mixes into output buffer with volume. */
+  size_t Mix(int8_t *out, size_t frame_count, float volume = 1.0f);
+
+  /* @brief reset all state, except effect parameters. */
+  void Clear();
+
+  size_t get_output_frame_count() const;
+  bool is_flushed() const;
+  bool is_finished() const;
+  bool is_bypass() const;
+
+  /* @brief expected output frame count per input frame. */
+  double get_length_ratio() const;
+
+private:
+  SoundInfo info_;
+  double tempo_;
+  double pitch_;
+  double volume_;
+  bool flushed_;
+
+  /* input frames waiting for pitch resampling */
+  std::vector<float> input_;
+  double input_pos_;
+
+  /* pitch-resampled frames waiting for tempo resampling */
+  std::vector<float> stage_;
+  double stage_pos_;
+  std::vector<float> tail_;
+  bool has_tail_;
+
+  /* processed frames ready to be pulled */
+  std::vector<float> output_;
+  size_t output_pos_;
+
+  void ProcessPitch();
+  void ProcessTempo();
+  void AppendOutput(const float *p, size_t samplecount);
+  size_t PullInternal(int8_t *out, size_t frame_count, float volume, bool mix);
+};
+
 template <typename T>
 size_t Resample_Pitch(T **dst, const T *src, const SoundInfo& info, size_t frame_size_src, double pitch);
 
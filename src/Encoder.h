@@ -4,6 +4,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <stdio.h>
 #include "Sound.h"
 
 namespace rmixer
@@ -48,6 +49,52 @@ protected:
   double quality_;
 };
 
+/* buffer size of WAVWriter; PCM is written to file in this unit. */
+constexpr size_t kWAVWriteBufferSize = 4 * 1024 * 1024;
+
+/**
+ * @brief
+ * Writes WAV file block-by-block as PCM is produced.
+ * Sizes are patched when closing, and RF64 (ds64 chunk) is used instead
+ * of RIFF if file exceeds 4GB. Space for ds64 is reserved as JUNK chunk.
+ */
+class WAVWriter
+{
+public:
+  WAVWriter();
+  ~WAVWriter();
+  WAVWriter(const WAVWriter&) = delete;
+  WAVWriter& operator=(const WAVWriter&) = delete;
+
+  /* @brief add LIST/INFO subchunk written after data (e.g. IART). */
+  void AddInfo(const std::string& id, const std::string& value);
+
+  bool Open(const std::string& path, const SoundInfo& info);
+  bool Write(const void *p, size_t byte_size);
+  bool Close();
+
+  /* @brief RIFF/data size above which file is written as RF64.
+   * default is 32bit limit (4GB); smaller value is only for testing. */
+  void SetMaxRiffSize(uint64_t max_riff_size);
+
+  bool is_open() const;
+  uint64_t get_data_size() const;
+
+private:
+  FILE *fp_;
+  SoundInfo info_;
+  uint64_t data_size_;
+  uint64_t file_size_;
+  uint64_t max_riff_size_;
+  std::vector<int8_t> buffer_;
+  size_t buffer_used_;
+  bool is_failed_;
+  std::vector<std::pair<std::string, std::string> > infos_;
+
+  bool WriteRaw(const void *p, size_t byte_size);
+  bool Flush();
+};
+
 class Encoder_WAV : public Encoder
 {
 public:
@@ -64,11 +111,6 @@ public:
 private:
   int quality_level;
   SoundInfo dest_info_;
-
-  size_t current_buffer_index;
-  size_t current_buffer_offset;
-  void initbufferread();
-  long bufferread(char* pOut, size_t size);
 };
 
 class Encoder_FLAC : public Encoder
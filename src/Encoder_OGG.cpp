@@ -3,6 +3,12 @@
 #include "rparser.h"  /* for rutil module */
 #include <memory.h>
 #include <time.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 /** https://svn.xiph.org/trunk/vorbis/examples/encoder_example.c */
 
@@ -38,57 +44,178 @@ public:
 Encoder_OGG::Encoder_OGG(const Sound& sound)
   : Encoder(sound), quality_level(static_cast<int>(quality_ * 10))
 {
-  initbufferread();
 }
 
-/* shortcut encoder */
-static inline float ConvertToFloatSample(char *p, const SoundInfo &info_)
+/* sample conversion from each source format into vorbis float */
+
+template <typename T> struct VorbisSample;
+template <> struct VorbisSample<uint8_t>
+{
+  static float to(uint8_t v) { return v / 128.f - 1.0f; }
+};
+template <> struct VorbisSample<int8_t>
+{
+  static float to(int8_t v) { return v / 128.f; }
+};
+template <> struct VorbisSample<uint16_t>
+{
+  static float to(uint16_t v) { return v / 32768.f - 1.0f; }
+};
+template <> struct VorbisSample<int16_t>
+{
+  static float to(int16_t v) { return v / 32768.f; }
+};
+template <> struct VorbisSample<uint32_t>
+{
+  static float to(uint32_t v) { return (float)(v / 2147483648.0 - 1.0); }
+};
+template <> struct VorbisSample<int32_t>
+{
+  static float to(int32_t v) { return (float)(v / 2147483648.0); }
+};
+template <> struct VorbisSample<float>
 {
-  if (info_.is_signed == 0)
+  static float to(float v) { return v; }
+};
+template <> struct VorbisSample<double>
+{
+  static float to(double v) { return (float)v; }
+};
+
+typedef void (*VorbisDeinterleaveFunc)(float **pcm, const char *src, int channels, int framecount);
+
+/* @brief convert interleaved source PCM into planar float buffer of libvorbis. */
+template <typename T>
+static void DeinterleaveVorbis(float **pcm, const char *src, int channels, int framecount)
+{
+  const T *in = (const T*)src;
+  for (int i = 0; i < channels; ++i)
   {
-    switch (info_.bitsize)
+    float *mono = pcm[i];
+    const T *p = in + i;
+    for (int j = 0; j < framecount; ++j, p += channels)
+      mono[j] = VorbisSample<T>::to(*p);
+  }
+}
+
+#ifdef USE_SSE2
+/* SIMD kernels: return processed frame count (remaining frames are done by scalar loop) */
+
+/* @brief sign-extend 4 s16 samples and convert into float. */
+static inline __m128 S16ToFloat_SIMD(__m128i v)
+{
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(v, 16)), _mm_set1_ps(1.0f / 32768.f));
+}
+
+static int DeinterleaveVorbis_S16_SIMD(float **pcm, const int16_t *in, int channels, int framecount)
+{
+  int j = 0;
+  if (channels == 1)
+  {
+    float *m = pcm[0];
+    for (; j + 8 <= framecount; j += 8)
+    {
+      const __m128i v = _mm_loadu_si128((const __m128i*)(in + j));
+      _mm_storeu_ps(m + j, S16ToFloat_SIMD(_mm_unpacklo_epi16(v, v)));
+      _mm_storeu_ps(m + j + 4, S16ToFloat_SIMD(_mm_unpackhi_epi16(v, v)));
+    }
+  }
+  else if (channels == 2)
+  {
+    float *l = pcm[0], *r = pcm[1];
+    for (; j + 4 <= framecount; j += 4)
     {
-    case 8:
-      return *(uint8_t*)p / 128.f - 1.0f;
-    case 16:
-      return *(uint16_t*)p / 32768.f - 1.0f;
-    case 32:
-      return *(uint32_t*)p / 2147483647.f - 1.0f;
-    default:
-      break;
+      const __m128i v = _mm_loadu_si128((const __m128i*)(in + j * 2));
+      const __m128 a = S16ToFloat_SIMD(_mm_unpacklo_epi16(v, v));   /* L0 R0 L1 R1 */
+      const __m128 b = S16ToFloat_SIMD(_mm_unpackhi_epi16(v, v));   /* L2 R2 L3 R3 */
+      _mm_storeu_ps(l + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(r + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
     }
   }
-  else if (info_.is_signed == 1)
+  return j;
+}
+
+static int DeinterleaveVorbis_F32_SIMD(float **pcm, const float *in, int channels, int framecount)
+{
+  int j = 0;
+  if (channels == 1)
+  {
+    memcpy(pcm[0], in, framecount * sizeof(float));
+    j = framecount;
+  }
+  else if (channels == 2)
   {
-    switch (info_.bitsize)
+    float *l = pcm[0], *r = pcm[1];
+    for (; j + 4 <= framecount; j += 4)
     {
-    case 8:
-      return *(int8_t*)p / 128.f;
-    case 16:
-      return ((p[1] << 8) | (0x00ff & (int)p[0])) / 32768.f;
-    case 32:
-      return *(int32_t*)p / 2147483647.f - 1.0f;
-    default:
-      break;
+      const __m128 a = _mm_loadu_ps(in + j * 2);
+      const __m128 b = _mm_loadu_ps(in + j * 2 + 4);
+      _mm_storeu_ps(l + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(r + j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
     }
   }
-  else if (info_.is_signed == 2)
+  return j;
+}
+
+template <>
+void DeinterleaveVorbis<int16_t>(float **pcm, const char *src, int channels, int framecount)
+{
+  const int16_t *in = (const int16_t*)src;
+  int j = Sound::is_simd_enabled() ? DeinterleaveVorbis_S16_SIMD(pcm, in, channels, framecount) : 0;
+  for (; j < framecount; ++j)
+    for (int i = 0; i < channels; ++i)
+      pcm[i][j] = VorbisSample<int16_t>::to(in[j * channels + i]);
+}
+
+template <>
+void DeinterleaveVorbis<float>(float **pcm, const char *src, int channels, int framecount)
+{
+  const float *in = (const float*)src;
+  int j = Sound::is_simd_enabled() ? DeinterleaveVorbis_F32_SIMD(pcm, in, channels, framecount) : 0;
+  for (; j < framecount; ++j)
+    for (int i = 0; i < channels; ++i)
+      pcm[i][j] = in[j * channels + i];
+}
+#endif
+
+/* @brief select conversion kernel for source format. nullptr if not supported. */
+static VorbisDeinterleaveFunc GetVorbisDeinterleaveFunc(const SoundInfo &info)
+{
+  switch (info.is_signed)
   {
-    switch (info_.bitsize)
+  case 0:
+    switch (info.bitsize)
+    {
+    case 8: return &DeinterleaveVorbis<uint8_t>;
+    case 16: return &DeinterleaveVorbis<uint16_t>;
+    case 32: return &DeinterleaveVorbis<uint32_t>;
+    }
+    break;
+  case 1:
+    switch (info.bitsize)
     {
-    case 32:
-      return *(float*)p;
-    case 64:
-      return (float)*(double*)p;
-    default:
-      break;
+    case 8: return &DeinterleaveVorbis<int8_t>;
+    case 16: return &DeinterleaveVorbis<int16_t>;
+    case 32: return &DeinterleaveVorbis<int32_t>;
     }
+    break;
+  case 2:
+    switch (info.bitsize)
+    {
+    case 32: return &DeinterleaveVorbis<float>;
+    case 64: return &DeinterleaveVorbis<double>;
+    }
+    break;
   }
-  return .0f;
+  return nullptr;
 }
 
 bool Encoder_OGG::Write(const std::string& path)
 {
+  const VorbisDeinterleaveFunc deinterleave = GetVorbisDeinterleaveFunc(info_);
+  if (!deinterleave)
+    return false;
+
   FILE *fp = rutil::fopen_utf8(path.c_str(), "wb");
   if (!fp)
     return false;
@@ -105,7 +232,6 @@ bool Encoder_OGG::Write(const std::string& path)
 
   int eos = 0, ret = 0;
   const size_t byte_per_frame = info_.channels * info_.bitsize / 8;
-  const size_t byte_per_sample = info_.bitsize / 8;
 
   vorbis_info_init(&vi);
   ret = vorbis_encode_init_vbr(&vi, info_.channels, info_.rate, quality_level / 10.0f);
@@ -155,14 +281,18 @@ bool Encoder_OGG::Write(const std::string& path)
     }
   }
 
-  /* start writing samples */
-  char *readbuffer = (char*)malloc(kOggStreamBufferSize * byte_per_frame);
+  /* start writing samples, directly from source buffers */
+  size_t buffer_index = 0;
+  size_t buffer_frame = 0;
   while (!eos) {
-    long i;
-    size_t ch;
-    long bytes = bufferread(readbuffer, kOggStreamBufferSize * byte_per_frame);
+    while (buffer_index < buffers_.size() &&
+           buffer_frame >= buffers_[buffer_index].s / byte_per_frame)
+    {
+      buffer_index++;
+      buffer_frame = 0;
+    }
 
-    if (bytes == 0) {
+    if (buffer_index == buffers_.size()) {
       /* end of file.  this can be done implicitly in the mainline,
       but it's easier to see here in non-clever fashion.
       Tell the library we're at end of stream so that it can handle
@@ -172,21 +302,20 @@ bool Encoder_OGG::Write(const std::string& path)
     else {
       /* data to encode */
 
+      const auto &src = buffers_[buffer_index];
+      const int framecount = (int)std::min<size_t>(kOggStreamBufferSize,
+        src.s / byte_per_frame - buffer_frame);
+
       /* expose the buffer to submit data */
-      float **buffer = vorbis_analysis_buffer(&vd, kOggStreamBufferSize);
+      float **buffer = vorbis_analysis_buffer(&vd, framecount);
 
       /* uninterleave samples */
-      /* XXX: need to unfold code to improve performance */
-      for (i = 0; i< bytes / (int)byte_per_frame /* frame size */; i++) {
-        for (ch = 0; ch < info_.channels; ++ch)
-        {
-          char *sample_ptr = readbuffer + i * byte_per_frame + ch * byte_per_sample;
-          buffer[ch][i] = ConvertToFloatSample(sample_ptr, info_);
-        }
-      }
+      deinterleave(buffer, (const char*)src.p + buffer_frame * byte_per_frame,
+                   info_.channels, framecount);
+      buffer_frame += framecount;
 
       /* tell the library how much we actually submitted */
-      vorbis_analysis_wrote(&vd, i);
+      vorbis_analysis_wrote(&vd, framecount);
     }
 
     /* vorbis does some data preanalysis, then divides up blocks for
@@ -220,43 +349,10 @@ bool Encoder_OGG::Write(const std::string& path)
   }
 
   /* end */
-  free(readbuffer);
   fclose(fp);
   return true;
 }
 
-void Encoder_OGG::initbufferread()
-{
-  current_buffer_index = 0;
-  current_buffer_offset = 0;
-}
-
-long Encoder_OGG::bufferread(char* pOut, size_t size)
-{
-  if (current_buffer_index == buffers_.size())
-    return 0;
-
-  long readsize = 0;
-  while (size > 0 && current_buffer_index < buffers_.size())
-  {
-    size_t cpysize = buffers_[current_buffer_index].s - current_buffer_offset;
-    if (cpysize > size) cpysize = size;
-    memcpy(pOut, buffers_[current_buffer_index].p + current_buffer_offset, cpysize);
-    pOut += cpysize;
-    current_buffer_offset += cpysize;
-    size -= cpysize;
-    readsize += cpysize;
-
-    if (current_buffer_offset >= buffers_[current_buffer_index].s)
-    {
-      current_buffer_index++;
-      current_buffer_offset = 0;
-    }
-  }
-
-  return readsize;
-}
-
 bool Encoder_OGG::Write(const std::string& path, const SoundInfo &soundinfo)
 {
   bool r;
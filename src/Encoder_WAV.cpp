@@ -1,154 +1,221 @@
 #include "Encoder.h"
 #include "rparser.h"  /* for rutil module */
 #include <memory.h>
+#include <algorithm>
 
 namespace rmixer
 {
-  
-#define WAVChunkHeader \
-  uint8_t chunk_id[4]; \
-  uint32_t chunk_size;
 
-typedef struct
+/**
+ * WAV header layout written by WAVWriter.
+ * JUNK chunk has same size with ds64 chunk, so it can be replaced
+ * without moving data when file exceeds 4GB (RF64).
+ */
+constexpr size_t kWAVRiffSizeOffset = 4;
+constexpr size_t kWAVJunkOffset = 12;
+constexpr size_t kWAVJunkSize = 28;     /* riff/data size, sample count, table length */
+constexpr size_t kWAVFmtOffset = kWAVJunkOffset + 8 + kWAVJunkSize;
+constexpr size_t kWAVFmtSize = 16;
+constexpr size_t kWAVDataSizeOffset = kWAVFmtOffset + 8 + kWAVFmtSize + 4;
+constexpr size_t kWAVHeaderSize = kWAVDataSizeOffset + 4;
+constexpr uint64_t kWAVMaxRiffSize = 0xFFFFFFFFull;
+
+static void PutLE(uint8_t *p, uint64_t v, int bytes)
 {
-  WAVChunkHeader
-  uint8_t format[4];
-} WAVHeader;
+  for (int i = 0; i < bytes; ++i)
+    p[i] = (uint8_t)(v >> (i * 8));
+}
 
-typedef struct
-{
-  WAVChunkHeader
-  uint16_t audio_format;
-  uint16_t num_channels;
-  uint32_t sample_rate;         // sample_rate denotes the sampling rate.
-  uint32_t byte_rate;
-  uint16_t block_align;
-  uint16_t bits_per_sample;
-} WAVFmtChunk;
-
-typedef struct
-{
-  WAVChunkHeader
-} WAVDataChunk;
+// ------------------------------------------------------------- WAVWriter
 
-typedef struct
-{
-  WAVChunkHeader
-  uint8_t subsection_id[4];
-} WAVINFOChunk;
+WAVWriter::WAVWriter()
+  : fp_(nullptr), data_size_(0), file_size_(0), max_riff_size_(kWAVMaxRiffSize),
+    buffer_used_(0), is_failed_(false) {}
 
-typedef struct
+WAVWriter::~WAVWriter()
 {
-  WAVChunkHeader
-  uint8_t data[256];
-} WAVINFOSubChunk;
-
-struct RawChunk
-{
-  void *p;          // raw data which is going to written in WAVE file.
-  size_t chunksize; // size actually written to filestream. not written in WAVE metadata.
-};
+  Close();
+}
 
-RawChunk MakeWAVINFOSubChunk(const std::string& section_id, const std::string& data)
+void WAVWriter::AddInfo(const std::string& id, const std::string& value)
 {
-  WAVINFOSubChunk &c = *new WAVINFOSubChunk();
-  size_t datasize = data.size() + 1;
-  memset(c.data, 0, sizeof(c.data));
-  memcpy(c.chunk_id, section_id.c_str(), 4);
-  c.chunk_size = datasize;
-  memcpy((char*)c.data, data.c_str(), datasize);
-  return { &c, datasize + 8 };
+  infos_.emplace_back(id, value);
 }
 
-Encoder_WAV::Encoder_WAV(const Sound &sound) : Encoder(sound) {}
-
-bool Encoder_WAV::Write(const std::string& path)
+bool WAVWriter::Open(const std::string& path, const SoundInfo& info)
 {
-  std::vector<RawChunk> wavheaders;
-  WAVHeader h;
-  WAVFmtChunk h_fmt;
-  WAVDataChunk h_data;
-  WAVINFOChunk h_meta;
-  std::vector<RawChunk> wavinfoheaders;
-  size_t total_metadata_size = 0;
-  uint32_t file_size = 0; // file_size - 8
+  Close();
 
   /* check is format suitable */
   if (!(
-    (info_.bitsize == 8 && info_.is_signed == 0) ||
-    (info_.bitsize == 16 && info_.is_signed == 1) ||
-    (info_.bitsize == 24 && info_.is_signed == 1) ||
-    (info_.bitsize == 32 && info_.is_signed == 1) ||
-    (info_.bitsize == 32 && info_.is_signed == 2) ))
+    (info.bitsize == 8 && info.is_signed == 0) ||
+    (info.bitsize == 16 && info.is_signed == 1) ||
+    (info.bitsize == 24 && info.is_signed == 1) ||
+    (info.bitsize == 32 && info.is_signed == 1) ||
+    (info.bitsize == 32 && info.is_signed == 2) ))
     return false;
 
-  /* fill header first */
-  memcpy(h.chunk_id, "RIFF", 4);
-  h.chunk_size = 0;   // filled later
-  memcpy(h.format, "WAVE", 4);
-  wavheaders.push_back({ &h, sizeof(h) });
-
-  /* fill fmt / data section */
-  memcpy(h_fmt.chunk_id, "fmt ", 4);
-  h_fmt.chunk_size = sizeof(h_fmt) - 8;
-  h_fmt.audio_format = (info_.is_signed == 1 ? 1 : 3 /* IEEE float */);
-  h_fmt.num_channels = info_.channels;
-  h_fmt.sample_rate = info_.rate;
-  h_fmt.byte_rate = h_fmt.sample_rate * h_fmt.num_channels * info_.bitsize / 8;
-  h_fmt.block_align = h_fmt.num_channels * info_.bitsize / 8;
-  h_fmt.bits_per_sample = info_.bitsize;
-  wavheaders.push_back({ &h_fmt, sizeof(h_fmt) });
-
-  memcpy(h_data.chunk_id, "data", 4);
-  h_data.chunk_size = total_buffer_size_;
-  wavheaders.push_back({ &h_data, sizeof(h_data) });
-  for (auto &x : buffers_)
-    wavheaders.push_back({ (void*)x.p, x.s });
+  fp_ = rutil::fopen_utf8(path.c_str(), "wb");
+  if (!fp_) return false;
+  info_ = info;
+  data_size_ = 0;
+  file_size_ = 0;
+  buffer_used_ = 0;
+  is_failed_ = false;
+  buffer_.resize(kWAVWriteBufferSize);
+
+  /* sizes are filled when closing */
+  uint8_t h[kWAVHeaderSize];
+  const uint32_t block_align = info.channels * info.bitsize / 8;
+  memset(h, 0, sizeof(h));
+  memcpy(h, "RIFF", 4);
+  memcpy(h + 8, "WAVE", 4);
+  memcpy(h + kWAVJunkOffset, "JUNK", 4);
+  PutLE(h + kWAVJunkOffset + 4, kWAVJunkSize, 4);
+  uint8_t *fmt = h + kWAVFmtOffset;
+  memcpy(fmt, "fmt ", 4);
+  PutLE(fmt + 4, kWAVFmtSize, 4);
+  PutLE(fmt + 8, info.is_signed == 2 ? 3 /* IEEE float */ : 1, 2);
+  PutLE(fmt + 10, info.channels, 2);
+  PutLE(fmt + 12, info.rate, 4);
+  PutLE(fmt + 16, info.rate * block_align, 4);
+  PutLE(fmt + 20, block_align, 2);
+  PutLE(fmt + 22, info.bitsize, 2);
+  memcpy(h + kWAVDataSizeOffset - 4, "data", 4);
+  return WriteRaw(h, sizeof(h));
+}
 
-  /* fill metadata if necessary */
-  std::string metavalue;
+bool WAVWriter::Write(const void *p, size_t byte_size)
+{
+  if (!fp_ || is_failed_) return false;
+  data_size_ += byte_size;
+
+  // large block is written directly, small blocks are gathered.
+  if (buffer_used_ + byte_size > buffer_.size())
   {
-    if (GetMetadata("TITLE", metavalue))
-    {
-      auto c = MakeWAVINFOSubChunk("ISBJ", metavalue.c_str());
-      total_metadata_size += c.chunksize + 8;
-      wavinfoheaders.push_back(c);
-    }
+    if (!Flush()) return false;
+    if (byte_size >= buffer_.size())
+      return WriteRaw(p, byte_size);
   }
+  memcpy(buffer_.data() + buffer_used_, p, byte_size);
+  buffer_used_ += byte_size;
+  return true;
+}
+
+bool WAVWriter::Close()
+{
+  if (!fp_) return false;
+  Flush();
+
+  // data chunk is padded to even size.
+  const uint8_t zero = 0;
+  if (data_size_ & 1)
+    WriteRaw(&zero, 1);
+
+  // metadata as LIST/INFO chunk
+  if (!infos_.empty())
   {
-    if (GetMetadata("ARTIST", metavalue))
+    std::vector<uint8_t> list(12);
+    memcpy(list.data(), "LIST", 4);
+    memcpy(list.data() + 8, "INFO", 4);
+    for (auto &ii : infos_)
     {
-      auto c = MakeWAVINFOSubChunk("IART", metavalue.c_str());
-      total_metadata_size += c.chunksize + 8;
-      wavinfoheaders.push_back(c);
+      const size_t len = ii.second.size() + 1;
+      const size_t pos = list.size();
+      list.resize(pos + 8 + len + (len & 1), 0);
+      memcpy(list.data() + pos, ii.first.c_str(), std::min<size_t>(4, ii.first.size()));
+      PutLE(list.data() + pos + 4, len, 4);
+      memcpy(list.data() + pos + 8, ii.second.c_str(), len);
     }
+    PutLE(list.data() + 4, list.size() - 8, 4);
+    WriteRaw(list.data(), list.size());
   }
-  if (total_metadata_size > 0)
+
+  // patch sizes. use RF64 if it cannot be described by 32bit.
+  uint8_t b[kWAVJunkSize + 8];
+  const uint64_t riff_size = file_size_ - 8;
+  if (riff_size <= max_riff_size_ && data_size_ <= max_riff_size_)
   {
-    memcpy(h_meta.chunk_id, "LIST", 4);
-    h_meta.chunk_size = total_metadata_size;
-    memcpy(h_meta.subsection_id, "INFO", 4);
-    wavheaders.push_back({ &h_meta, sizeof(h_meta) });
-    for (auto& chunk : wavinfoheaders)
-      wavheaders.push_back(chunk);
+    PutLE(b, riff_size, 4);
+    is_failed_ |= fseek(fp_, kWAVRiffSizeOffset, SEEK_SET) != 0 ||
+                  fwrite(b, 1, 4, fp_) != 4;
+    PutLE(b, data_size_, 4);
+    is_failed_ |= fseek(fp_, kWAVDataSizeOffset, SEEK_SET) != 0 ||
+                  fwrite(b, 1, 4, fp_) != 4;
+  }
+  else
+  {
+    memcpy(b, "RF64", 4);
+    PutLE(b + 4, kWAVMaxRiffSize, 4);
+    is_failed_ |= fseek(fp_, 0, SEEK_SET) != 0 || fwrite(b, 1, 8, fp_) != 8;
+    memcpy(b, "ds64", 4);
+    PutLE(b + 4, kWAVJunkSize, 4);
+    PutLE(b + 8, riff_size, 8);
+    PutLE(b + 16, data_size_, 8);
+    PutLE(b + 24, data_size_ / (info_.channels * info_.bitsize / 8), 8);
+    PutLE(b + 32, 0, 4);    /* no table */
+    is_failed_ |= fseek(fp_, kWAVJunkOffset, SEEK_SET) != 0 ||
+                  fwrite(b, 1, sizeof(b), fp_) != sizeof(b);
+    PutLE(b, kWAVMaxRiffSize, 4);
+    is_failed_ |= fseek(fp_, kWAVDataSizeOffset, SEEK_SET) != 0 ||
+                  fwrite(b, 1, 4, fp_) != 4;
   }
 
-  /* calculate total file size and fill RIFF chunk size */
-  for (auto &i : wavheaders)
-    file_size += i.chunksize;
-  h.chunk_size = file_size - 8; /* self header description size */
+  is_failed_ |= fclose(fp_) != 0;
+  fp_ = nullptr;
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  return !is_failed_;
+}
 
-  FILE *fp = rutil::fopen_utf8(path.c_str(), "wb");
-  if (!fp) return false;
-  for (auto &chunk : wavheaders)
-    fwrite(chunk.p, 1, chunk.chunksize, fp);
-  fclose(fp);
+void WAVWriter::SetMaxRiffSize(uint64_t max_riff_size)
+{
+  max_riff_size_ = std::min(max_riff_size, kWAVMaxRiffSize);
+}
 
-  // cleanup
-  for (auto& chunk : wavinfoheaders)
-    free(chunk.p);
+bool WAVWriter::is_open() const { return fp_ != nullptr; }
 
-  return true;
+uint64_t WAVWriter::get_data_size() const { return data_size_; }
+
+bool WAVWriter::WriteRaw(const void *p, size_t byte_size)
+{
+  if (fwrite(p, 1, byte_size, fp_) != byte_size)
+    is_failed_ = true;
+  file_size_ += byte_size;
+  return !is_failed_;
+}
+
+bool WAVWriter::Flush()
+{
+  if (buffer_used_ == 0) return !is_failed_;
+  const size_t s = buffer_used_;
+  buffer_used_ = 0;
+  return WriteRaw(buffer_.data(), s);
+}
+
+// ----------------------------------------------------------- Encoder_WAV
+
+Encoder_WAV::Encoder_WAV(const Sound &sound) : Encoder(sound) {}
+
+bool Encoder_WAV::Write(const std::string& path)
+{
+  WAVWriter writer;
+
+  /* fill metadata if necessary */
+  std::string metavalue;
+  if (GetMetadata("TITLE", metavalue))
+    writer.AddInfo("ISBJ", metavalue);
+  if (GetMetadata("ARTIST", metavalue))
+    writer.AddInfo("IART", metavalue);
+
+  if (!writer.Open(path, info_))
+    return false;
+  for (auto &x : buffers_)
+  {
+    if (!writer.Write(x.p, x.s))
+      break;
+  }
+  return writer.Close();
 }
 
 }
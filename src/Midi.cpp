@@ -1,6 +1,7 @@
 #include "Midi.h"
 #include "Error.h"
 #include "rparser.h"  /* for rutil::fopen_utf8 */
+#include <algorithm>
 #include <iostream>
 #include <memory.h>
 
@@ -14,6 +15,9 @@
 namespace rmixer
 {
 
+static_assert(kMidiEventNoteOn == ME_NOTEON && kMidiEventNoteOff == ME_NOTEOFF,
+  "Midi event type mismatch with timidity");
+
 // -------------------------- class MidiChannel
 
 MidiChannel::MidiChannel()
@@ -62,19 +66,11 @@ void MidiChannel::SendEvent(uint8_t *e)
 
 // --------------------------------- class Midi
 
-int Midi::midi_count = 0;
-
 Midi::Midi(size_t buffer_size_in_byte, const char* midi_cfg_path)
-  : song_(0), buffer_size_(buffer_size_in_byte), nrpn_(0)
+  : config_(0), song_(0), buffer_size_(buffer_size_in_byte),
+    polyphony_(kMidiDefPolyphony), nrpn_(0)
 {
-  if (midi_count++ == 0)
-  {
-    if (!midi_cfg_path || mid_init(midi_cfg_path) != 0)
-    {
-      std::cerr << "[Midi] No Soundfont, midi sound may be muted." << std::endl;
-      mid_init_no_config();
-    }
-  }
+  LoadConfig(midi_cfg_path);
 
   for (unsigned i = 0; i < kMidiMaxChannel; ++i)
   {
@@ -86,16 +82,10 @@ Midi::Midi(size_t buffer_size_in_byte, const char* midi_cfg_path)
 }
 
 Midi::Midi(const SoundInfo& info, size_t buffer_size_in_byte, const char* midi_cfg_path)
-  : song_(0), info_(info), buffer_size_(buffer_size_in_byte), nrpn_(0)
+  : config_(0), song_(0), info_(info), buffer_size_(buffer_size_in_byte),
+    polyphony_(kMidiDefPolyphony), nrpn_(0)
 {
-  if (midi_count++ == 0)
-  {
-    if (!midi_cfg_path || mid_init(midi_cfg_path) != 0)
-    {
-      std::cerr << "[Midi] No Soundfont, midi sound may be muted." << std::endl;
-      mid_init_no_config();
-    }
-  }
+  LoadConfig(midi_cfg_path);
 
   for (unsigned i = 0; i < kMidiMaxChannel; ++i)
   {
@@ -109,8 +99,18 @@ Midi::Midi(const SoundInfo& info, size_t buffer_size_in_byte, const char* midi_c
 Midi::~Midi()
 {
   Close();
-  if (--midi_count == 0)
-    mid_exit();
+  mid_config_free(config_);
+}
+
+void Midi::LoadConfig(const char* midi_cfg_path)
+{
+  if (midi_cfg_path)
+    config_ = mid_config_load(midi_cfg_path);
+  if (!config_)
+  {
+    std::cerr << "[Midi] No Soundfont, midi sound may be muted." << std::endl;
+    config_ = mid_config_new();
+  }
 }
 
 bool Midi::LoadFile(const char* filename)
@@ -190,6 +190,19 @@ void Midi::SetVolume(float v)
   mid_song_set_volume(song_, (int)(v * 800));
 }
 
+void Midi::SetPolyphony(size_t voices)
+{
+  RMIXER_ASSERT_M(voices > 0 && voices <= MID_MAX_VOICES, "Invalid midi polyphony.");
+  polyphony_ = voices;
+  if (song_)
+    mid_song_set_polyphony(song_, (int)polyphony_);
+}
+
+size_t Midi::get_polyphony() const
+{
+  return polyphony_;
+}
+
 bool Midi::Init(const SoundInfo& info, MidIStream *stream)
 {
   info_ = info;
@@ -225,10 +238,17 @@ bool Midi::Init(MidIStream *stream)
     case 16:
       options.format = MID_AUDIO_S16;
       break;
+    case 32:
+      options.format = MID_AUDIO_S32;
+      break;
     default:
       RMIXER_THROW("Unsupported Midi bitsize.");
     }
   }
+  else if (info_.is_signed == 2 && info_.bitsize == 32)
+  {
+    options.format = MID_AUDIO_F32;
+  }
   else
   {
     RMIXER_THROW("Unsupported Midi audio type.");
@@ -238,18 +258,45 @@ bool Midi::Init(MidIStream *stream)
   options.buffer_size = buffer_size_ / (info_.bitsize / 8);
 
   if (stream)
-    song_ = mid_song_load(stream, &options);
+    song_ = mid_song_load_with_config(config_, stream, &options);
   else
-    song_ = mid_song_for_stream(&options);  // "empty midi stream" for real-time playing
+    song_ = mid_song_for_stream_with_config(config_, &options);  // "empty midi stream" for real-time playing
 
+  if (!song_)
+    return false;
+  mid_song_set_polyphony(song_, (int)polyphony_);
   mid_song_start(song_);
 
   return true;
 }
 
+void Midi::QueueEvents(const std::vector<MidiEvent>& events)
+{
+  if (!song_) return;
+
+  std::vector<MidEvent> midevents;
+  midevents.reserve(events.size());
+  for (auto &e : events)
+  {
+    MidEvent event;
+    event.time = (sint32)std::min(e.frame, (size_t)INT_MAX - 1);
+    event.channel = e.channel;
+    event.type = e.type;
+    event.a = e.a;
+    event.b = e.b;
+    midevents.push_back(event);
+  }
+  std::stable_sort(midevents.begin(), midevents.end(),
+    [](const MidEvent &a, const MidEvent &b) { return a.time < b.time; });
+
+  if (mid_song_queue_events(song_, midevents.data(), (sint32)midevents.size()) != 0)
+    RMIXER_THROW("Failed to allocate midi events.");
+}
+
 void Midi::ClearEvent()
 {
-  // clear all midi event. (TODO)
+  if (!song_) return;
+  mid_song_queue_events(song_, nullptr, 0);
 }
 
 bool Midi::IsMixFinish()
@@ -264,6 +311,12 @@ size_t Midi::GetMixedPCMData(char* outbuf, size_t size)
   return mid_song_read_wave(song_, (sint8*)outbuf, size);
 }
 
+size_t Midi::MixPCMData(char* outbuf, size_t size, float volume)
+{
+  if (!song_) return 0;
+  return mid_song_mix_wave(song_, (sint8*)outbuf, size, volume);
+}
+
 /* refer: readmidi.c : read_midi_event */
 uint8_t Midi::GetEventTypeFromStatus(uint8_t status, uint8_t &a, uint8_t &b)
 {
@@ -341,36 +394,59 @@ const SoundInfo& Midi::get_soundinfo() const
   return info_;
 }
 
+void Midi::ClearInstrumentCache()
+{
+  mid_instrument_cache_clear();
+}
+
+void Midi::EnableSIMD(bool v)
+{
+  mid_set_simd(v ? 1 : 0);
+}
 
-// ---------------------------- class MidiSound
 
-constexpr size_t kDefaultMidiSoundBuffer = 65536;
+// ---------------------------- class MidiSound
 
 MidiSound::MidiSound(const SoundInfo& info, Midi *midi)
-  : Sound(info, kDefaultMidiSoundBuffer), midi_(midi), actual_buffer_size_(kDefaultMidiSoundBuffer)
+  : Sound(info, rmixer::GetByteFromFrame(1, info)), midi_(midi),
+    actual_buffer_size_(rmixer::GetByteFromFrame(1, info))
 {
+  /* buffer is allocated on demand, only if format conversion is necessary. */
   is_streaming_ = true;
 }
 
 size_t MidiSound::Mix(int8_t *copy_to, size_t *offset, size_t frame_len) const
 {
-  const_cast<MidiSound*>(this)->CreateMidiData(frame_len);
-  RMIXER_ASSERT(actual_buffer_size_ >= buffer_size_);
-  size_t r = Sound::Mix(copy_to, offset, frame_len);
-  *offset = 0;
-  return r;
+  return MixWithVolume(copy_to, offset, frame_len, 1.0f);
 }
 
 size_t MidiSound::MixWithVolume(int8_t *copy_to, size_t *offset, size_t frame_len, float volume) const
 {
+  *offset = 0;
+  if (is_direct_mixable())
+  {
+    midi_->MixPCMData((char*)copy_to, GetByteFromFrame(frame_len), volume);
+    return frame_len;
+  }
   const_cast<MidiSound*>(this)->CreateMidiData(frame_len);
-  size_t r = Sound::MixWithVolume(copy_to, offset, frame_len, volume);
+  size_t r = volume == 1.0f ?
+    Sound::Mix(copy_to, offset, frame_len) :
+    Sound::MixWithVolume(copy_to, offset, frame_len, volume);
   *offset = 0;
   return r;
 }
 
 size_t MidiSound::Copy(int8_t *p, size_t *offset, size_t frame_len) const
 {
+  *offset = 0;
+  if (midi_->get_soundinfo() == get_soundinfo())
+  {
+    const size_t size = GetByteFromFrame(frame_len);
+    const size_t r = midi_->GetMixedPCMData((char*)p, size);
+    if (r < size)
+      memset(p + r, 0, size - r);
+    return frame_len;
+  }
   const_cast<MidiSound*>(this)->CreateMidiData(frame_len);
   size_t r = Sound::Copy(p, offset, frame_len);
   *offset = 0;
@@ -379,12 +455,25 @@ size_t MidiSound::Copy(int8_t *p, size_t *offset, size_t frame_len) const
 
 size_t MidiSound::CopyWithVolume(int8_t *p, size_t *offset, size_t frame_len, float volume) const
 {
+  *offset = 0;
+  if (is_direct_mixable())
+  {
+    memset(p, 0, GetByteFromFrame(frame_len));
+    midi_->MixPCMData((char*)p, GetByteFromFrame(frame_len), volume);
+    return frame_len;
+  }
   const_cast<MidiSound*>(this)->CreateMidiData(frame_len);
   size_t r = Sound::CopyWithVolume(p, offset, frame_len, volume);
   *offset = 0;
   return r;
 }
 
+bool MidiSound::is_direct_mixable() const
+{
+  /* timidity can mix only into signed / float PCM of its own format. */
+  return midi_->get_soundinfo() == get_soundinfo() && get_soundinfo().is_signed != 0;
+}
+
 void MidiSound::ReallocateBufferSize(size_t req_buffer_size)
 {
   if (actual_buffer_size_ < req_buffer_size)
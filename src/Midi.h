@@ -2,19 +2,37 @@
 #define RENCODER_MIDI_H
 
 #include "Sound.h"
+#include <vector>
 
 struct _MidSong;
 typedef struct _MidSong MidSong;
 struct _MidIStream;
 typedef struct _MidIStream MidIStream;
+struct _MidConfig;
+typedef struct _MidConfig MidConfig;
 
 namespace rmixer
 {
 
 constexpr size_t kMidiDefMaxBufferByteSize = 1024 * 1024;
 constexpr size_t kMidiMaxChannel = 16;
+constexpr uint8_t kMidiEventNoteOn = 1;   /* ME_NOTEON */
+constexpr uint8_t kMidiEventNoteOff = 2;  /* ME_NOTEOFF */
+/* default polyphony; dense keysound charts easily exceed timidity's default. */
+constexpr size_t kMidiDefPolyphony = 256;
 class Midi;
 
+/* @brief midi event with frame timestamp, for offline rendering.
+ * type is timidity event type (same as Midi::SendEvent). */
+struct MidiEvent
+{
+  size_t frame;
+  uint8_t channel;
+  uint8_t type;
+  uint8_t a;
+  uint8_t b;
+};
+
 class MidiChannel
 {
 public:
@@ -60,29 +78,58 @@ public:
   void SendEvent(uint8_t channel, uint8_t type, uint8_t a, uint8_t b);
   void SetVolume(float v);
 
+  /* @brief set maximum count of simultaneously playing voices.
+   * applied immediately if song is loaded, otherwise when loaded. */
+  void SetPolyphony(size_t voices);
+  size_t get_polyphony() const;
+
+  /* @brief queue timestamped events for offline rendering.
+   * frame is offset from current playing position, and events are
+   * processed sample-accurately while GetMixedPCMData() renders.
+   * Replaces previously queued events. */
+  void QueueEvents(const std::vector<MidiEvent>& events);
+
+  /* @brief remove queued events which are not processed yet. */
   void ClearEvent();
   bool IsMixFinish();
   size_t GetMixedPCMData(char* outbuf, size_t size);
 
+  /* @brief same as GetMixedPCMData(), but adds PCM data scaled by volume
+   * into outbuf. Only signed / float output is supported; returns 0 otherwise. */
+  size_t MixPCMData(char* outbuf, size_t size, float volume);
+
   uint8_t GetEventTypeFromStatus(uint8_t status, uint8_t &a, uint8_t &b);
   const SoundInfo& get_soundinfo() const;
 
+  /* @brief release instrument patches cached across Midi instances,
+   * which are not used by any Midi instance now. */
+  static void ClearInstrumentCache();
+
+  /* @brief enable/disable SIMD rendering of timidity (see Sound::EnableSIMD). */
+  static void EnableSIMD(bool enable_simd);
+
 private:
-  static int midi_count;
+  /* soundfont configuration owned by this instance,
+   * so Midi instances can be used from different threads. */
+  MidConfig *config_;
   MidSong *song_;
   SoundInfo info_;
   size_t buffer_size_;
+  size_t polyphony_;
   uint8_t rpn_msb_[kMidiMaxChannel];
   uint8_t rpn_lsb_[kMidiMaxChannel];
   uint8_t nrpn_;
   MidiChannel ch_[kMidiMaxChannel];
 
+  void LoadConfig(const char* midi_cfg_path);
   bool Init(const SoundInfo& info, MidIStream *stream);
   bool Init(MidIStream *stream);
 };
 
 /**
  * @brief Adaptor for converting midi audio to PCM sound data.
+ * Midi audio is rendered directly into the output buffer if the format is
+ * same as midi, and the internal buffer is only used for conversion.
  * @warn  offset parameter of Mix/Copy method is always ignored and will be set to 0.
  */
 class MidiSound : public Sound
@@ -97,6 +144,7 @@ public:
 
 private:
   void ReallocateBufferSize(size_t req_buffer_size);
+  bool is_direct_mixable() const;
 
   Midi *midi_;
   size_t actual_buffer_size_;
@@ -4,6 +4,7 @@
 #include <memory.h>
 #include <string.h>
 #include <thread>
+#include <math.h>
 
 // for sending timidity event
 #include "playmidi.h"
@@ -16,8 +17,8 @@ namespace rmixer
 Channel::Channel(ChannelIndex chidx)
   : chidx_(chidx), groupidx_(0), sound_(nullptr),
     volume_(1.0f), loop_(0), is_paused_(false), is_occupied_(false),
-    frame_pos_(0), effect_length_(0), effect_remain_(0),
-    pitch_(1.0f), speed_(1.0f), reverb_(0.0f),
+    frame_pos_(0), frame_frac_(0), effect_length_(0), effect_remain_(0),
+    pitch_(1.0f), speed_(1.0f), reverb_(0.0f), key_(0), cubic_interpolation_(false),
     is_virtual_(false), sound_level_(0.0f), priority_(0) {}
 
 ChannelIndex Channel::get_channel_index() const { return chidx_; }
@@ -63,7 +64,9 @@ void Channel::Play(int loop_count)
   loop_ = loop_count;
   is_paused_ = false;
   frame_pos_ = 0;
+  frame_frac_ = 0;
   effect_length_ = effect_remain_ = 0;
+  if (effector_) effector_->Clear();
 }
 
 void Channel::Stop()
@@ -76,6 +79,53 @@ void Channel::SetFadePoint(unsigned milisecond)
   effect_length_ = effect_remain_ = milisecond;
 }
 
+void Channel::SetEffect(double pitch, double tempo)
+{
+  if (pitch == 1.0 && tempo == 1.0)
+  {
+    ClearEffect();
+    return;
+  }
+  if (!effector_) effector_.reset(new StreamEffector());
+  effector_->SetPitch(pitch);
+  effector_->SetTempo(tempo);
+  effector_->Clear();
+}
+
+void Channel::ClearEffect()
+{
+  effector_.reset();
+}
+
+void Channel::SetPitch(float pitch)
+{
+  RMIXER_ASSERT(pitch > 0);
+  pitch_ = pitch;
+}
+
+void Channel::SetSpeed(float speed)
+{
+  RMIXER_ASSERT(speed > 0);
+  speed_ = speed;
+}
+
+void Channel::SetKey(int key)
+{
+  key_ = key;
+}
+
+void Channel::SetCubicInterpolation(bool cubic)
+{
+  cubic_interpolation_ = cubic;
+}
+
+double Channel::get_playback_rate() const
+{
+  double rate = (double)pitch_ * speed_;
+  if (key_ != 0) rate *= pow(2.0, key_ / 12.0);
+  return rate;
+}
+
 /* @brief lock channel to prevent channel is occupied by other sound. */
 void Channel::LockChannel()
 {
@@ -144,6 +194,17 @@ void Channel::Mix(char *out, size_t frame_len)
     volume_final *= 1.0f - (float)effect_remain_ / effect_length_;
   }
   if (volume_final >= 1.0f) volume_final = 1.0f;
+  if (effector_ && !sound_->is_streaming())
+  {
+    MixWithEffector(out, frame_len, volume_final);
+    return;
+  }
+  const double rate = get_playback_rate();
+  if (rate != 1.0 && !sound_->is_streaming())
+  {
+    MixWithRate(out, frame_len, volume_final, rate);
+    return;
+  }
   while (mixsize < frame_len && loop_ > 0)
   {
     if (volume_final == 1.0f)
@@ -161,6 +222,77 @@ void Channel::Mix(char *out, size_t frame_len)
   }
 }
 
+/**
+ * @brief feed sound into effector and mix processed output.
+ * channel keeps playing until effector output is drained.
+ */
+void Channel::MixWithEffector(char *out, size_t frame_len, float volume)
+{
+  constexpr size_t kEffectorFeedFrame = 1024;
+  const SoundInfo &info = sound_->get_soundinfo();
+  if (!(effector_->get_soundinfo() == info))
+    effector_->SetSoundInfo(info);
+
+  size_t mixsize = 0;
+  while (mixsize < frame_len && loop_ > 0)
+  {
+    if (effector_->get_output_frame_count() > 0)
+    {
+      mixsize += effector_->Mix((int8_t*)out + sound_->GetByteFromFrame(mixsize),
+                                frame_len - mixsize, volume);
+      continue;
+    }
+    if (effector_->is_flushed())
+    {
+      loop_ = 0;
+      effector_->Clear();
+      break;
+    }
+    const size_t feedsize = std::min(kEffectorFeedFrame, sound_->get_frame_count() - frame_pos_);
+    const Sound *s = sound_;  /* read-only access; no copy for borrowed buffer */
+    if (s->is_compressed())
+    {
+      // compressed sound (up to 8 channels) is decoded to feed.
+      int8_t feed[kEffectorFeedFrame * 8 * sizeof(float)];
+      size_t pos = frame_pos_;
+      s->Copy(feed, &pos, feedsize);
+      effector_->Push(feed, feedsize);
+    }
+    else
+      effector_->Push(s->get_ptr() + s->GetByteFromFrame(frame_pos_), feedsize);
+    frame_pos_ += feedsize;
+    if (frame_pos_ >= sound_->get_frame_count())
+    {
+      frame_pos_ = 0;
+      if (loop_ > 1) loop_--;
+      else effector_->Flush();
+    }
+  }
+}
+
+/* @brief mix with playback rate, using fixed-point phase accumulator. */
+void Channel::MixWithRate(char *out, size_t frame_len, float volume, double rate)
+{
+  const uint64_t step = static_cast<uint64_t>(rate * 4294967296.0);
+  size_t mixsize = 0;
+  while (mixsize < frame_len && loop_ > 0)
+  {
+    const size_t mixed = sound_->MixWithRate((int8_t*)out + sound_->GetByteFromFrame(mixsize),
+      &frame_pos_, &frame_frac_, step, frame_len - mixsize, volume, cubic_interpolation_,
+      &rate_scratch_);
+    mixsize += mixed;
+    if (frame_pos_ >= sound_->get_frame_count())
+    {
+      loop_--;
+      frame_pos_ = 0;
+      frame_frac_ = 0;
+    }
+    // nothing mixable (e.g. unsupported format); don't spin.
+    if (mixed == 0)
+      break;
+  }
+}
+
 void Channel::UpdateBySample(size_t sample)
 {
   float sound_level = sound_->GetSoundLevel(frame_pos_, sample);
@@ -284,6 +416,8 @@ Sound* Mixer::CreateSound(const char *filepath, bool loadasync)
     channel_lock_->unlock();
   }
   s = new Sound();
+  if (cache_sound_)
+    s->SetArena(&sound_arena_);
   if (loadasync)
   {
     // create SoundLoadContext and run it from separated thread.
@@ -329,6 +463,8 @@ Sound* Mixer::CreateSound(const char *p, size_t len, const char *filename, bool
     channel_lock_->unlock();
   }
   s = new Sound();
+  if (cache_sound_)
+    s->SetArena(&sound_arena_);
   const char *ext = nullptr;
   if (filename)
   {
@@ -369,6 +505,71 @@ Sound* Mixer::CreateSound(const char *p, size_t len, const char *filename, bool
   return s;
 }
 
+void Mixer::ClearSounds()
+{
+  channel_lock_->lock();
+  std::vector<Sound*> sounds(sounds_);
+  std::sort(sounds.begin(), sounds.end());
+  for (auto *c : channels_)
+  {
+    if (std::binary_search(sounds.begin(), sounds.end(), c->sound_))
+    {
+      c->SetSound(nullptr);
+      c->UnlockChannel();
+    }
+  }
+  for (auto *s : sounds_)
+    delete s;
+  sounds_.clear();
+  sound_arena_.Clear();
+  channel_lock_->unlock();
+}
+
+Sound* Mixer::CreateSound(const char *p, size_t len, const char *filename,
+                          const std::shared_ptr<const void> &owner)
+{
+  Sound *s;
+  // search for pre-registered sound
+  if (cache_sound_ && filename != nullptr && *filename)
+  {
+    channel_lock_->lock();
+    for (auto *ss : sounds_)
+    {
+      if (strcmp(ss->name().c_str(), filename) == 0)
+      {
+        channel_lock_->unlock();
+        return ss;
+      }
+    }
+    channel_lock_->unlock();
+  }
+  s = new Sound();
+  if (cache_sound_)
+    s->SetArena(&sound_arena_);
+  const char *ext = nullptr;
+  if (filename)
+  {
+    for (const char *c = filename; *c; ++c)
+      if (*c == '.') ext = c + 1;
+  }
+  // load with mixer format, so matching PCM is not copied.
+  if (!s->Load(p, len, ext, info_, owner))
+  {
+    delete s;
+    return nullptr;
+  }
+  if (filename)
+    s->set_name(filename);
+  s->SetSoundFormat(info_);
+  if (cache_sound_)
+  {
+    channel_lock_->lock();
+    sounds_.push_back(s);
+    channel_lock_->unlock();
+  }
+  return s;
+}
+
 void Mixer::DeleteSound(Sound *sound)
 {
   auto i = std::find(sounds_.begin(), sounds_.end(), sound);
@@ -535,6 +736,16 @@ void Mixer::Update()
 
 }
 
+void Mixer::LockMixing()
+{
+  channel_lock_->lock();
+}
+
+void Mixer::UnlockMixing()
+{
+  channel_lock_->unlock();
+}
+
 void Mixer::Mix(char* out, size_t frame_len, ChannelIndex channel_index)
 {
   // XXX: need channel lock?
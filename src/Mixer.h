@@ -3,6 +3,7 @@
 
 #include "Sound.h"
 #include "Midi.h"
+#include "Effector.h"
 #include <mutex>
 #include <vector>
 #include <map>
@@ -30,6 +31,19 @@ public:
   void Play(int loop_count);
   void Stop();
   void SetFadePoint(unsigned milisecond);
+
+  /* @brief apply streaming pitch/tempo effect while mixing.
+   * same parameter as Sound::Effect(). (1.0, 1.0) disables effect. */
+  void SetEffect(double pitch, double tempo);
+  void ClearEffect();
+
+  /* @brief playback rate related, resampled while mixing.
+   * playback rate is (pitch * speed * 2^(key/12)). */
+  void SetPitch(float pitch);
+  void SetSpeed(float speed);
+  void SetKey(int key);
+  void SetCubicInterpolation(bool cubic);
+  double get_playback_rate() const;
   void LockChannel();
   void UnlockChannel();
 
@@ -50,6 +64,9 @@ public:
   friend class Mixer;
 
 private:
+  void MixWithEffector(char *out, size_t frame_len, float volume);
+  void MixWithRate(char *out, size_t frame_len, float volume, double rate);
+
   ChannelIndex chidx_;
   unsigned groupidx_;
   Sound *sound_;
@@ -59,6 +76,7 @@ private:
   bool is_paused_;
   bool is_occupied_;
   size_t frame_pos_;        // uint64_t
+  uint32_t frame_frac_;     // fractional part of frame_pos_ (0.32 fixed-point)
   uint32_t effect_length_;
   uint32_t effect_remain_;
 
@@ -67,6 +85,9 @@ private:
   float speed_;
   float reverb_;
   int key_;
+  bool cubic_interpolation_;
+  std::unique_ptr<StreamEffector> effector_;
+  std::vector<int8_t> rate_scratch_;  // decoding window for rate mixing
 
   /* sound level and virtual sound related */
   bool is_virtual_;
@@ -103,7 +124,16 @@ public:
   void SetCacheSound(bool cache_sound);
   Sound* CreateSound(const char *filepath, bool loadasync = false);
   Sound* CreateSound(const char *p, size_t len, const char *filename = nullptr, bool loadasync = false);
+
+  /* @brief create sound from memory, referencing PCM of p in place if it is
+   * already in mixer format. owner keeps p alive while the sound refers it. */
+  Sound* CreateSound(const char *p, size_t len, const char *filename,
+                     const std::shared_ptr<const void> &owner);
   void DeleteSound(Sound *sound);
+
+  /* @brief delete all cached sounds (e.g. keysounds of unloaded chart)
+   * and release their PCM buffers at once. */
+  void ClearSounds();
   Channel* PlaySound(Sound *sound, bool start = false);
   void StopSound(Sound *sound);
   
@@ -121,6 +151,11 @@ public:
   /* @brief Update channels for next mixing */
   void Update();
 
+  /* @brief block mixing while PCM of sounds bound to channels is modified
+   * from other thread (e.g. swapping or clearing on-demand keysounds). */
+  void LockMixing();
+  void UnlockMixing();
+
   void Mix(char* out, size_t frame_len, ChannelIndex channel_index);
   void Copy(char* out, size_t frame_len, ChannelIndex channel_index);
   void MixAll(char* out, size_t frame_len);
@@ -140,6 +175,9 @@ private:
   /* @brief Cached sound data which is loaded by Mixer */
   std::vector<Sound*> sounds_;
 
+  /* @brief PCM buffer arena of cached sounds */
+  SoundArena sound_arena_;
+
   /* @brief registered sound objects (only mix, not released) */
   std::vector<Channel*> channels_;
 
@@ -9,6 +9,13 @@
 
 
 #include <math.h>
+#include <limits>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 #if 0
 // script for byte-to-floats
@@ -24,12 +31,12 @@ private static float[] bytesToFloats(byte[] bytes) {
 namespace rmixer
 {
 
-Sampler::Sampler() : source_(nullptr) {}
+Sampler::Sampler() : source_(nullptr), use_custom_matrix_(false) {}
 
-Sampler::Sampler(const Sound& source) : source_(&source) {}
+Sampler::Sampler(const Sound& source) : source_(&source), use_custom_matrix_(false) {}
 
 Sampler::Sampler(const Sound& source, const SoundInfo& target_quality)
-  : source_(&source), target_info_(target_quality) {}
+  : source_(&source), target_info_(target_quality), use_custom_matrix_(false) {}
 
 Sampler::~Sampler() {}
 
@@ -43,6 +50,17 @@ void Sampler::SetTargetQuality(const SoundInfo& target_info)
   target_info_ = target_info;
 }
 
+void Sampler::SetChannelMatrix(const ChannelMatrix& matrix)
+{
+  matrix_ = matrix;
+  use_custom_matrix_ = true;
+}
+
+void Sampler::ResetChannelMatrix()
+{
+  use_custom_matrix_ = false;
+}
+
 template <typename T>
 void Resample_from_u4_2_int(const Sound &source, T* p)
 {
@@ -157,145 +175,580 @@ size_t Allocate_Memory_By_Framesize(T **dst, const SoundInfo &info, size_t frame
   return s;
 }
 
+/* @brief convert PCM samples into given bit format without allocation.
+ * @return false if target bit format is not supported. */
 template <typename T>
-size_t Resample_Byte(T **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info);
+bool Convert_Byte(T *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info);
 
 template <>
-size_t Resample_Byte(uint8_t **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(uint8_t *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  RMIXER_THROW("Unsupported bit size");
-  return 0;
+  return false;
 }
 
 template <>
-size_t Resample_Byte(uint16_t **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(uint16_t *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  size_t s = Allocate_Memory_By_Framesize(dst, source_info, src_framecount);
   int result_is_signed =
     (source_info.bitsize == 8 && source_info.is_signed == 0) ||
     (source_info.bitsize != 8 && source_info.is_signed == 1) ||
     source_info.is_signed == 2;
   if (source_info.is_signed == 2)
-    drwav__ieee_to_s16((int16_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
+    drwav__ieee_to_s16((int16_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
   else
-    drwav__pcm_to_s16((int16_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
-  if (*dst && result_is_signed == 1)
-    s16_to_u16(*(int16_t**)dst, src_framecount * source_info.channels);
-  return s;
+    drwav__pcm_to_s16((int16_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
+  if (result_is_signed == 1)
+    s16_to_u16((int16_t*)dst, samplecount);
+  return true;
 }
 
 template <>
-size_t Resample_Byte(uint32_t **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(uint32_t *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  size_t s = Allocate_Memory_By_Framesize(dst, source_info, src_framecount);
   int result_is_signed =
     (source_info.bitsize == 8 && source_info.is_signed == 0) ||
     (source_info.bitsize != 8 && source_info.is_signed == 1) ||
     source_info.is_signed == 2;
   if (source_info.is_signed == 2)
-    drwav__ieee_to_s32((int32_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
+    drwav__ieee_to_s32((int32_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
   else
-    drwav__pcm_to_s32((int32_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
-  if (*dst && result_is_signed == 1)
-    s32_to_u32(*(int32_t**)dst, src_framecount * source_info.channels);
-  return s;
+    drwav__pcm_to_s32((int32_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
+  if (result_is_signed == 1)
+    s32_to_u32((int32_t*)dst, samplecount);
+  return true;
 }
 
 template <>
-size_t Resample_Byte(int8_t **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(int8_t *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  RMIXER_THROW("Unsupported bit size");
-  return 0;
+  return false;
 }
 
 template <>
-size_t Resample_Byte(int16_t **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(int16_t *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  size_t s = Allocate_Memory_By_Framesize(dst, source_info, src_framecount);
   int result_is_signed =
     (source_info.bitsize == 8 && source_info.is_signed == 0) ||
     (source_info.bitsize != 8 && source_info.is_signed == 1) ||
     source_info.is_signed == 2;
   if (source_info.is_signed == 2)
-    drwav__ieee_to_s16((int16_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
+    drwav__ieee_to_s16((int16_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
   else
-    drwav__pcm_to_s16((int16_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
-  if (*dst && result_is_signed == 0)
-    u16_to_s16(*(uint16_t**)dst, src_framecount * source_info.channels);
-  return s;
+    drwav__pcm_to_s16((int16_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
+  if (result_is_signed == 0)
+    u16_to_s16((uint16_t*)dst, samplecount);
+  return true;
 }
 
 template <>
-size_t Resample_Byte(int32_t **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(int32_t *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  size_t s = Allocate_Memory_By_Framesize(dst, source_info, src_framecount);
   int result_is_signed =
     (source_info.bitsize == 8 && source_info.is_signed == 0) ||
     (source_info.bitsize != 8 && source_info.is_signed == 1) ||
     source_info.is_signed == 2;
   if (source_info.is_signed == 2)
-    drwav__ieee_to_s32((int32_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
+    drwav__ieee_to_s32((int32_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
   else
-    drwav__pcm_to_s32((int32_t*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
-  if (*dst && result_is_signed == 0)
-    u32_to_s32(*(uint32_t**)dst, src_framecount * source_info.channels);
-  return s;
+    drwav__pcm_to_s32((int32_t*)dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
+  if (result_is_signed == 0)
+    u32_to_s32((uint32_t*)dst, samplecount);
+  return true;
 }
 
 template <>
-size_t Resample_Byte(float **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(float *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
 {
-  size_t s = Allocate_Memory_By_Framesize(dst, source_info, src_framecount);
   int result_is_signed =
     (source_info.bitsize == 8 && source_info.is_signed == 0) ||
     (source_info.bitsize != 8 && source_info.is_signed == 1) ||
     source_info.is_signed == 2;
   if (source_info.is_signed == 2)
-    drwav__ieee_to_f32((float*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
+    drwav__ieee_to_f32(dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
   else
-    drwav__pcm_to_f32((float*)*dst, (uint8_t*)source,
-      src_framecount * source_info.channels, source_info.bitsize / 8);
-  if (*dst && result_is_signed == 0) /* in case of source is unsigned */
+    drwav__pcm_to_f32(dst, (uint8_t*)source,
+      samplecount, source_info.bitsize / 8);
+  if (result_is_signed == 0) /* in case of source is unsigned */
   {
-    float *_p = (float*)*dst;
-    for (size_t i = 0; i < src_framecount * source_info.channels; ++i)
-      _p[i] -= 1.0f;
+    for (size_t i = 0; i < samplecount; ++i)
+      dst[i] -= 1.0f;
   }
-  return s;
+  return true;
 }
 
 template <>
-size_t Resample_Byte(double **dst, const void *source, size_t src_framecount,
-                     const SoundInfo &source_info, const SoundInfo &target_info)
+bool Convert_Byte(double *dst, const void *source, size_t samplecount,
+                  const SoundInfo &source_info)
+{
+  return false;
+}
+
+/* @brief convert PCM samples into the bit format of target_info. */
+static bool Convert_Byte_Format(void *dst, const void *source, size_t samplecount,
+                                const SoundInfo &source_info, const SoundInfo &target_info)
+{
+  switch (target_info.is_signed)
+  {
+  case 0:
+    switch (target_info.bitsize)
+    {
+    case 8:
+      return Convert_Byte((uint8_t*)dst, source, samplecount, source_info);
+    case 16:
+      return Convert_Byte((uint16_t*)dst, source, samplecount, source_info);
+    case 32:
+      return Convert_Byte((uint32_t*)dst, source, samplecount, source_info);
+    default:
+      break;
+    }
+    break;
+  case 1:
+    switch (target_info.bitsize)
+    {
+    case 8:
+      return Convert_Byte((int8_t*)dst, source, samplecount, source_info);
+    case 16:
+      return Convert_Byte((int16_t*)dst, source, samplecount, source_info);
+    case 32:
+      return Convert_Byte((int32_t*)dst, source, samplecount, source_info);
+    default:
+      break;
+    }
+    break;
+  case 2:
+    switch (target_info.bitsize)
+    {
+    case 32:
+      return Convert_Byte((float*)dst, source, samplecount, source_info);
+    case 64:
+      return Convert_Byte((double*)dst, source, samplecount, source_info);
+    default:
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+  return false;
+}
+
+
+// ------------------------ class ChannelMatrix
+
+/* ITU-R BS.775 downmix coefficient (-3dB) */
+constexpr float kDownmixCoef = 0.70710678f;
+
+ChannelMatrix::ChannelMatrix() : in_channels(0), out_channels(0)
 {
-  RMIXER_THROW("Unsupported bit size");
+  Clear();
+}
+
+ChannelMatrix::ChannelMatrix(uint8_t in_channels, uint8_t out_channels)
+  : in_channels(in_channels), out_channels(out_channels)
+{
+  RMIXER_ASSERT_M(in_channels <= kMaxMatrixChannel && out_channels <= kMaxMatrixChannel,
+    "Unsupported channel count for channel matrix.");
+  Clear();
+}
+
+void ChannelMatrix::Clear()
+{
+  memset(coef, 0, sizeof(coef));
+}
+
+void ChannelMatrix::Set(uint8_t out_ch, uint8_t in_ch, float v)
+{
+  RMIXER_ASSERT(out_ch < out_channels && in_ch < in_channels);
+  coef[out_ch][in_ch] = v;
+}
+
+bool ChannelMatrix::is_identity() const
+{
+  if (in_channels != out_channels) return false;
+  for (unsigned o = 0; o < out_channels; ++o)
+    for (unsigned i = 0; i < in_channels; ++i)
+      if (coef[o][i] != (o == i ? 1.0f : 0.0f)) return false;
+  return true;
+}
+
+bool ChannelMatrix::is_mono_to_stereo() const
+{
+  return in_channels == 1 && out_channels == 2 &&
+         coef[0][0] == 1.0f && coef[1][0] == 1.0f;
+}
+
+bool ChannelMatrix::is_stereo_to_mono() const
+{
+  return in_channels == 2 && out_channels == 1 &&
+         coef[0][0] == 0.5f && coef[0][1] == 0.5f;
+}
+
+ChannelMatrix ChannelMatrix::CreateDefault(uint8_t in_channels, uint8_t out_channels)
+{
+  ChannelMatrix m(in_channels, out_channels);
+  if (in_channels == out_channels)
+  {
+    for (unsigned i = 0; i < in_channels; ++i)
+      m.coef[i][i] = 1.0f;
+  }
+  else if (in_channels == 1)
+  {
+    for (unsigned o = 0; o < out_channels; ++o)
+      m.coef[o][0] = 1.0f;
+  }
+  else if (out_channels == 1)
+  {
+    for (unsigned i = 0; i < in_channels; ++i)
+      m.coef[0][i] = 1.0f / in_channels;
+  }
+  else if (in_channels == 6 && out_channels == 2)
+  {
+    // L R C LFE Ls Rs --> L R (LFE is dropped), normalized to prevent clipping.
+    const float n = 1.0f / (1.0f + kDownmixCoef * 2);
+    m.coef[0][0] = n;
+    m.coef[0][2] = kDownmixCoef * n;
+    m.coef[0][4] = kDownmixCoef * n;
+    m.coef[1][1] = n;
+    m.coef[1][2] = kDownmixCoef * n;
+    m.coef[1][5] = kDownmixCoef * n;
+  }
+  else
+  {
+    // general case: wrap input channels into output channels and normalize.
+    for (unsigned i = 0; i < in_channels; ++i)
+      m.coef[i % out_channels][i] = 1.0f;
+    for (unsigned o = 0; o < out_channels; ++o)
+    {
+      float sum = 0;
+      for (unsigned i = 0; i < in_channels; ++i)
+        sum += m.coef[o][i];
+      if (sum > 1.0f)
+        for (unsigned i = 0; i < in_channels; ++i)
+          m.coef[o][i] /= sum;
+    }
+  }
+  return m;
+}
+
+
+// channel conversion start
+
+/* @brief sample conversion rule used by channel matrix. */
+template <typename T> struct ChannelSampleTraits
+{
+  typedef float acc_t;
+  static acc_t to_acc(T v) { return (acc_t)v; }
+  static T from_acc(acc_t v)
+  {
+    if (v >= (acc_t)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+    if (v <= (acc_t)std::numeric_limits<T>::min()) return std::numeric_limits<T>::min();
+    return (T)(v < 0 ? v - 0.5f : v + 0.5f);
+  }
+  static T average(T a, T b) { return (T)(((int32_t)a + b) >> 1); }
+};
+
+template <> struct ChannelSampleTraits<uint8_t>
+{
+  typedef float acc_t;
+  static acc_t to_acc(uint8_t v) { return (acc_t)v - 0x80; }
+  static uint8_t from_acc(acc_t v)
+  {
+    v += 0x80;
+    if (v >= 0xFF) return 0xFF;
+    if (v <= 0) return 0;
+    return (uint8_t)(v + 0.5f);
+  }
+  static uint8_t average(uint8_t a, uint8_t b) { return (uint8_t)(((uint32_t)a + b) >> 1); }
+};
+
+template <> struct ChannelSampleTraits<uint16_t>
+{
+  typedef float acc_t;
+  static acc_t to_acc(uint16_t v) { return (acc_t)v - 0x8000; }
+  static uint16_t from_acc(acc_t v)
+  {
+    v += 0x8000;
+    if (v >= 0xFFFF) return 0xFFFF;
+    if (v <= 0) return 0;
+    return (uint16_t)(v + 0.5f);
+  }
+  static uint16_t average(uint16_t a, uint16_t b) { return (uint16_t)(((uint32_t)a + b) >> 1); }
+};
+
+template <> struct ChannelSampleTraits<int32_t>
+{
+  typedef double acc_t;
+  static acc_t to_acc(int32_t v) { return (acc_t)v; }
+  static int32_t from_acc(acc_t v)
+  {
+    if (v >= 2147483647.0) return std::numeric_limits<int32_t>::max();
+    if (v <= -2147483648.0) return std::numeric_limits<int32_t>::min();
+    return (int32_t)(v < 0 ? v - 0.5 : v + 0.5);
+  }
+  static int32_t average(int32_t a, int32_t b) { return (a >> 1) + (b >> 1) + (a & b & 1); }
+};
+
+template <> struct ChannelSampleTraits<uint32_t>
+{
+  typedef double acc_t;
+  static acc_t to_acc(uint32_t v) { return (acc_t)v - 2147483648.0; }
+  static uint32_t from_acc(acc_t v)
+  {
+    v += 2147483648.0;
+    if (v >= 4294967295.0) return std::numeric_limits<uint32_t>::max();
+    if (v <= 0) return 0;
+    return (uint32_t)(v + 0.5);
+  }
+  static uint32_t average(uint32_t a, uint32_t b) { return (a >> 1) + (b >> 1) + (a & b & 1); }
+};
+
+template <> struct ChannelSampleTraits<float>
+{
+  typedef float acc_t;
+  static acc_t to_acc(float v) { return v; }
+  static float from_acc(acc_t v) { return v; }
+  static float average(float a, float b) { return (a + b) * 0.5f; }
+};
+
+template <> struct ChannelSampleTraits<double>
+{
+  typedef double acc_t;
+  static acc_t to_acc(double v) { return v; }
+  static double from_acc(acc_t v) { return v; }
+  static double average(double a, double b) { return (a + b) * 0.5; }
+};
+
+/* SIMD kernels: return processed frame count (remaining frames are done by scalar loop) */
+
+#ifdef USE_SSE2
+static size_t Duplicate16_SIMD(int16_t *dst, const int16_t *src, size_t framecount)
+{
+  size_t i = 0;
+  for (; i + 8 <= framecount; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_unpacklo_epi16(v, v));
+    _mm_storeu_si128((__m128i*)(dst + i * 2 + 8), _mm_unpackhi_epi16(v, v));
+  }
+  return i;
+}
+
+static size_t Duplicate32_SIMD(int32_t *dst, const int32_t *src, size_t framecount)
+{
+  size_t i = 0;
+  for (; i + 4 <= framecount; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_unpacklo_epi32(v, v));
+    _mm_storeu_si128((__m128i*)(dst + i * 2 + 4), _mm_unpackhi_epi32(v, v));
+  }
+  return i;
+}
+
+/* @param flip  sign bit mask to treat unsigned samples as signed. */
+static size_t Average16_SIMD(int16_t *dst, const int16_t *src, size_t framecount, int16_t flip)
+{
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i mask = _mm_set1_epi16(flip);
+  size_t i = 0;
+  for (; i + 8 <= framecount; i += 8)
+  {
+    __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i * 2)), mask);
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i * 2 + 8)), mask);
+    // sum of (L, R) pair in 32bit, then halve it.
+    a = _mm_srai_epi32(_mm_madd_epi16(a, one), 1);
+    b = _mm_srai_epi32(_mm_madd_epi16(b, one), 1);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_packs_epi32(a, b), mask));
+  }
+  return i;
+}
+
+static size_t Average32_SIMD(int32_t *dst, const int32_t *src, size_t framecount, int32_t flip)
+{
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i mask = _mm_set1_epi32(flip);
+  size_t i = 0;
+  for (; i + 4 <= framecount; i += 4)
+  {
+    __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i * 2)), mask);
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i * 2 + 4)), mask);
+    // deinterleave (L0 R0 L1 R1) (L2 R2 L3 R3) --> (L0 L1 L2 L3) (R0 R1 R2 R3)
+    __m128i l = _mm_castps_si128(_mm_shuffle_ps(
+      _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i r = _mm_castps_si128(_mm_shuffle_ps(
+      _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+    // (l >> 1) + (r >> 1) + (l & r & 1) : average without overflow
+    __m128i v = _mm_add_epi32(_mm_add_epi32(_mm_srai_epi32(l, 1), _mm_srai_epi32(r, 1)),
+                              _mm_and_si128(_mm_and_si128(l, r), one));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(v, mask));
+  }
+  return i;
+}
+
+static size_t AverageF32_SIMD(float *dst, const float *src, size_t framecount)
+{
+  const __m128 half = _mm_set1_ps(0.5f);
+  size_t i = 0;
+  for (; i + 4 <= framecount; i += 4)
+  {
+    __m128 a = _mm_loadu_ps(src + i * 2);
+    __m128 b = _mm_loadu_ps(src + i * 2 + 4);
+    __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+  }
+  return i;
+}
+#endif
+
+template <typename T>
+size_t Duplicate_SIMD(T *dst, const T *src, size_t framecount)
+{
+#ifdef USE_SSE2
+  switch (sizeof(T))
+  {
+  case 2:
+    return Duplicate16_SIMD((int16_t*)dst, (const int16_t*)src, framecount);
+  case 4:
+    return Duplicate32_SIMD((int32_t*)dst, (const int32_t*)src, framecount);
+  default:
+    break;
+  }
+#endif
   return 0;
 }
 
+template <typename T>
+size_t Average_SIMD(T *dst, const T *src, size_t framecount) { return 0; }
+
+#ifdef USE_SSE2
+size_t Average_SIMD(int16_t *dst, const int16_t *src, size_t framecount)
+{
+  return Average16_SIMD(dst, src, framecount, 0);
+}
+
+size_t Average_SIMD(uint16_t *dst, const uint16_t *src, size_t framecount)
+{
+  return Average16_SIMD((int16_t*)dst, (const int16_t*)src, framecount, (int16_t)0x8000);
+}
+
+size_t Average_SIMD(int32_t *dst, const int32_t *src, size_t framecount)
+{
+  return Average32_SIMD(dst, src, framecount, 0);
+}
+
+size_t Average_SIMD(uint32_t *dst, const uint32_t *src, size_t framecount)
+{
+  return Average32_SIMD((int32_t*)dst, (const int32_t*)src, framecount, (int32_t)0x80000000);
+}
+
+size_t Average_SIMD(float *dst, const float *src, size_t framecount)
+{
+  return AverageF32_SIMD(dst, src, framecount);
+}
+#endif
+
+template <typename T>
+void MixChannel_Duplicate(T *dst, const T *src, size_t framecount)
+{
+  size_t i = Duplicate_SIMD(dst, src, framecount);
+  for (; i < framecount; ++i)
+  {
+    dst[i * 2] = src[i];
+    dst[i * 2 + 1] = src[i];
+  }
+}
+
+template <typename T>
+void MixChannel_Average(T *dst, const T *src, size_t framecount)
+{
+  size_t i = Average_SIMD(dst, src, framecount);
+  for (; i < framecount; ++i)
+    dst[i] = ChannelSampleTraits<T>::average(src[i * 2], src[i * 2 + 1]);
+}
+
+template <typename T>
+void MixChannel_Matrix(T *dst, const T *src, size_t framecount, const ChannelMatrix &matrix)
+{
+  typedef ChannelSampleTraits<T> traits;
+  typedef typename traits::acc_t acc_t;
+  const unsigned in_ch = matrix.in_channels;
+  const unsigned out_ch = matrix.out_channels;
+  acc_t coef[kMaxMatrixChannel][kMaxMatrixChannel];
+  acc_t in[kMaxMatrixChannel];
+  for (unsigned o = 0; o < out_ch; ++o)
+    for (unsigned i = 0; i < in_ch; ++i)
+      coef[o][i] = (acc_t)matrix.coef[o][i];
+
+  for (size_t f = 0; f < framecount; ++f)
+  {
+    for (unsigned i = 0; i < in_ch; ++i)
+      in[i] = traits::to_acc(src[i]);
+    for (unsigned o = 0; o < out_ch; ++o)
+    {
+      acc_t v = 0;
+      for (unsigned i = 0; i < in_ch; ++i)
+        v += in[i] * coef[o][i];
+      dst[o] = traits::from_acc(v);
+    }
+    src += in_ch;
+    dst += out_ch;
+  }
+}
+
+template <typename T>
+void MixChannel(T *dst, const T *src, size_t framecount, const ChannelMatrix &matrix)
+{
+  if (matrix.is_identity())
+    memcpy(dst, src, sizeof(T) * framecount * matrix.in_channels);
+  else if (matrix.is_mono_to_stereo())
+    MixChannel_Duplicate(dst, src, framecount);
+  else if (matrix.is_stereo_to_mono())
+    MixChannel_Average(dst, src, framecount);
+  else
+    MixChannel_Matrix(dst, src, framecount, matrix);
+}
+
+template void MixChannel(uint8_t *dst, const uint8_t *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(uint16_t *dst, const uint16_t *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(uint32_t *dst, const uint32_t *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(int8_t *dst, const int8_t *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(int16_t *dst, const int16_t *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(int32_t *dst, const int32_t *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(float *dst, const float *src, size_t framecount, const ChannelMatrix &matrix);
+template void MixChannel(double *dst, const double *src, size_t framecount, const ChannelMatrix &matrix);
+
+/* frame count of each chunk when PCM and channel conversion is done at once.
+ * small enough to keep intermediate chunk in cache. */
+constexpr size_t kChannelConvertChunkFrame = 1024;
+
+// channel conversion end
+
 
 // XXX:
 // Performance problem when signed/unsigned is changed.
 // Need to create new sign/unsigned conversion API
 // independent from drwav library.
 template <typename T_TO>
-void Resample_Internal(const Sound &source, Sound &newsound, const SoundInfo& newinfo)
+void Resample_Internal(const Sound &source, Sound &newsound, const SoundInfo& newinfo,
+                       const ChannelMatrix &matrix)
 {
   RMIXER_ASSERT(sizeof(T_TO) == 2 || sizeof(T_TO) == 4);
   RMIXER_ASSERT(&source != &newsound);
@@ -305,104 +758,72 @@ void Resample_Internal(const Sound &source, Sound &newsound, const SoundInfo& ne
   size_t framecount = source.get_frame_count();
   new_ptr = const_cast<T_TO*>(reinterpret_cast<const T_TO*>(source.get_ptr()));
 
-  // 1. do byte conversion(PCM conversion), if necessary.
   bool is_bitsize_diff = (sinfo.bitsize != newinfo.bitsize) || (sinfo.is_signed != newinfo.is_signed);
-  bool is_channelsize_diff = sinfo.channels != newinfo.channels;
+  bool is_channel_mix = !matrix.is_identity();
   double sample_rate = (double)newinfo.rate / sinfo.rate;
 
-  if (is_bitsize_diff)
+  if (is_bitsize_diff && is_channel_mix && sinfo.bitsize != 4)
   {
-    T_TO *p = nullptr;
-    if (sinfo.bitsize == 4)
+    // 1-2. byte conversion and channel conversion in a single pass.
+    // source is converted by small chunks, so only the output buffer is allocated.
+    T_TO *p = (T_TO*)malloc(sizeof(T_TO) * framecount * newinfo.channels);
+    T_TO *chunk = (T_TO*)malloc(sizeof(T_TO) * kChannelConvertChunkFrame * sinfo.channels);
+    for (size_t i = 0; i < framecount; i += kChannelConvertChunkFrame)
     {
+      const size_t chunk_framecount = std::min(kChannelConvertChunkFrame, framecount - i);
+      if (!Convert_Byte_Format(chunk, source.get_ptr() + source.GetByteFromFrame(i),
+                               chunk_framecount * sinfo.channels, sinfo, newinfo))
+      {
+        free(chunk);
+        free(p);
+        RMIXER_THROW("Unsupported bit size");
+      }
+      MixChannel(p + i * newinfo.channels, chunk, chunk_framecount, matrix);
+    }
+    free(chunk);
+    new_ptr = p;
+    prev_ptr = new_ptr;
+  }
+  else
+  {
+    // 1. do byte conversion(PCM conversion), if necessary.
+    if (is_bitsize_diff && sinfo.bitsize == 4)
+    {
+      T_TO *p = nullptr;
       if (sinfo.is_signed == 1)
         RMIXER_THROW("Unsupported bit size");
 
       // check for 4 bit PCM
       // (XXX: is this really exists as memory form?)
       Resample_from_u4(source, p);
+      // replace previous cache
+      new_ptr = p;
+      prev_ptr = new_ptr;
     }
-    else
+    else if (is_bitsize_diff)
     {
-      switch (newinfo.is_signed)
-      {
-      case 0:
-        switch (newinfo.bitsize)
-        {
-        case 8:
-          Resample_Byte((uint8_t**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        case 16:
-          Resample_Byte((uint16_t**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        case 32:
-          Resample_Byte((uint32_t**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        default:
-          break;
-        }
-        break;
-      case 1:
-        switch (newinfo.bitsize)
-        {
-        case 8:
-          Resample_Byte((int8_t**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        case 16:
-          Resample_Byte((int16_t**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        case 32:
-          Resample_Byte((int32_t**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        default:
-          break;
-        }
-        break;
-      case 2:
-        switch (newinfo.bitsize)
-        {
-        case 32:
-          Resample_Byte((float**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        case 64:
-          Resample_Byte((double**)&p, (void*)source.get_ptr(), framecount, sinfo, newinfo);
-          break;
-        default:
-          break;
-        }
-        break;
-      default:
-        break;
-      }
-      if (!p)
+      T_TO *p = nullptr;
+      Allocate_Memory_By_Framesize(&p, sinfo, framecount);
+      if (!Convert_Byte_Format(p, source.get_ptr(), framecount * sinfo.channels, sinfo, newinfo))
       {
+        free(p);
         RMIXER_THROW("Unsupported bit size");
       }
+      // replace previous cache
+      new_ptr = p;
+      prev_ptr = new_ptr;
     }
-    // replace previous cache
-    new_ptr = p;
-    prev_ptr = new_ptr;
-  }
 
-  // 2. channel conversion
-  // downsample into single channel and averaging method
-  if (is_channelsize_diff)
-  {
-    T_TO downsample;
-    T_TO *p = (T_TO*)malloc(sizeof(T_TO) * framecount * newinfo.channels);
-    T_TO *p_org = p;
-    for (size_t i = 0; i < framecount; i++)
+    // 2. channel conversion using channel matrix
+    if (is_channel_mix)
     {
-      downsample = 0;
-      for (size_t ch = 0; ch < sinfo.channels; ch++)
-        downsample += *(new_ptr++) / sinfo.channels;
-      for (size_t ch = 0; ch < newinfo.channels; ch++)
-        *(p++) = downsample;
+      T_TO *p = (T_TO*)malloc(sizeof(T_TO) * framecount * newinfo.channels);
+      MixChannel(p, new_ptr, framecount, matrix);
+      // replace previous cache
+      if (prev_ptr) { free(prev_ptr); }
+      new_ptr = p;
+      prev_ptr = new_ptr;
     }
-    // replace previous cache
-    if (prev_ptr) { free(prev_ptr); }
-    new_ptr = p_org;
-    prev_ptr = new_ptr;
   }
 
   // 3. sample rate conversion
@@ -499,19 +920,29 @@ bool Sampler::Resample(Sound &newsound)
   if (!newsound.is_empty() && newsound.get_soundinfo() == target_info_)
     return true;
 
+  const SoundInfo &sinfo = source_->get_soundinfo();
+  if (sinfo.channels > kMaxMatrixChannel || target_info_.channels > kMaxMatrixChannel)
+    return false;
+  const ChannelMatrix matrix =
+    (use_custom_matrix_ &&
+     matrix_.in_channels == sinfo.channels &&
+     matrix_.out_channels == target_info_.channels)
+    ? matrix_
+    : ChannelMatrix::CreateDefault(sinfo.channels, target_info_.channels);
+
   switch (target_info_.is_signed)
   {
   case 0:
     switch (target_info_.bitsize)
     {
     case 8:
-      Resample_Internal<int8_t>(*source_, newsound, target_info_);
+      Resample_Internal<uint8_t>(*source_, newsound, target_info_, matrix);
       break;
     case 16:
-      Resample_Internal<int16_t>(*source_, newsound, target_info_);
+      Resample_Internal<uint16_t>(*source_, newsound, target_info_, matrix);
       break;
     case 32:
-      Resample_Internal<int32_t>(*source_, newsound, target_info_);
+      Resample_Internal<uint32_t>(*source_, newsound, target_info_, matrix);
       break;
     default:
       return false;
@@ -521,13 +952,13 @@ bool Sampler::Resample(Sound &newsound)
     switch (target_info_.bitsize)
     {
     case 8:
-      Resample_Internal<uint8_t>(*source_, newsound, target_info_);
+      Resample_Internal<int8_t>(*source_, newsound, target_info_, matrix);
       break;
     case 16:
-      Resample_Internal<uint16_t>(*source_, newsound, target_info_);
+      Resample_Internal<int16_t>(*source_, newsound, target_info_, matrix);
       break;
     case 32:
-      Resample_Internal<uint32_t>(*source_, newsound, target_info_);
+      Resample_Internal<int32_t>(*source_, newsound, target_info_, matrix);
       break;
     default:
       return false;
@@ -537,10 +968,10 @@ bool Sampler::Resample(Sound &newsound)
     switch (target_info_.bitsize)
     {
     case 32:
-      Resample_Internal<float>(*source_, newsound, target_info_);
+      Resample_Internal<float>(*source_, newsound, target_info_, matrix);
       break;
     case 64:
-      Resample_Internal<double>(*source_, newsound, target_info_);
+      Resample_Internal<double>(*source_, newsound, target_info_, matrix);
       break;
     default:
       return false;
@@ -6,6 +6,37 @@
 namespace rmixer
 {
 
+/* maximum channel count which channel matrix can handle. */
+constexpr unsigned kMaxMatrixChannel = 8;
+
+/**
+ * @brief
+ * Channel mixing matrix used for channel conversion.
+ * out[o] = sum of (in[i] * coef[o][i])
+ */
+struct ChannelMatrix
+{
+  uint8_t in_channels;
+  uint8_t out_channels;
+  float coef[kMaxMatrixChannel][kMaxMatrixChannel];
+
+  ChannelMatrix();
+  ChannelMatrix(uint8_t in_channels, uint8_t out_channels);
+
+  void Clear();
+  void Set(uint8_t out_ch, uint8_t in_ch, float v);
+  bool is_identity() const;
+  bool is_mono_to_stereo() const;
+  bool is_stereo_to_mono() const;
+
+  /**
+   * @brief create default matrix.
+   * mono to multi-channel is duplicated, multi-channel to mono is averaged,
+   * and 5.1 (L R C LFE Ls Rs) to stereo uses ITU downmix coefficients.
+   */
+  static ChannelMatrix CreateDefault(uint8_t in_channels, uint8_t out_channels);
+};
+
 class Sampler
 {
 public:
@@ -17,15 +48,26 @@ public:
   void SetSource(const Sound& source);
   void SetTargetQuality(const SoundInfo& target_info);
 
+  /* @brief use custom channel matrix instead of default one.
+   * ignored if matrix channel count is not matched with source/target. */
+  void SetChannelMatrix(const ChannelMatrix& matrix);
+  void ResetChannelMatrix();
+
   bool Resample(Sound &newsound);
 private:
   const Sound *source_;
   SoundInfo target_info_;
+  ChannelMatrix matrix_;
+  bool use_custom_matrix_;
 };
 
 // Utility resampler function
 bool Resample(Sound &dst, const Sound &src, const SoundInfo &target_info);
 
+// Channel conversion function
+template <typename T>
+void MixChannel(T *dst, const T *src, size_t framecount, const ChannelMatrix &matrix);
+
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -8,6 +8,9 @@
 #include "Effector.h"
 #include <memory.h>
 #include <string.h>
+#include <type_traits>
+#include <cmath>
+#include <atomic>
 
 #ifndef _ENDIAN_H
 # if __BYTE_ORDER == __LITTLE_ENDIAN
@@ -27,6 +30,7 @@ namespace rmixer
 {
 
 static bool enable_detailed_log = false;
+static std::atomic<bool> enable_simd(true);
 
 // mixing util function start
 
@@ -419,8 +423,294 @@ void pcmmix(int8_t* dst, const int8_t* src, size_t bytesize, size_t bytepersampl
   else RMIXER_ASSERT(0);
 }
 
+/* sample center value (silence) for mixing with playback rate */
+template <typename T>
+struct RateMixTraits
+{
+  typedef typename std::conditional<(sizeof(T) >= 4), double, float>::type calc_t;
+  static constexpr calc_t kCenter = std::is_signed<T>::value ? 0 :
+    (calc_t)(std::numeric_limits<T>::max() / 2 + 1);
+  static void mix(T *dst, calc_t v)
+  {
+    calc_t r = *dst + v;
+    if (r > std::numeric_limits<T>::max()) *dst = std::numeric_limits<T>::max();
+    else if (r < std::numeric_limits<T>::min()) *dst = std::numeric_limits<T>::min();
+    else *dst = static_cast<T>(r);
+  }
+};
+
+template <>
+struct RateMixTraits<float>
+{
+  typedef float calc_t;
+  static constexpr calc_t kCenter = 0;
+  static void mix(float *dst, float v) { *dst += v; }
+};
+
+/**
+ * @brief mix source with fractional position (32.32 fixed-point phase).
+ * @return mixed frame count
+ */
+template <typename T>
+size_t pcmmix_rate_template(T* dst, const T* src, size_t src_frame_count, size_t channels,
+                            size_t *pos, uint32_t *frac, uint64_t step,
+                            size_t frame_len, float volume, bool cubic)
+{
+  typedef typename RateMixTraits<T>::calc_t calc_t;
+  const calc_t center = RateMixTraits<T>::kCenter;
+  const calc_t vol = volume;
+  constexpr calc_t kFracScale = (calc_t)(1.0 / 4294967296.0);
+  uint64_t phase = ((uint64_t)*pos << 32) | *frac;
+  const uint64_t phase_end = (uint64_t)src_frame_count << 32;
+  size_t i = 0;
+
+  for (; i < frame_len && phase < phase_end; ++i, phase += step)
+  {
+    const size_t idx = static_cast<size_t>(phase >> 32);
+    const calc_t t = (uint32_t)phase * kFracScale;
+    const T *p1 = src + idx * channels;
+    const T *p2 = idx + 1 < src_frame_count ? p1 + channels : p1;
+    T *d = dst + i * channels;
+    if (!cubic)
+    {
+      for (size_t c = 0; c < channels; ++c)
+      {
+        const calc_t v = p1[c] + (p2[c] - (calc_t)p1[c]) * t;
+        RateMixTraits<T>::mix(d + c, (v - center) * vol);
+      }
+    }
+    else
+    {
+      // Catmull-Rom spline
+      const T *p0 = idx > 0 ? p1 - channels : p1;
+      const T *p3 = idx + 2 < src_frame_count ? p2 + channels : p2;
+      for (size_t c = 0; c < channels; ++c)
+      {
+        const calc_t s0 = p0[c], s1 = p1[c], s2 = p2[c], s3 = p3[c];
+        const calc_t v = s1 + (calc_t)0.5 * t * (s2 - s0 +
+          t * (2 * s0 - 5 * s1 + 4 * s2 - s3 + t * (3 * (s1 - s2) + s3 - s0)));
+        RateMixTraits<T>::mix(d + c, (v - center) * vol);
+      }
+    }
+  }
+
+  *pos = static_cast<size_t>(phase >> 32);
+  *frac = (uint32_t)phase;
+  return i;
+}
+
 // mixing util function end
 
+// compressed sound (block IMA ADPCM) util function start
+
+/* maximum channel count of compressed sound. */
+constexpr size_t kMaxCompressChannel = 8;
+
+/* frame count decoded at once for rate mixing of compressed sound. */
+constexpr size_t kCompressWindowFrame = 512;
+
+static const int kIMAIndexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int kIMAStepTable[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+struct ADPCMState
+{
+  int predictor;
+  int index;
+};
+
+/* @brief decode a nibble and update predictor. shared by encoder/decoder. */
+static inline int16_t StepADPCM(ADPCMState &st, int nibble)
+{
+  const int step = kIMAStepTable[st.index];
+  int diff = step >> 3;
+  if (nibble & 1) diff += step >> 2;
+  if (nibble & 2) diff += step >> 1;
+  if (nibble & 4) diff += step;
+  if (nibble & 8) diff = -diff;
+  st.predictor = std::min(32767, std::max(-32768, st.predictor + diff));
+  st.index = std::min(88, std::max(0, st.index + kIMAIndexTable[nibble]));
+  return (int16_t)st.predictor;
+}
+
+static inline int EncodeADPCM(ADPCMState &st, int sample)
+{
+  int step = kIMAStepTable[st.index];
+  int diff = sample - st.predictor;
+  int nibble = 0;
+  if (diff < 0)
+  {
+    nibble = 8;
+    diff = -diff;
+  }
+  if (diff >= step) { nibble |= 4; diff -= step; }
+  step >>= 1;
+  if (diff >= step) { nibble |= 2; diff -= step; }
+  step >>= 1;
+  if (diff >= step) { nibble |= 1; }
+  StepADPCM(st, nibble);
+  return nibble;
+}
+
+/* @brief byte size of a block: per-channel header and 4bit samples. */
+static inline size_t GetADPCMBlockSize(size_t channels)
+{
+  return 4 * channels + (kCompressBlockFrame * channels + 1) / 2;
+}
+
+template <typename T>
+static inline int16_t ToADPCMSample(T v) { return v; }
+template <>
+inline int16_t ToADPCMSample(float v)
+{
+  return (int16_t)std::lrintf(std::min(1.0f, std::max(-1.0f, v)) * 32767.0f);
+}
+
+template <typename T>
+static inline T FromADPCMSample(int16_t v) { return v; }
+template <>
+inline float FromADPCMSample(int16_t v) { return v * (1.0f / 32768.0f); }
+
+template <typename T>
+static void EncodeADPCMBlocks(uint8_t *out, const T *src, size_t framecount, size_t channels)
+{
+  ADPCMState st[kMaxCompressChannel];
+  const size_t blocksize = GetADPCMBlockSize(channels);
+  for (size_t c = 0; c < channels; ++c)
+    st[c] = { ToADPCMSample(src[c]), 0 };
+  for (size_t f = 0; f < framecount; f += kCompressBlockFrame, out += blocksize)
+  {
+    const size_t n = std::min(kCompressBlockFrame, framecount - f);
+    memset(out, 0, blocksize);
+    for (size_t c = 0; c < channels; ++c)
+    {
+      out[c * 4] = (uint8_t)(st[c].predictor & 0xFF);
+      out[c * 4 + 1] = (uint8_t)((st[c].predictor >> 8) & 0xFF);
+      out[c * 4 + 2] = (uint8_t)st[c].index;
+    }
+    uint8_t *data = out + 4 * channels;
+    const T *s = src + f * channels;
+    for (size_t i = 0; i < n * channels; ++i)
+    {
+      const int nibble = EncodeADPCM(st[i % channels], ToADPCMSample(s[i]));
+      data[i >> 1] |= (uint8_t)(nibble << ((i & 1) * 4));
+    }
+  }
+}
+
+/* @brief decode first framecount frames of a block. */
+static void DecodeADPCMBlock(int16_t *out, const uint8_t *block, size_t framecount, size_t channels)
+{
+  ADPCMState st[kMaxCompressChannel];
+  for (size_t c = 0; c < channels; ++c)
+  {
+    st[c].predictor = (int16_t)(block[c * 4] | (block[c * 4 + 1] << 8));
+    st[c].index = block[c * 4 + 2];
+  }
+  const uint8_t *data = block + 4 * channels;
+  size_t i = 0;
+  for (size_t f = 0; f < framecount; ++f)
+  {
+    for (size_t c = 0; c < channels; ++c, ++i)
+      out[i] = StepADPCM(st[c], (data[i >> 1] >> ((i & 1) * 4)) & 0xF);
+  }
+}
+
+/* @brief decode frames of compressed data in any position. */
+template <typename T>
+static void DecodeADPCMFrames(T *out, const uint8_t *blocks, size_t offset,
+                              size_t framecount, size_t channels)
+{
+  int16_t tmp[kCompressBlockFrame * kMaxCompressChannel];
+  const size_t blocksize = GetADPCMBlockSize(channels);
+  while (framecount > 0)
+  {
+    const size_t block_offset = offset % kCompressBlockFrame;
+    const size_t n = std::min(kCompressBlockFrame - block_offset, framecount);
+    DecodeADPCMBlock(tmp, blocks + offset / kCompressBlockFrame * blocksize,
+                     block_offset + n, channels);
+    const int16_t *s = tmp + block_offset * channels;
+    for (size_t i = 0; i < n * channels; ++i)
+      out[i] = FromADPCMSample<T>(s[i]);
+    out += n * channels;
+    offset += n;
+    framecount -= n;
+  }
+}
+
+template <typename T>
+static void MixADPCMFrames(T *dst, const uint8_t *blocks, size_t offset, size_t framecount,
+                           size_t channels, float volume, bool copy)
+{
+  T tmp[kCompressBlockFrame * kMaxCompressChannel];
+  while (framecount > 0)
+  {
+    const size_t n = std::min(kCompressBlockFrame, framecount);
+    const size_t samplecount = n * channels;
+    DecodeADPCMFrames(tmp, blocks, offset, n, channels);
+    if (copy)
+    {
+      if (volume == 1.0f) pcmcpy(dst, tmp, samplecount);
+      else pcmcpy(dst, tmp, samplecount, volume);
+    }
+    else
+    {
+      if (volume == 1.0f) pcmmix(dst, tmp, samplecount);
+      else pcmmix(dst, tmp, samplecount, volume);
+    }
+    dst += samplecount;
+    offset += n;
+    framecount -= n;
+  }
+}
+
+template <typename T>
+static size_t MixADPCMFramesWithRate(T *dst, const uint8_t *blocks, size_t src_frame_count,
+                                     size_t channels, size_t *pos, uint32_t *frac, uint64_t step,
+                                     size_t frame_len, float volume, bool cubic,
+                                     std::vector<int8_t> &scratch)
+{
+  // decoding window is kept in caller's scratch, not to use large stack.
+  const size_t window_byte = kCompressWindowFrame * channels * sizeof(T);
+  if (scratch.size() < window_byte)
+    scratch.resize(window_byte);
+  T *window = (T*)scratch.data();
+  size_t mixsize = 0;
+  while (mixsize < frame_len && *pos < src_frame_count)
+  {
+    // decode from previous frame, which is necessary for interpolation.
+    const size_t start = *pos > 0 ? *pos - 1 : 0;
+    const size_t count = std::min(kCompressWindowFrame, src_frame_count - start);
+    DecodeADPCMFrames(window, blocks, start, count, channels);
+
+    // stop before interpolating with frames out of window, unless end of sound.
+    const size_t limit = start + count == src_frame_count ? count : count - 2;
+    size_t local_pos = *pos - start;
+    const uint64_t phase = ((uint64_t)local_pos << 32) | *frac;
+    const uint64_t remain = ((uint64_t)limit << 32) - phase;
+    const size_t len = (size_t)std::min<uint64_t>(frame_len - mixsize, (remain + step - 1) / step);
+    mixsize += pcmmix_rate_template(dst + mixsize * channels, window, count, channels,
+                                    &local_pos, frac, step, len, volume, cubic);
+    *pos = start + local_pos;
+  }
+  return mixsize;
+}
+
+// compressed sound util function end
+
 
 bool operator==(const SoundInfo& a, const SoundInfo& b)
 {
@@ -503,20 +793,113 @@ const SoundInfo& SoundInfo::GetDefaultSoundInfo()
 }
 
 
+// --------------------------- class SoundArena
+
+constexpr size_t kSoundArenaAlign = 16;
+
+SoundArena::SoundArena(size_t chunk_size)
+  : chunk_size_(chunk_size), current_(0) {}
+
+SoundArena::~SoundArena()
+{
+  Clear();
+}
+
+int8_t* SoundArena::Allocate(size_t size)
+{
+  size = (size + kSoundArenaAlign - 1) & ~(kSoundArenaAlign - 1);
+  if (size == 0) size = kSoundArenaAlign;
+  std::lock_guard<std::mutex> lock(lock_);
+  if (current_ < chunks_.size() &&
+      chunks_[current_].size - chunks_[current_].used >= size)
+  {
+    Chunk &c = chunks_[current_];
+    int8_t *p = c.p + c.used;
+    c.used += size;
+    return p;
+  }
+  // large buffer gets its own chunk, so current chunk remains usable.
+  const bool dedicated = size > chunk_size_ / 4;
+  Chunk c;
+  c.size = dedicated ? size : chunk_size_;
+  c.used = size;
+  c.p = (int8_t*)malloc(c.size);
+  RMIXER_ASSERT_M(c.p, "Failed to allocate sound arena chunk.");
+  chunks_.push_back(c);
+  if (!dedicated)
+    current_ = chunks_.size() - 1;
+  return c.p;
+}
+
+void SoundArena::Release(int8_t *p, size_t size)
+{
+  if (!p) return;
+  size = (size + kSoundArenaAlign - 1) & ~(kSoundArenaAlign - 1);
+  if (size == 0) size = kSoundArenaAlign;
+  std::lock_guard<std::mutex> lock(lock_);
+  for (size_t i = chunks_.size(); i > 0; --i)
+  {
+    Chunk &c = chunks_[i - 1];
+    if (p < c.p || p >= c.p + c.size)
+      continue;
+    if (p + size == c.p + c.used)
+      c.used -= size;
+    if (c.used == 0 && i - 1 != current_)
+    {
+      free(c.p);
+      chunks_.erase(chunks_.begin() + (i - 1));
+      if (current_ > i - 1) current_--;
+    }
+    return;
+  }
+  RMIXER_ASSERT_M(0, "Buffer is not allocated from this arena.");
+}
+
+void SoundArena::Clear()
+{
+  std::lock_guard<std::mutex> lock(lock_);
+  for (auto &c : chunks_)
+    free(c.p);
+  chunks_.clear();
+  current_ = 0;
+}
+
+size_t SoundArena::get_used_byte() const
+{
+  std::lock_guard<std::mutex> lock(lock_);
+  size_t r = 0;
+  for (auto &c : chunks_)
+    r += c.used;
+  return r;
+}
+
+size_t SoundArena::get_reserved_byte() const
+{
+  std::lock_guard<std::mutex> lock(lock_);
+  size_t r = 0;
+  for (auto &c : chunks_)
+    r += c.size;
+  return r;
+}
+
+
 // -------------------------------- class Sound
 
-Sound::Sound() : buffer_(nullptr), buffer_size_(0), frame_size_(0),
+Sound::Sound() : buffer_(nullptr), arena_(nullptr), buffer_arena_(nullptr),
+                 compressed_size_(0), buffer_size_(0), frame_size_(0),
                  duration_(.0f), is_loading_(false), is_streaming_(false) {}
 
 Sound::Sound(const SoundInfo& info, size_t buffer_size)
-  : buffer_(nullptr), buffer_size_(buffer_size), frame_size_(0),
+  : buffer_(nullptr), arena_(nullptr), buffer_arena_(nullptr), compressed_size_(0),
+    buffer_size_(buffer_size), frame_size_(0),
     duration_(.0f), is_loading_(false), is_streaming_(false)
 {
   AllocateSize(info, buffer_size);
 }
 
 Sound::Sound(const SoundInfo& info, size_t buffer_size, int8_t *p)
-  : info_(info), buffer_(p), buffer_size_(buffer_size), frame_size_(0),
+  : info_(info), buffer_(p), arena_(nullptr), buffer_arena_(nullptr), compressed_size_(0),
+    buffer_size_(buffer_size), frame_size_(0),
     duration_(.0f), is_loading_(false), is_streaming_(false)
 {
   frame_size_ = GetFrameFromByte(buffer_size, info);
@@ -543,12 +926,13 @@ bool Sound::Load(const std::string& path)
 
 bool Sound::Load(const std::string& path, const SoundInfo& info)
 {
-  rutil::FileData fd;
-  rutil::ReadFileData(path, fd);
-  if (fd.IsEmpty())
+  // file data is shared, as decoded sound may refer it directly.
+  std::shared_ptr<rutil::FileData> fd = std::make_shared<rutil::FileData>();
+  rutil::ReadFileData(path, *fd);
+  if (fd->IsEmpty())
     return false;
   std::string ext = rutil::GetExtension(path);
-  return Load((char*)fd.p, fd.len, ext.c_str(), info);
+  return Load((char*)fd->p, fd->len, ext.c_str(), info, fd);
 }
 
 static inline Decoder *CreateDecoder(const char *sig, const char *ext_hint)
@@ -583,17 +967,19 @@ bool Sound::Load(const char* p, size_t len, const char *ext_hint)
   is_loading_ = true;
   if (decoder->open(p, len))
   {
+    decoder->set_arena(arena_);
     r = (framecount = decoder->read(&buf)) != 0;
 
     if (!r)
     {
       // failure cleanup
-      if (buf) free(buf);
+      if (buf) decoder->release_buffer(buf, 0);
     }
     else
     {
       // set buffer
       SetBuffer(decoder->get_info(), framecount, buf);
+      buffer_arena_ = decoder->get_arena();
     }
   }
   is_loading_ = false;
@@ -603,11 +989,18 @@ bool Sound::Load(const char* p, size_t len, const char *ext_hint)
 }
 
 bool Sound::Load(const char* p, size_t len, const char *ext_hint, const SoundInfo &info)
+{
+  return Load(p, len, ext_hint, info, nullptr);
+}
+
+bool Sound::Load(const char* p, size_t len, const char *ext_hint, const SoundInfo &info,
+                 const std::shared_ptr<const void> &owner)
 {
   Decoder *decoder = nullptr;
   bool r = false;
   size_t framecount = 0;
   char *buf = 0;
+  const char *borrowed = 0;
 
   if (len < 4) return false;
   if (!(decoder = CreateDecoder(p, ext_hint)))
@@ -616,32 +1009,50 @@ bool Sound::Load(const char* p, size_t len, const char *ext_hint, const SoundInf
   is_loading_ = true;
   if (decoder->open(p, len))
   {
-    r = (framecount = decoder->readWithFormat(&buf, info)) != 0;
-
-    if (!r)
+    if (owner && (framecount = decoder->borrow(&borrowed, info)) != 0)
+    {
+      // no decoding is necessary; refer data in place.
+      SetBorrowedBuffer(info, framecount, borrowed, owner);
+      r = true;
+    }
+    else
     {
-      // attempt again with general reader
-      // if not, failure cleanup
-      r = (framecount = decoder->read(&buf)) != 0;
-      if (r)
+      // decode into arena directly only if no resampling is expected.
+      if (decoder->get_info().channels == info.channels &&
+          decoder->get_info().rate == info.rate)
+        decoder->set_arena(arena_);
+      r = (framecount = decoder->readWithFormat(&buf, info)) != 0;
+
+      if (!r)
       {
-        SetBuffer(decoder->get_info(), framecount, buf);
+        // attempt again with general reader
+        // if not, failure cleanup
+        r = (framecount = decoder->read(&buf)) != 0;
+        if (r)
+        {
+          SetBuffer(decoder->get_info(), framecount, buf);
+          buffer_arena_ = decoder->get_arena();
+        }
+        else
+        {
+          if (buf) decoder->release_buffer(buf, 0);
+        }
       }
       else
       {
-        if (buf) free(buf);
+        // set buffer
+        SetBuffer(decoder->get_info(), framecount, buf);
+        buffer_arena_ = decoder->get_arena();
       }
     }
-    else
-    {
-      // set buffer
-      SetBuffer(decoder->get_info(), framecount, buf);
-    }
   }
 
   // do resampling (for channel / rate conversion)
   if (r)
+  {
     r = Resample(info);
+    CommitToArena();
+  }
   else
     Clear();
   is_loading_ = false;
@@ -671,6 +1082,90 @@ bool Sound::Load(const std::unique_ptr<SoundLoadContext> &loadctx)
   }
 }
 
+/* size of head and tail of the file read for probing. */
+constexpr size_t kProbeReadSize = 64 * 1024;
+
+/* @brief probe from p (len byte), which is whole or head and tail of source.
+ * head_len is size of head, and source_len is audio size of whole source. */
+static bool ProbeData(const char* p, size_t len, size_t head_len, size_t source_len,
+                      const char *ext_hint, SoundProbeInfo &out)
+{
+  Decoder *decoder = nullptr;
+  bool r = false;
+
+  if (len < 4) return false;
+  if (!(decoder = CreateDecoder(p, ext_hint)))
+    return false;
+
+  if (decoder->open(p, len))
+    r = decoder->probe(out, head_len, source_len);
+
+  delete decoder;
+  return r;
+}
+
+bool Sound::Probe(const std::string& path, SoundProbeInfo &out)
+{
+  // only head (format) and tail (e.g. OGG last page) of file is read.
+  FILE *fp = rutil::fopen_utf8(path.c_str(), "rb");
+  if (!fp)
+    return false;
+  fseek(fp, 0, SEEK_END);
+  const long filesize = ftell(fp);
+  if (filesize <= 0)
+  {
+    fclose(fp);
+    return false;
+  }
+  const size_t source_len = (size_t)filesize;
+  std::string ext = rutil::GetExtension(path);
+
+  // skip ID3v2 tag (which may contain large album art),
+  // so head starts with audio frames.
+  size_t audio_offset = 0;
+  uint8_t id3[10];
+  if (fseek(fp, 0, SEEK_SET) == 0 && fread(id3, 1, 10, fp) == 10 &&
+      memcmp(id3, "ID3", 3) == 0)
+  {
+    audio_offset = 10 + ((size_t)(id3[6] & 0x7F) << 21 | (size_t)(id3[7] & 0x7F) << 14 |
+                         (size_t)(id3[8] & 0x7F) << 7 | (size_t)(id3[9] & 0x7F));
+    if (id3[5] & 0x10)
+      audio_offset += 10;   /* footer */
+    ext = "mp3";
+  }
+  if (audio_offset >= source_len)
+  {
+    fclose(fp);
+    return false;
+  }
+
+  size_t audio_len = source_len - audio_offset;
+  const size_t head = std::min(audio_len, kProbeReadSize);
+  const size_t tail = std::min(audio_len - head, kProbeReadSize);
+  std::vector<char> buf(head + tail);
+  bool r = fseek(fp, (long)audio_offset, SEEK_SET) == 0 &&
+           fread(buf.data(), 1, head, fp) == head;
+  if (r && tail > 0)
+  {
+    r = fseek(fp, (long)(source_len - tail), SEEK_SET) == 0 &&
+        fread(buf.data() + head, 1, tail, fp) == tail;
+  }
+  fclose(fp);
+  if (!r)
+    return false;
+
+  // ID3v1 tag at end of file is not audio either.
+  if (tail >= 128 && memcmp(buf.data() + head + tail - 128, "TAG", 3) == 0)
+    audio_len -= 128;
+
+  return ProbeData(buf.data(), buf.size(), head, audio_len, ext.c_str(), out);
+}
+
+bool Sound::Probe(const char* p, size_t len, const char *ext_hint, SoundProbeInfo &out)
+{
+  return ProbeData(p, len, len, len, ext_hint, out);
+}
+
 bool Sound::Save(const std::string& path)
 {
   std::map<std::string, std::string> __;
@@ -694,6 +1189,7 @@ bool Sound::Save(const std::string& path,
 
   if (is_empty())
     return false;
+  Decompress();
 
   if (ext == "wav")
     encoder = new Encoder_WAV(*this);
@@ -722,9 +1218,16 @@ void Sound::Clear()
 {
   if (buffer_)
   {
-    free(buffer_);
+    if (buffer_owner_)
+      buffer_owner_.reset();
+    else if (buffer_arena_)
+      buffer_arena_->Release(buffer_, get_memory_byte());
+    else
+      free(buffer_);
     buffer_ = 0;
+    buffer_arena_ = nullptr;
     buffer_size_ = 0;
+    compressed_size_ = 0;
   }
 }
 
@@ -732,6 +1235,7 @@ bool Sound::Resample(const SoundInfo& info)
 {
   // resampling if necessary
   if (!buffer_) return false;
+  Decompress();
   if (get_soundinfo() != info && !is_empty())
   {
     Sound *new_s = new Sound();
@@ -744,6 +1248,7 @@ bool Sound::Resample(const SoundInfo& info)
     if (!new_s->is_empty())
       swap(*new_s);
     delete new_s;
+    CommitToArena();
   }
   info_ = info;
   return true;
@@ -753,6 +1258,7 @@ bool Sound::Effect(double pitch, double tempo, double volume)
 {
   // resampling for pitch / speed / etc.
   // sound quality is not changed by this method.
+  Decompress();
   Effector effector;
   effector.SetPitch(pitch);
   effector.SetTempo(tempo);
@@ -779,7 +1285,14 @@ void Sound::AllocateFrame(const SoundInfo& info, size_t frame_size)
   frame_size_ = frame_size;
   buffer_size_ = GetByteFromFrame(frame_size);
   duration_ = (float)frame_size / info.rate * 1000;
-  buffer_ = (int8_t*)calloc(1, buffer_size_);
+  if (arena_)
+  {
+    buffer_ = arena_->Allocate(buffer_size_);
+    buffer_arena_ = arena_;
+    memset(buffer_, 0, buffer_size_);
+  }
+  else
+    buffer_ = (int8_t*)calloc(1, buffer_size_);
 }
 
 void Sound::AllocateDuration(const SoundInfo& info, uint32_t duration_ms)
@@ -802,6 +1315,103 @@ void Sound::SetEmptyBuffer(const SoundInfo& info, size_t framecount)
   AllocateSize(info, info.channels * info.bitsize / 8 * framecount);
 }
 
+void Sound::SetBorrowedBuffer(const SoundInfo& info, size_t framecount, const void *p,
+                              const std::shared_ptr<const void> &owner)
+{
+  SetBuffer(info, framecount, const_cast<void*>(p));
+  buffer_owner_ = owner;
+}
+
+void Sound::SetArena(SoundArena *arena)
+{
+  arena_ = arena;
+  CommitToArena();
+}
+
+void Sound::CommitToArena()
+{
+  if (!arena_ || !buffer_ || buffer_arena_ || buffer_owner_ || compressed_size_)
+    return;
+  int8_t *p = arena_->Allocate(buffer_size_);
+  memcpy(p, buffer_, buffer_size_);
+  free(buffer_);
+  buffer_ = p;
+  buffer_arena_ = arena_;
+}
+
+void Sound::MakeOwned()
+{
+  if (!buffer_owner_)
+    return;
+  int8_t *p = arena_ ? arena_->Allocate(buffer_size_) : (int8_t*)malloc(buffer_size_);
+  memcpy(p, buffer_, buffer_size_);
+  buffer_ = p;
+  buffer_arena_ = arena_;
+  buffer_owner_.reset();
+}
+
+bool Sound::Compress()
+{
+  if (is_empty() || compressed_size_ || is_streaming_ ||
+      info_.channels == 0 || info_.channels > kMaxCompressChannel)
+    return false;
+  const bool is_float = info_.is_signed == 2 && info_.bitsize == 32;
+  const bool is_s16 = info_.is_signed == 1 && info_.bitsize == 16;
+  if (!is_float && !is_s16)
+    return false;
+
+  const size_t blockcount = (frame_size_ + kCompressBlockFrame - 1) / kCompressBlockFrame;
+  const size_t size = blockcount * GetADPCMBlockSize(info_.channels);
+  uint8_t *blocks = (uint8_t*)malloc(size);
+  RMIXER_ASSERT(blocks);
+  if (is_float)
+    EncodeADPCMBlocks(blocks, (const float*)buffer_, frame_size_, info_.channels);
+  else
+    EncodeADPCMBlocks(blocks, (const int16_t*)buffer_, frame_size_, info_.channels);
+
+  // release PCM first, so arena may reuse its space.
+  const size_t pcm_size = buffer_size_;
+  Clear();
+  buffer_size_ = pcm_size;
+  compressed_size_ = size;
+  if (arena_)
+  {
+    buffer_ = arena_->Allocate(size);
+    memcpy(buffer_, blocks, size);
+    buffer_arena_ = arena_;
+    free(blocks);
+  }
+  else
+    buffer_ = (int8_t*)blocks;
+  return true;
+}
+
+void Sound::Decompress()
+{
+  if (!compressed_size_)
+    return;
+  // decompressed buffer is malloc'd, as compressed block is still in use
+  // while decoding; arena block would be allocated before it is released.
+  int8_t *p = (int8_t*)malloc(buffer_size_);
+  RMIXER_ASSERT(p);
+  if (info_.is_signed == 2)
+    DecodeADPCMFrames((float*)p, (const uint8_t*)buffer_, 0, frame_size_, info_.channels);
+  else
+    DecodeADPCMFrames((int16_t*)p, (const uint8_t*)buffer_, 0, frame_size_, info_.channels);
+
+  const size_t pcm_size = buffer_size_;
+  Clear();
+  buffer_ = p;
+  buffer_size_ = pcm_size;
+}
+
+bool Sound::is_compressed() const { return compressed_size_ > 0; }
+
+size_t Sound::get_memory_byte() const
+{
+  return compressed_size_ ? compressed_size_ : buffer_size_;
+}
+
 const SoundInfo& Sound::get_soundinfo() const
 {
   return info_;
@@ -843,6 +1453,17 @@ float Sound::GetSoundLevel(size_t offset, size_t sample_len) const
     sample_len);
   const size_t sampleoffset = offset * info_.channels;
   if (scansize == 0) return .0f;
+  if (compressed_size_)
+  {
+    // level of decoded 16bit samples, scanned within a block.
+    int16_t tmp[kCompressBlockFrame * kMaxCompressChannel];
+    const size_t n = std::min(scansize, kCompressBlockFrame * info_.channels);
+    DecodeADPCMFrames(tmp, (const uint8_t*)buffer_, offset,
+                      (n + info_.channels - 1) / info_.channels, info_.channels);
+    for (size_t i = 0; i < n; ++i)
+      levelsum += std::abs((int)tmp[i]);
+    return (levelsum / n) / 32768.0f;
+  }
   uint64_t maxval = 0;
 
   /* sum up samples */
@@ -922,8 +1543,19 @@ float Sound::GetSoundLevel(size_t offset, size_t sample_len) const
   return (levelsum / scansize) / (float)maxval;
 }
 
-const int8_t* Sound::get_ptr() const { return buffer_; }
-int8_t* Sound::get_ptr() { return buffer_; }
+const int8_t* Sound::get_ptr() const
+{
+  RMIXER_ASSERT_M(!compressed_size_, "Compressed sound has no PCM buffer.");
+  return buffer_;
+}
+
+int8_t* Sound::get_ptr()
+{
+  // copy-on-write: borrowed buffer must not be modified.
+  Decompress();
+  MakeOwned();
+  return buffer_;
+}
 
 bool Sound::is_empty() const
 {
@@ -942,6 +1574,8 @@ bool Sound::is_loaded() const
 
 bool Sound::is_streaming() const { return is_streaming_; }
 
+bool Sound::is_borrowed() const { return (bool)buffer_owner_; }
+
 size_t Sound::GetByteFromSample(size_t sample_len) const
 {
   return rmixer::GetByteFromSample(sample_len, info_);
@@ -955,6 +1589,8 @@ size_t Sound::GetByteFromFrame(size_t frame_len) const
 size_t Sound::Mix(int8_t *copy_to, size_t *offset, size_t frame_len) const
 {
   if (is_empty()) return 0;
+  if (compressed_size_)
+    return MixCompressed((int8_t*)copy_to, offset, frame_len, 1.0f, false);
   // mixsize : frame count
   const size_t mixsize = std::min(frame_size_ - *offset, frame_len);
   const size_t smixsize = mixsize * info_.channels;
@@ -1020,6 +1656,8 @@ size_t Sound::Mix(int8_t *copy_to, size_t *offset, size_t frame_len) const
 size_t Sound::MixWithVolume(int8_t *copy_to, size_t *offset, size_t frame_len, float volume) const
 {
   if (is_empty()) return 0;
+  if (compressed_size_)
+    return MixCompressed((int8_t*)copy_to, offset, frame_len, volume, false);
   const size_t mixsize = std::min(frame_size_ - *offset, frame_len);
   const size_t smixsize = mixsize * info_.channels;
   const size_t soffset = *offset * info_.channels;
@@ -1080,9 +1718,89 @@ size_t Sound::MixWithVolume(int8_t *copy_to, size_t *offset, size_t frame_len, f
   return mixsize;
 }
 
+size_t Sound::MixWithRate(int8_t *copy_to, size_t *offset, uint32_t *offset_frac, uint64_t step,
+                          size_t frame_len, float volume, bool cubic,
+                          std::vector<int8_t> *scratch) const
+{
+  if (is_empty()) return 0;
+  const size_t ch = info_.channels;
+  size_t mixsize = 0;
+  if (compressed_size_)
+  {
+    std::vector<int8_t> temp_scratch;
+    std::vector<int8_t> &window = scratch ? *scratch : temp_scratch;
+    if (info_.is_signed == 2)
+      return MixADPCMFramesWithRate((float*)copy_to, (const uint8_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic, window);
+    return MixADPCMFramesWithRate((int16_t*)copy_to, (const uint8_t*)buffer_, frame_size_, ch,
+      offset, offset_frac, step, frame_len, volume, cubic, window);
+  }
+  if (info_.is_signed == 0)
+  {
+    switch (info_.bitsize)
+    {
+    case 8:
+      mixsize = pcmmix_rate_template((uint8_t*)copy_to, (uint8_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    case 16:
+      mixsize = pcmmix_rate_template((uint16_t*)copy_to, (uint16_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    case 32:
+      mixsize = pcmmix_rate_template((uint32_t*)copy_to, (uint32_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    default:
+      /* 24bit unsigned audio is not supported */
+      RMIXER_ASSERT(0);
+    }
+  }
+  else if (info_.is_signed == 1)
+  {
+    switch (info_.bitsize)
+    {
+    case 8:
+      mixsize = pcmmix_rate_template((int8_t*)copy_to, (int8_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    case 16:
+      mixsize = pcmmix_rate_template((int16_t*)copy_to, (int16_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    case 32:
+      mixsize = pcmmix_rate_template((int32_t*)copy_to, (int32_t*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    default:
+      /* 24bit audio is not supported for rate mixing */
+      RMIXER_ASSERT(0);
+    }
+  }
+  else if (info_.is_signed == 2)
+  {
+    switch (info_.bitsize)
+    {
+    case 32:
+      mixsize = pcmmix_rate_template((float*)copy_to, (float*)buffer_, frame_size_, ch,
+        offset, offset_frac, step, frame_len, volume, cubic);
+      break;
+    default:
+      RMIXER_ASSERT(0);
+    }
+  }
+  else
+  {
+    RMIXER_THROW("Unsupported PCM type.");
+  }
+  return mixsize;
+}
+
 size_t Sound::Copy(int8_t *p, size_t *offset, size_t frame_len) const
 {
   if (is_empty()) return 0;
+  if (compressed_size_)
+    return MixCompressed((int8_t*)p, offset, frame_len, 1.0f, true);
   const size_t mixsize = std::min(frame_size_ - *offset, frame_len);
   const size_t smixsize = mixsize * info_.channels;
   const size_t soffset = *offset * info_.channels;
@@ -1146,6 +1864,8 @@ size_t Sound::Copy(int8_t *p, size_t *offset, size_t frame_len) const
 size_t Sound::CopyWithVolume(int8_t *p, size_t *offset, size_t frame_len, float volume) const
 {
   if (is_empty()) return 0;
+  if (compressed_size_)
+    return MixCompressed((int8_t*)p, offset, frame_len, volume, true);
   const size_t mixsize = std::min(frame_size_ - *offset, frame_len);
   const size_t smixsize = mixsize * info_.channels;
   const size_t soffset = *offset * info_.channels;
@@ -1206,14 +1926,31 @@ size_t Sound::CopyWithVolume(int8_t *p, size_t *offset, size_t frame_len, float
   return mixsize;
 }
 
+size_t Sound::MixCompressed(int8_t *copy_to, size_t *offset, size_t frame_len,
+                            float volume, bool copy) const
+{
+  const size_t mixsize = std::min(frame_size_ - *offset, frame_len);
+  if (info_.is_signed == 2)
+    MixADPCMFrames((float*)copy_to, (const uint8_t*)buffer_, *offset, mixsize,
+                   info_.channels, volume, copy);
+  else
+    MixADPCMFrames((int16_t*)copy_to, (const uint8_t*)buffer_, *offset, mixsize,
+                   info_.channels, volume, copy);
+  *offset += mixsize;
+  return mixsize;
+}
+
 void Sound::swap(Sound &s)
 {
   std::swap(name_, s.name_);
   std::swap(info_, s.info_);
   std::swap(buffer_, s.buffer_);
+  std::swap(buffer_arena_, s.buffer_arena_);
+  std::swap(buffer_owner_, s.buffer_owner_);
   std::swap(duration_, s.duration_);
   std::swap(is_loading_, s.is_loading_);    // XXX: is it okay?
   std::swap(buffer_size_, s.buffer_size_);
+  std::swap(compressed_size_, s.compressed_size_);
   std::swap(frame_size_, s.frame_size_);
 }
 
@@ -1223,21 +1960,23 @@ void Sound::copy(const Sound &src)
   name_ = src.name_;
   info_ = src.info_;
   buffer_size_ = src.buffer_size_;
+  compressed_size_ = src.compressed_size_;
   frame_size_ = src.frame_size_;
   duration_ = src.duration_;
-  buffer_ = (int8_t*)malloc(buffer_size_);
-  memcpy(buffer_, src.buffer_, buffer_size_);
+  buffer_ = (int8_t*)malloc(src.get_memory_byte());
+  memcpy(buffer_, src.buffer_, src.get_memory_byte());
   is_loading_ = false;
 }
 
 Sound* Sound::clone() const
 {
   Sound *s = new Sound();
-  s->buffer_ = (int8_t*)malloc(buffer_size_);
-  memcpy(s->buffer_, buffer_, buffer_size_);
+  s->buffer_ = (int8_t*)malloc(get_memory_byte());
+  memcpy(s->buffer_, buffer_, get_memory_byte());
   s->info_ = info_;
   s->is_loading_ = false;   // always false for duplicated object
   s->buffer_size_ = buffer_size_;
+  s->compressed_size_ = compressed_size_;
   s->frame_size_ = frame_size_;
   s->duration_ = duration_;
   return s;
@@ -1313,7 +2052,7 @@ std::string Sound::toString() const
     }
     p = tmp + sprintf(tmp, "PCMSound %dHz / %dCh / %dBit (%s), Frame %lu, Size %lu",
       s.rate, s.channels, s.bitsize, typestr, frame_size_, buffer_size_);
-    if (enable_detailed_log)
+    if (enable_detailed_log && !compressed_size_)
     {
       if (frame_size_ > 128)
       {
@@ -1338,6 +2077,17 @@ void Sound::EnableDetailedLog(bool v)
   enable_detailed_log = v;
 }
 
+void Sound::EnableSIMD(bool v)
+{
+  enable_simd = v;
+  Midi::EnableSIMD(v);
+}
+
+bool Sound::is_simd_enabled()
+{
+  return enable_simd.load(std::memory_order_relaxed);
+}
+
 #if 0
 SoundVariableBuffer::SoundVariableBuffer(const SoundInfo& info, size_t chunk_byte_size)
   : PCMBuffer(info, 0), chunk_byte_size_(chunk_byte_size),
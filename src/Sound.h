@@ -6,6 +6,7 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <mutex>
 
 namespace rmixer
 {
@@ -60,6 +61,65 @@ struct SoundLoadContext
   SoundInfo target_soundinfo;
 };
 
+/**
+ * @brief
+ * Sound file information acquired from headers, without decoding.
+ */
+struct SoundProbeInfo
+{
+  SoundInfo info;         /* format of decoded PCM */
+  uint64_t frame_count;   /* 0 if unknown */
+  size_t byte_size;       /* estimated size of decoded PCM */
+  float duration;         /* in milisecond */
+};
+
+/* frame count of each block of compressed sound. */
+constexpr size_t kCompressBlockFrame = 256;
+
+/* default chunk size of SoundArena. */
+constexpr size_t kSoundArenaChunkSize = 8 * 1024 * 1024;
+
+/**
+ * @brief
+ * Arena allocator for PCM buffers of many sounds (e.g. keysounds of a chart).
+ * Buffers are carved from large chunks so loading many small sounds won't
+ * fragment heap, and all of them are released at once by Clear().
+ * Multi-thread safe.
+ */
+class SoundArena
+{
+public:
+  SoundArena(size_t chunk_size = kSoundArenaChunkSize);
+  ~SoundArena();
+  SoundArena(const SoundArena&) = delete;
+  SoundArena& operator=(const SoundArena&) = delete;
+
+  int8_t* Allocate(size_t size);
+
+  /* @brief give back buffer to arena.
+   * memory is reused only if it is the last allocation of its chunk. */
+  void Release(int8_t *p, size_t size);
+
+  /* @brief release all buffers.
+   * @warn sounds using buffer of this arena must be cleared first. */
+  void Clear();
+
+  size_t get_used_byte() const;
+  size_t get_reserved_byte() const;
+
+private:
+  struct Chunk
+  {
+    int8_t *p;
+    size_t size;
+    size_t used;
+  };
+  std::vector<Chunk> chunks_;
+  size_t chunk_size_;
+  size_t current_;    /* index of chunk to allocate from */
+  mutable std::mutex lock_;
+};
+
 /**
  * @brief
  * PCM sound data.
@@ -79,8 +139,18 @@ public:
   bool Load(const std::string& path, const SoundInfo& info);
   bool Load(const char* p, size_t len, const char *ext_hint);
   bool Load(const char* p, size_t len, const char *ext_hint, const SoundInfo &info);
+
+  /* @brief load sound, referencing PCM data of p in place if it is already
+   * stored in target format (e.g. uncompressed WAV).
+   * owner keeps p alive while this sound refers it. */
+  bool Load(const char* p, size_t len, const char *ext_hint, const SoundInfo &info,
+            const std::shared_ptr<const void> &owner);
   bool Load(const std::unique_ptr<SoundLoadContext> &loadctx);
   bool Save(const std::string& path);
+
+  /* @brief read format and length of sound file without decoding. */
+  static bool Probe(const std::string& path, SoundProbeInfo &out);
+  static bool Probe(const char* p, size_t len, const char *ext_hint, SoundProbeInfo &out);
   bool Save(const std::string& path, const SoundInfo &info);
   bool Save(const std::string& path,
     const std::map<std::string, std::string> &metadata,
@@ -94,6 +164,25 @@ public:
   void AllocateDuration(const SoundInfo& info, uint32_t duration_ms);
   void SetBuffer(const SoundInfo& info, size_t framecount, void*);
   void SetEmptyBuffer(const SoundInfo& info, size_t framecount);
+
+  /* @brief use buffer which is not owned by this sound.
+   * owner keeps the buffer alive, and the buffer is copied when modification
+   * is necessary (copy-on-write). */
+  void SetBorrowedBuffer(const SoundInfo& info, size_t framecount, const void *p,
+                         const std::shared_ptr<const void> &owner);
+
+  /* @brief allocate PCM buffer of this sound from arena.
+   * current buffer is moved into arena if exists.
+   * @warn arena must outlive this sound. */
+  void SetArena(SoundArena *arena);
+
+  /* @brief keep PCM as block IMA ADPCM (lossy, 4x smaller than S16),
+   * which is decoded block-by-block while mixing.
+   * only S16 / F32 sound is supported. PCM is restored by Decompress(),
+   * or when buffer is accessed for modification (e.g. Resample). */
+  bool Compress();
+  void Decompress();
+
   bool Effect(double pitch, double tempo, double volume);
   bool Resample(const SoundInfo& new_info);
   bool SetSoundFormat(const SoundInfo& info); /* alias to Resample */
@@ -110,6 +199,11 @@ public:
   bool is_loading() const;
   bool is_loaded() const;
   bool is_streaming() const;
+  bool is_borrowed() const;
+  bool is_compressed() const;
+
+  /* @brief actual memory size of buffer (compressed size if compressed). */
+  size_t get_memory_byte() const;
   size_t GetByteFromSample(size_t sample_len) const;
   size_t GetByteFromFrame(size_t frame_len) const;
 
@@ -126,12 +220,31 @@ public:
   virtual size_t Copy(int8_t *p, size_t *offset, size_t sample_len) const;
   virtual size_t CopyWithVolume(int8_t *p, size_t *offset, size_t sample_len, float volume) const;
 
+  /**
+   * @brief   Mix PCM data with playback rate (resampled while mixing).
+   * @param   offset      source buffer offset (in frame)
+   * @param   offset_frac fractional part of source offset (0.32 fixed-point)
+   * @param   step        source frame advance per output frame (32.32 fixed-point)
+   * @param   cubic       use cubic interpolation instead of linear
+   * @param   scratch     decoding buffer of compressed sound, reused by caller
+   *                      (allocated for each call if not given)
+   * @return  filled buffer size in frame count
+   */
+  size_t MixWithRate(int8_t *copy_to, size_t *offset, uint32_t *offset_frac, uint64_t step,
+                     size_t frame_len, float volume, bool cubic,
+                     std::vector<int8_t> *scratch = nullptr) const;
+
   void swap(Sound &s);
   void copy(const Sound &src);
   Sound* clone() const;
   std::string toString() const;
 
   static void EnableDetailedLog(bool enable_detailed_log);
+
+  /* @brief use SIMD kernels if compiled in (default on).
+   * disabling gives scalar reference output, e.g. for testing kernels. */
+  static void EnableSIMD(bool enable_simd);
+  static bool is_simd_enabled();
   friend class Mixer;
 
 private:
@@ -139,9 +252,18 @@ private:
 
   SoundInfo info_;
   int8_t* buffer_;
+  SoundArena* arena_;         /* arena to allocate buffer from (optional) */
+  SoundArena* buffer_arena_;  /* arena which owns buffer_, null if malloc'd */
+  std::shared_ptr<const void> buffer_owner_;  /* owner of borrowed buffer_, null if owned */
+  size_t compressed_size_;  /* ADPCM size of buffer_, 0 if PCM */
   float duration_;      /* in milisecond */
   volatile bool is_loading_;  /* if sound is currently loading */
 
+  void CommitToArena();
+  void MakeOwned();
+  size_t MixCompressed(int8_t *copy_to, size_t *offset, size_t frame_len,
+                       float volume, bool copy) const;
+
 protected:
   size_t buffer_size_;  /* buffer size in byte */
   size_t frame_size_;
@@ -2,9 +2,13 @@
 #include "Error.h"
 #include "Mixer.h"
 #include "Midi.h"
+#include "Effector.h"
+#include "Encoder.h"
 
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <thread>
 #include <memory.h>
 
 namespace rmixer
@@ -17,6 +21,24 @@ enum InternalMidiEvents
   kEffect,
 };
 
+enum LoadFileStates
+{
+  kFileQueued,
+  kFileLoading,
+  kFileDone,
+};
+
+constexpr size_t kRecordBlockFrame = 4096;
+constexpr size_t kNoFile = static_cast<size_t>(-1);
+constexpr float kNeverUsed = std::numeric_limits<float>::max();
+
+/* @brief entries of archive cannot be probed by path. */
+static bool IsArchivePath(const std::string &path)
+{
+  const std::string ext = rutil::lower(rutil::GetExtension(path));
+  return ext == "zip" || ext == "rar" || ext == "7z" || ext == "lzh";
+}
+
 // ---------------------------- class SoundPool
 
 SoundPool::SoundPool(Mixer *mixer, size_t pool_size)
@@ -46,20 +68,32 @@ bool SoundPool::LoadSound(size_t channel, const std::string& path)
 {
   Sound* s = mixer_->CreateSound(path.c_str());
   if (!s) return false;
-  channels_[channel] = mixer_->PlaySound(s, false);
-  channels_[channel]->LockChannel();
-  return true;
+  return BindSound(channel, s);
 }
 
 bool SoundPool::LoadSound(size_t channel, const char* p, size_t len, const char *name)
 {
   Sound* s = mixer_->CreateSound(p, len, name, false);
   if (!s) return false;
+  return BindSound(channel, s);
+}
+
+bool SoundPool::BindSound(size_t channel, Sound *s)
+{
   channels_[channel] = mixer_->PlaySound(s, false);
+  if (!channels_[channel]) return false;
   channels_[channel]->LockChannel();
   return true;
 }
 
+void SoundPool::UnbindSound(size_t channel)
+{
+  if (!channels_[channel]) return;
+  channels_[channel]->SetSound(nullptr);
+  channels_[channel]->UnlockChannel();
+  channels_[channel] = nullptr;
+}
+
 void SoundPool::Play(size_t lane)
 {
   if (channels_[lane])
@@ -85,6 +119,7 @@ void SoundPool::StopMidi(uint8_t lane, uint8_t key)
 }
 
 Mixer *SoundPool::get_mixer() { return mixer_; }
+size_t SoundPool::get_pool_size() const { return pool_size_; }
 Channel* SoundPool::get_channel(size_t ch) { return channels_[ch]; }
 const Mixer *SoundPool::get_mixer() const { return mixer_; }
 const Channel* SoundPool::get_channel(size_t ch) const { return channels_[ch]; }
@@ -102,21 +137,30 @@ const MidiChannel* SoundPool::get_midi_channel(uint8_t ch) const
 // ----------------- class KeySoundPoolWithTime
 
 KeySoundPoolWithTime::KeySoundPoolWithTime(Mixer *mixer, size_t pool_size)
-  : SoundPool(mixer, pool_size), time_(0), is_autoplay_(false), lane_count_(0),
-    loading_progress_(0), loading_finished_(true),
-    volume_base_(1.0f)
+  : SoundPool(mixer, pool_size), offline_midi_(false), time_(0), is_autoplay_(false),
+    lane_count_(0), file_ready_idx_(0), file_done_count_(0),
+    total_load_byte_(0), loading_progress_(0), loading_finished_(true),
+    loader_stop_(false),
+    volume_base_(1.0f), variant_pitch_(1.0), variant_tempo_(1.0),
+    memory_budget_(0), resident_byte_(0), prefetch_time_(0), is_budget_warned_(false),
+    prefetch_stop_(false),
+    compress_threshold_(0)
 {
   memset(lane_mapping_, 0, sizeof(lane_mapping_));
   memset(lane_idx_, 0, sizeof(lane_idx_));
 }
 
+KeySoundPoolWithTime::~KeySoundPoolWithTime()
+{
+  StopLoading();
+  ClearVariantCache();
+  ClearLazySounds();
+}
+
 void KeySoundPoolWithTime::LoadFromChartAndSound(const rparser::Chart& c)
 {
   LoadFromChart(c);
-  while (!is_loading_finished())
-  {
-    LoadRemainingSound();
-  }
+  LoadRemainingSoundParallel(0);
 }
 
 void KeySoundPoolWithTime::LoadFromChart(const rparser::Chart& c)
@@ -124,19 +168,35 @@ void KeySoundPoolWithTime::LoadFromChart(const rparser::Chart& c)
   using namespace rparser;
 
   // clear loading context
+  StopLoading();
+  ClearLazySounds();
   loading_finished_ = false;
   loading_progress_ = 0.;
   file_load_idx_ = 0;
+  file_ready_idx_ = 0;
+  file_done_count_ = 0;
   files_to_load_.clear();
+  file_state_.clear();
+  channel_file_idx_.assign(get_pool_size(), kNoFile);
+  probed_duration_.assign(get_pool_size(), 0.f);
+  total_load_byte_ = 0;
 
   // prepare desc for loading
   // if no directory, then it must be Midi sequenced file (e.g. VOS)
   // so don't prepare loading list.
   bool is_midi = true;
   Directory *dir = c.GetParent()->GetDirectory();
+  free_dirs_.clear();
+  dir_path_.clear();
   if (dir)
   {
     dir->SetAlternativeSearch(true);
+    dir_path_ = dir->GetPath();
+    std::shared_ptr<DirectoryHandle> handle = AcquireDirectory();
+    if (handle)
+      ReleaseDirectory(handle);
+    else
+      dir_path_.clear();
     const auto &md = c.GetMetaData();
     for (auto &ii : md.GetSoundChannel()->fn)
     {
@@ -144,7 +204,7 @@ void KeySoundPoolWithTime::LoadFromChart(const rparser::Chart& c)
       if (dir)
       {
         files_to_load_.push_back({
-          filename, ii.first, dir
+          filename, ii.first, dir, 0, kNeverUsed
           });
       }
     }
@@ -249,55 +309,342 @@ void KeySoundPoolWithTime::LoadFromChart(const rparser::Chart& c)
   }
 
   lane_count_ = c.GetNoteData().get_track_count();
+  if (memory_budget_ > 0)
+  {
+    lazy_sounds_.assign(get_pool_size(), { nullptr, 0, -1.f, false, false });
+    prefetch_thread_ = std::thread(&KeySoundPoolWithTime::RunPrefetchThread, this);
+  }
 
   // sort keyevents by time
   for (size_t i = 0; i <= lane_count_; ++i)
     std::sort(lane_time_mapping_[i].begin(), lane_time_mapping_[i].end());
 
+  // load sounds in order of first use, so playback can start
+  // before whole sounds are loaded.
+  {
+    std::vector<float> first_use(get_pool_size(), kNeverUsed);
+    trigger_count_.assign(get_pool_size(), 0);
+    for (size_t i = 0; i <= lane_count_; ++i)
+    {
+      for (auto &keyevt : lane_time_mapping_[i])
+      {
+        if (keyevt.is_midi_channel || keyevt.channel >= first_use.size())
+          continue;
+        first_use[keyevt.channel] = std::min(first_use[keyevt.channel], keyevt.time);
+        if (keyevt.event_type == InternalMidiEvents::kNoteOn)
+          trigger_count_[keyevt.channel]++;
+      }
+    }
+    for (auto &ld : files_to_load_)
+    {
+      if (ld.channel < first_use.size())
+        ld.first_use = first_use[ld.channel];
+    }
+
+    // probe files on disk by reading only their heads, so PCM size and
+    // length of sounds are known before decoding.
+    // archive entries are probed by loading thread as they're extracted.
+    if (!dir_path_.empty() && !IsArchivePath(dir_path_))
+    {
+      std::string dir_path = dir_path_;
+      if (dir_path.back() != '/' && dir_path.back() != '\\')
+        dir_path += '/';
+      for (size_t i = 0; i < files_to_load_.size(); ++i)
+      {
+        SoundProbeInfo probe;
+        if (!Sound::Probe(dir_path + files_to_load_[i].filename, probe))
+          continue;
+        std::lock_guard<std::mutex> lock(loading_mutex_);
+        SetProbeInfo(i, probe);
+      }
+    }
+
+    // sounds first used at same time are loaded largest-first,
+    // so parallel workers finish them at similar time.
+    std::stable_sort(files_to_load_.begin(), files_to_load_.end(),
+      [](const LoadFileDesc &a, const LoadFileDesc &b) {
+        if (a.first_use != b.first_use)
+          return a.first_use < b.first_use;
+        return a.byte_size > b.byte_size;
+      });
+    file_state_.assign(files_to_load_.size(), kFileQueued);
+    for (size_t i = 0; i < files_to_load_.size(); ++i)
+    {
+      if (files_to_load_[i].channel < channel_file_idx_.size())
+        channel_file_idx_[files_to_load_[i].channel] = i;
+    }
+  }
+
   // whole load finished
   loading_progress_ = 1.0;
+  loading_finished_ = files_to_load_.empty();
 }
 
 void KeySoundPoolWithTime::LoadRemainingSound()
 {
-  std::string filename;
-  size_t channel;
-  rparser::Directory *dir;
-  const char* p;
-  size_t len;
+  size_t file_idx;
+  if (ClaimNextFile(file_idx))
+    LoadFile(file_idx);
+}
 
+void KeySoundPoolWithTime::LoadRemainingSoundParallel(unsigned thread_count)
+{
+  if (thread_count == 0)
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+  // each worker extracts a file and decodes it immediately, in timeline order.
+  auto worker = [this]() {
+    size_t file_idx;
+    while (ClaimNextFile(file_idx))
+      LoadFile(file_idx);
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < thread_count; ++i)
+    workers.emplace_back(worker);
+  worker();
+  for (auto &t : workers)
+    t.join();
+}
+
+void KeySoundPoolWithTime::StartLoading(unsigned thread_count)
+{
+  if (!loader_threads_.empty())
+    return;
+  if (thread_count == 0)
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+  // same as LoadRemainingSoundParallel(), but without waiting for workers.
+  auto worker = [this]() {
+    size_t file_idx;
+    while (ClaimNextFile(file_idx))
+      LoadFile(file_idx);
+  };
+  for (unsigned i = 0; i < thread_count; ++i)
+    loader_threads_.emplace_back(worker);
+}
+
+void KeySoundPoolWithTime::StopLoading()
+{
   loading_mutex_.lock();
+  loader_stop_ = true;
+  loading_mutex_.unlock();
+  for (auto &t : loader_threads_)
+    t.join();
+  loader_threads_.clear();
+  loading_mutex_.lock();
+  loader_stop_ = false;
+  loading_mutex_.unlock();
+}
+
+bool KeySoundPoolWithTime::ClaimNextFile(size_t &file_idx)
+{
+  std::lock_guard<std::mutex> lock(loading_mutex_);
+  if (loader_stop_)
+    return false;
+  while (file_load_idx_ < files_to_load_.size() &&
+         file_state_[file_load_idx_] != kFileQueued)
+    file_load_idx_++;
   if (file_load_idx_ >= files_to_load_.size())
   {
-    // cannot read more ...
-    loading_finished_ = true;
-    loading_progress_ = 1.0;
-    loading_mutex_.unlock();
+    // cannot read more ... (some may be still loading by other thread)
+    return false;
+  }
+  file_idx = file_load_idx_++;
+  file_state_[file_idx] = kFileLoading;
+  return true;
+}
+
+std::shared_ptr<KeySoundPoolWithTime::DirectoryHandle> KeySoundPoolWithTime::AcquireDirectory()
+{
+  std::lock_guard<std::mutex> lock(extract_mutex_);
+  std::shared_ptr<DirectoryHandle> handle;
+  if (!free_dirs_.empty())
+  {
+    handle = free_dirs_.back();
+    free_dirs_.pop_back();
+  }
+  else if (!dir_path_.empty())
+  {
+    // no idle handle; open another one for this thread.
+    handle = std::make_shared<DirectoryHandle>();
+    handle->dir.reset(rparser::DirectoryFactory::Create().Open(dir_path_));
+    if (handle->dir)
+      handle->dir->SetAlternativeSearch(true);
+    else
+      handle.reset();
+  }
+  return handle;
+}
+
+void KeySoundPoolWithTime::ReleaseDirectory(const std::shared_ptr<DirectoryHandle> &handle)
+{
+  std::lock_guard<std::mutex> lock(extract_mutex_);
+  free_dirs_.push_back(handle);
+}
+
+KeySoundPoolWithTime::ExtractedFile::ExtractedFile(KeySoundPoolWithTime *pool)
+  : pool(pool), p(nullptr), len(0) {}
+
+KeySoundPoolWithTime::ExtractedFile::~ExtractedFile()
+{
+  if (handle)
+    pool->ReleaseDirectory(handle);
+}
+
+bool KeySoundPoolWithTime::ExtractFile(const LoadFileDesc &ld, ExtractedFile &f)
+{
+  // each thread extracts with its own handle, so archives are read in parallel.
+  f.handle = AcquireDirectory();
+  if (f.handle)
+  {
+    std::shared_ptr<DirectoryHandle> handle = f.handle;
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    if (handle->dir->GetFile(ld.filename, &f.p, f.len))
+    {
+      // extracted data is kept by handle until its last owner is gone.
+      const std::string filename = ld.filename;
+      handle->refs[filename]++;
+      f.owner = std::shared_ptr<const void>(f.p, [handle, filename](const void*) {
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        if (--handle->refs[filename] == 0)
+        {
+          handle->refs.erase(filename);
+          handle->dir->Unload(filename);
+        }
+      });
+      return true;
+    }
+  }
+
+  // song directory is not owned by pool, so data cannot be referred.
+  // it is a single handle shared with others, so serialize it.
+  std::lock_guard<std::mutex> lock(extract_mutex_);
+  f.owner.reset();
+  return ((rparser::Directory*)ld.dir)->GetFile(ld.filename, &f.p, f.len);
+}
+
+void KeySoundPoolWithTime::LoadChannelNow(size_t channel)
+{
+  if (channel >= channel_file_idx_.size() || channel_file_idx_[channel] == kNoFile)
+    return;
+  const size_t file_idx = channel_file_idx_[channel];
+
+  // steal the file if it is not taken by loading thread yet,
+  // or wait for loading thread so the trigger is not dropped.
+  std::unique_lock<std::mutex> lock(loading_mutex_);
+  if (file_state_[file_idx] == kFileLoading)
+  {
+    file_done_cond_.wait(lock, [this, file_idx]() {
+      return file_state_[file_idx] == kFileDone;
+    });
     return;
   }
-  auto &ld = files_to_load_[file_load_idx_];
-  dir = (rparser::Directory*)ld.dir;
-  filename = ld.filename;
-  channel = ld.channel;
-  file_load_idx_++;
+  if (file_state_[file_idx] != kFileQueued)
+    return;
+  file_state_[file_idx] = kFileLoading;
+  lock.unlock();
+
+  LoadFile(file_idx);
+}
+
+Channel* KeySoundPoolWithTime::GetBoundChannel(size_t channel)
+{
+  // channel is bound by loading thread, so read it under loading lock.
+  loading_mutex_.lock();
+  Channel *ch = get_channel(channel);
+  loading_mutex_.unlock();
+  if (ch)
+    return ch;
+
+  // sound not reached by loading thread yet; load it right now.
+  LoadChannelNow(channel);
+  loading_mutex_.lock();
+  ch = get_channel(channel);
   loading_mutex_.unlock();
+  return ch;
+}
+
+void KeySoundPoolWithTime::LoadFile(size_t file_idx)
+{
+  const auto &ld = files_to_load_[file_idx];
+  const std::string &filename = ld.filename;
+  const size_t channel = ld.channel;
 
-  if (!dir->GetFile(filename, &p, len))
+  if (memory_budget_ > 0)
   {
-    std::cerr << "Missing sound file: " << filename
-      << " (" << channel << ")" << std::endl;
-    return;
+    // on-demand mode: only probe and register empty sound,
+    // decoded later by Update(). files on disk are already probed.
+    SoundProbeInfo probe;
+    bool is_probed = false;
+    if (ld.byte_size == 0)
+    {
+      ExtractedFile f(this);
+      is_probed = ExtractFile(ld, f) &&
+        Sound::Probe(f.p, f.len, rutil::GetExtension(filename).c_str(), probe);
+    }
+    Sound *s = new Sound();
+    s->set_name(filename);
+    loading_mutex_.lock();
+    if (is_probed)
+      SetProbeInfo(file_idx, probe);
+    if (channel < lazy_sounds_.size() && !lazy_sounds_[channel].sound &&
+        BindSound(channel, s))
+    {
+      // other fields are updated by Update() without lock.
+      lazy_sounds_[channel].file_idx = file_idx;
+      lazy_sounds_[channel].sound = s;
+    }
+    else
+      delete s;
+    loading_mutex_.unlock();
   }
-  if (!LoadSound(channel, p, len))
+  else
   {
-    std::cerr << "Failed loading sound file: " << filename
-      << " (" << channel << ")" << std::endl;
-    return;
+    // decode without lock, and only bind channel exclusively.
+    Sound *s = nullptr;
+    bool is_found;
+    {
+      ExtractedFile f(this);
+      is_found = ExtractFile(ld, f);
+      if (is_found)
+      {
+        s = get_mixer()->CreateSound(f.p, f.len, nullptr, f.owner);
+        if (s && is_rarely_used(channel))
+          s->Compress();
+      }
+      else
+      {
+        std::cerr << "Missing sound file: " << filename
+          << " (" << channel << ")" << std::endl;
+      }
+    }
+    loading_mutex_.lock();
+    if (s)
+    {
+      // replace probed estimation with actual size.
+      total_load_byte_ -= files_to_load_[file_idx].byte_size;
+      files_to_load_[file_idx].byte_size = s->get_total_byte();
+      total_load_byte_ += s->get_total_byte();
+    }
+    if (is_found && (!s || !BindSound(channel, s)))
+    {
+      std::cerr << "Failed loading sound file: " << filename
+        << " (" << channel << ")" << std::endl;
+    }
+    loading_mutex_.unlock();
   }
 
-  // XXX: this shouldn't need to be thread-safe ..?
-  loading_finished_ = (file_load_idx_ >= files_to_load_.size());
-  loading_progress_ = (double)file_load_idx_ / files_to_load_.size();
+  // failed file is also done; it won't be loaded anyway.
+  loading_mutex_.lock();
+  file_state_[file_idx] = kFileDone;
+  file_done_count_++;
+  while (file_ready_idx_ < files_to_load_.size() &&
+         file_state_[file_ready_idx_] == kFileDone)
+    file_ready_idx_++;
+  loading_finished_ = (file_done_count_ >= files_to_load_.size());
+  loading_progress_ = (double)file_done_count_ / files_to_load_.size();
+  loading_mutex_.unlock();
+  file_done_cond_.notify_all();
 }
 
 double KeySoundPoolWithTime::get_load_progress() const
@@ -310,6 +657,32 @@ bool KeySoundPoolWithTime::is_loading_finished() const
   return loading_finished_;
 }
 
+float KeySoundPoolWithTime::get_ready_time() const
+{
+  std::lock_guard<std::mutex> lock(loading_mutex_);
+  if (file_ready_idx_ >= files_to_load_.size())
+    return kNeverUsed;
+  return files_to_load_[file_ready_idx_].first_use;
+}
+
+size_t KeySoundPoolWithTime::get_total_load_byte() const
+{
+  std::lock_guard<std::mutex> lock(loading_mutex_);
+  return total_load_byte_;
+}
+
+void KeySoundPoolWithTime::SetProbeInfo(size_t file_idx, const SoundProbeInfo &probe)
+{
+  // estimated PCM size after converted into mixer format.
+  auto &ld = files_to_load_[file_idx];
+  const SoundInfo &info = get_mixer()->GetSoundInfo();
+  const uint64_t framecount = probe.frame_count * info.rate / probe.info.rate;
+  ld.byte_size = GetByteFromFrame((uint32_t)framecount, info);
+  total_load_byte_ += ld.byte_size;
+  if (ld.channel < probed_duration_.size())
+    probed_duration_[ld.channel] = probe.duration;
+}
+
 void KeySoundPoolWithTime::SetAutoPlay(bool autoplay)
 {
   is_autoplay_ = autoplay;
@@ -341,6 +714,7 @@ void KeySoundPoolWithTime::MoveTo(float ms)
 
 float KeySoundPoolWithTime::GetLastSoundTime() const
 {
+  std::lock_guard<std::mutex> lock(loading_mutex_);
   float last_play_time = 0;
   for (size_t i = 0; i <= lane_count_; ++i)
   {
@@ -349,7 +723,9 @@ float KeySoundPoolWithTime::GetLastSoundTime() const
       float key_end_time = keyevt.time;
       const Channel *ch = get_channel(keyevt.channel);
       const Sound *s = ch ? ch->get_sound() : nullptr;
-      if (s) key_end_time += s->get_duration();
+      if (s && !s->is_empty()) key_end_time += s->get_duration();
+      else if (keyevt.channel < probed_duration_.size())
+        key_end_time += probed_duration_[keyevt.channel];
       last_play_time = std::max(last_play_time, key_end_time);
     }
   }
@@ -359,6 +735,7 @@ float KeySoundPoolWithTime::GetLastSoundTime() const
 void KeySoundPoolWithTime::Update(float delta_ms)
 {
   time_ += delta_ms;
+  PrefetchLazySounds();
 
   // update lane-channel table
   for (size_t i = 0; i <= lane_count_; ++i)
@@ -378,18 +755,24 @@ void KeySoundPoolWithTime::Update(float delta_ms)
         switch (currlanecmd.event_type)
         {
         case InternalMidiEvents::kNoteOn:
-          if (is_autoplay_ || currlanecmd.autoplay)
-            Play(currlanecmd.channel);
+        {
+          Channel *ch = GetBoundChannel(currlanecmd.channel);
+          if (ch && (is_autoplay_ || currlanecmd.autoplay))
+            ch->Play();
           break;
+        }
         case InternalMidiEvents::kNoteOff:  // XXX: may not reachable
-          if (is_autoplay_ || currlanecmd.autoplay)
-            Stop(currlanecmd.channel);
+        {
+          Channel *ch = GetBoundChannel(currlanecmd.channel);
+          if (ch && (is_autoplay_ || currlanecmd.autoplay))
+            ch->Stop();
           break;
+        }
         default:
           break;
         }
       }
-      else
+      else if (!offline_midi_)
       {
         auto *c = get_midi_channel(currlanecmd.channel);
         switch (currlanecmd.event_type)
@@ -417,59 +800,590 @@ void KeySoundPoolWithTime::Update(float delta_ms)
   }
 }
 
-void KeySoundPoolWithTime::RecordToSound(Sound &s)
+bool KeySoundPoolWithTime::GetMixingTimepoints(std::vector<float> &timepoints) const
 {
-  // we reuse loading progress here again ...
-  loading_finished_ = false;
-  loading_progress_ = 0.;
-
   // stack mixing timepoint
   std::vector<float> mixing_timepoint;
   for (size_t i = 0; i <= lane_count_; ++i)
   {
     for (size_t j = 0; j < lane_time_mapping_[i].size(); ++j)
+    {
+      // queued MIDI events don't need update while mixing
+      if (offline_midi_ && lane_time_mapping_[i][j].is_midi_channel)
+        continue;
       mixing_timepoint.push_back(lane_time_mapping_[i][j].time);
+    }
   }
   std::sort(mixing_timepoint.begin(), mixing_timepoint.end());
 
   // reduce mixing timepoint for optimization
-  std::vector<float> mixing_timepoint_opt;
+  timepoints.clear();
   for (float timepoint : mixing_timepoint)
   {
-    if (mixing_timepoint_opt.empty() || timepoint - mixing_timepoint_opt.back() > 10)
-      mixing_timepoint_opt.push_back(timepoint);
+    if (timepoints.empty() || timepoint - timepoints.back() > 10)
+      timepoints.push_back(timepoint);
     else
-      mixing_timepoint_opt.back() = timepoint;
+      timepoints.back() = timepoint;
   }
 
-  if (mixing_timepoint_opt.empty())
-    return;
+  return !timepoints.empty();
+}
 
-  // get last timepoint(byte offset) of the mixing ...
-  // Give 3 sec of spare time
-  const SoundInfo &info = get_mixer()->GetSoundInfo();
+size_t KeySoundPoolWithTime::GetRecordFrameCount() const
+{
+  // Give 3 sec of spare time after last sound
   uint32_t last_play_time = (uint32_t)GetLastSoundTime() + 3000;
-  size_t last_frame_offset = GetFrameFromMilisecond(last_play_time, info);
+  return GetFrameFromMilisecond(last_play_time, get_mixer()->GetSoundInfo());
+}
+
+bool KeySoundPoolWithTime::RecordBlocks(size_t framecount, const RecordSink &sink, Sound *dst)
+{
+  // we reuse loading progress here again ...
+  loading_finished_ = false;
+  loading_progress_ = 0.;
+
+  // offline midi is ended by guard, even on early return or throw.
+  struct OfflineMidiGuard
+  {
+    KeySoundPoolWithTime &pool;
+    ~OfflineMidiGuard() { pool.EndOfflineMidi(); }
+  };
+  BeginOfflineMidi();
+  OfflineMidiGuard midi_guard{ *this };
+  std::vector<float> mixing_timepoint_opt;
+  if (!GetMixingTimepoints(mixing_timepoint_opt) && !offline_midi_)
+    return false;
+
+  // mix in blocks, so streaming sound (midi) won't allocate whole length
+  // and sink may consume the mix without keeping all of it.
+  // if destination is given, blocks are mixed into it in place.
+  const SoundInfo &info = get_mixer()->GetSoundInfo();
+  const size_t framesize = GetByteFromFrame(1, info);
+  int8_t *out = nullptr;
+  std::vector<int8_t> block;
+  if (dst)
+  {
+    dst->AllocateFrame(info, framecount);
+    out = (int8_t*)dst->get_ptr();
+  }
+  else
+    block.resize(kRecordBlockFrame * framesize);
+  size_t mixed_frame = 0;
+  bool r = true;
+  auto mix_frames = [&](size_t count) {
+    while (count > 0 && r)
+    {
+      const size_t len = std::min(count, kRecordBlockFrame);
+      int8_t *p = out ? out + mixed_frame * framesize : block.data();
+      if (!out)
+        memset(p, 0, len * framesize);
+      get_mixer()->MixAll((char*)p, len);
+      if (sink)
+        r = sink(p, len);
+      mixed_frame += len;
+      count -= len;
+    }
+  };
 
-  // allocate new sound and start mixing
-  s.AllocateFrame(info, last_frame_offset);
   size_t frame_offset = 0;
-  size_t byte_offset = 0;
   float prev_timepoint = 0;
   for (float timepoint : mixing_timepoint_opt)
   {
     size_t new_offset = GetFrameFromMilisecond((uint32_t)timepoint, info);
-    byte_offset = GetByteFromFrame((uint32_t)frame_offset, info);
-    get_mixer()->MixAll((char*)s.get_ptr() + byte_offset, new_offset - frame_offset);
+    mix_frames(new_offset - frame_offset);
+    if (!r)
+      break;
     Update(timepoint - prev_timepoint);
     prev_timepoint = timepoint;
     frame_offset = new_offset;
   }
 
-  // mix remaining byte to end
-  RMIXER_ASSERT(last_frame_offset >= frame_offset);
-  byte_offset = GetByteFromFrame((uint32_t)frame_offset, info);
-  get_mixer()->MixAll((char*)s.get_ptr() + byte_offset, last_frame_offset - frame_offset);
+  // mix remaining frames to end
+  if (r)
+  {
+    RMIXER_ASSERT(framecount >= frame_offset);
+    mix_frames(framecount - frame_offset);
+  }
+  return r;
+}
+
+void KeySoundPoolWithTime::RecordToSound(Sound &s)
+{
+  // mixed in place; sound is allocated only if there is anything to record.
+  RecordBlocks(GetRecordFrameCount(), nullptr, &s);
+}
+
+bool KeySoundPoolWithTime::RecordToWAV(WAVWriter &writer)
+{
+  // mixed blocks are written immediately, so whole mix is never in memory.
+  const size_t framesize = GetByteFromFrame(1, get_mixer()->GetSoundInfo());
+  return RecordBlocks(GetRecordFrameCount(), [&](const int8_t *p, size_t len) {
+    return writer.Write(p, len * framesize);
+  });
+}
+
+void KeySoundPoolWithTime::BeginOfflineMidi()
+{
+  Midi *midi = get_mixer()->get_midi();
+  if (!midi)
+    return;
+
+  const SoundInfo &info = get_mixer()->GetSoundInfo();
+  std::vector<MidiEvent> events;
+  for (size_t i = 0; i <= lane_count_; ++i)
+  {
+    for (size_t j = lane_idx_[i]; j < lane_time_mapping_[i].size(); ++j)
+    {
+      const auto &prop = lane_time_mapping_[i][j];
+      if (!prop.is_midi_channel || prop.channel >= kMidiMaxChannel)
+        continue;
+      const bool is_playing = is_autoplay_ || prop.autoplay;
+      MidiEvent e;
+      e.frame = prop.time > time_ ?
+        static_cast<size_t>((prop.time - time_) * info.rate / 1000.0) : 0;
+      e.channel = static_cast<uint8_t>(prop.channel);
+      switch (prop.event_type)
+      {
+      case InternalMidiEvents::kNoteOn:
+        if (!is_playing) continue;
+        e.type = kMidiEventNoteOn;
+        e.a = prop.event_args[1];
+        e.b = prop.event_args[2];
+        break;
+      case InternalMidiEvents::kNoteOff:
+        if (!is_playing) continue;
+        e.type = kMidiEventNoteOff;
+        e.a = prop.event_args[1];
+        e.b = 0;
+        break;
+      case InternalMidiEvents::kEffect:
+        e.type = prop.event_args[0];
+        e.a = prop.event_args[1];
+        e.b = prop.event_args[2];
+        break;
+      default:
+        continue;
+      }
+      events.push_back(e);
+    }
+  }
+  if (events.empty())
+    return;
+
+  midi->QueueEvents(events);
+  offline_midi_ = true;
+}
+
+void KeySoundPoolWithTime::EndOfflineMidi()
+{
+  if (!offline_midi_)
+    return;
+  get_mixer()->get_midi()->ClearEvent();
+  offline_midi_ = false;
+}
+
+void KeySoundPoolWithTime::RecordToSound(Sound &s, StreamEffector &effector)
+{
+  if (effector.is_bypass())
+  {
+    RecordToSound(s);
+    return;
+  }
+
+  const SoundInfo &info = get_mixer()->GetSoundInfo();
+  const size_t framecount = GetRecordFrameCount();
+  effector.SetSoundInfo(info);
+
+  // output buffer is allocated with expected size, and grows if necessary.
+  const size_t framesize = GetByteFromFrame(1, info);
+  size_t out_capacity = static_cast<size_t>(framecount * effector.get_length_ratio()) + info.rate;
+  size_t out_frame = 0;
+  int8_t *out = (int8_t*)malloc(out_capacity * framesize);
+  RMIXER_ASSERT(out);
+
+  auto pull_all = [&]() {
+    while (effector.get_output_frame_count() > 0)
+    {
+      if (out_frame == out_capacity)
+      {
+        out_capacity *= 2;
+        int8_t *p = (int8_t*)realloc(out, out_capacity * framesize);
+        if (!p)
+        {
+          free(out);
+          RMIXER_THROW("Failed to allocate memory for recording");
+        }
+        out = p;
+      }
+      out_frame += effector.Pull(out + out_frame * framesize, out_capacity - out_frame);
+    }
+  };
+  const bool r = RecordBlocks(framecount, [&](const int8_t *p, size_t len) {
+    effector.Push(p, len);
+    pull_all();
+    return true;
+  });
+  if (!r)
+  {
+    free(out);
+    return;
+  }
+  effector.Flush();
+  pull_all();
+
+  s.SetBuffer(info, out_frame, out);
+}
+
+void KeySoundPoolWithTime::RecordToSound(Sound &s, double pitch, double tempo)
+{
+  if (pitch == 1.0 && tempo == 1.0)
+  {
+    RecordToSound(s);
+    return;
+  }
+
+  // MIDI events cannot be effected per sound; effect the mixed stream.
+  // on-demand keysounds are not resident at once, so also use stream.
+  if (memory_budget_ > 0)
+  {
+    StreamEffector effector;
+    effector.SetPitch(pitch);
+    effector.SetTempo(tempo);
+    RecordToSound(s, effector);
+    return;
+  }
+  for (size_t i = 0; i <= lane_count_; ++i)
+  {
+    for (auto &keyevt : lane_time_mapping_[i])
+    {
+      if (keyevt.is_midi_channel)
+      {
+        StreamEffector effector;
+        effector.SetPitch(pitch);
+        effector.SetTempo(tempo);
+        RecordToSound(s, effector);
+        return;
+      }
+    }
+  }
+
+  // prepare effected keysounds. each sound is effected only once,
+  // even if it is shared by many channels or rendered repeatedly.
+  if (variant_pitch_ != pitch || variant_tempo_ != tempo)
+  {
+    ClearVariantCache();
+    variant_pitch_ = pitch;
+    variant_tempo_ = tempo;
+  }
+  for (size_t i = 0; i < get_pool_size(); ++i)
+  {
+    Channel *ch = get_channel(i);
+    Sound *sound = ch ? ch->get_sound() : nullptr;
+    if (!sound || sound->is_empty() || variant_cache_.count(sound))
+      continue;
+    Sound *variant = new Sound();
+    variant->copy(*sound);
+    if (!variant->Effect(pitch, tempo, 1.0))
+    {
+      delete variant;
+      continue;
+    }
+    variant_cache_[sound] = variant;
+  }
+
+  // re-time events and record with effected keysounds.
+  // pool state is restored by guard, even if recording throws.
+  struct VariantGuard
+  {
+    KeySoundPoolWithTime &pool;
+    std::vector<float> orig_time[kMaxLaneCount];
+    bool is_swapped;
+    ~VariantGuard()
+    {
+      if (is_swapped)
+        pool.SwapVariantSounds();
+      for (size_t i = 0; i <= pool.lane_count_; ++i)
+      {
+        for (size_t j = 0; j < orig_time[i].size(); ++j)
+          pool.lane_time_mapping_[i][j].time = orig_time[i][j];
+      }
+    }
+  } guard{ *this, {}, false };
+
+  const float time_scale = static_cast<float>(tempo / pitch);
+  for (size_t i = 0; i <= lane_count_; ++i)
+  {
+    guard.orig_time[i].reserve(lane_time_mapping_[i].size());
+    for (auto &keyevt : lane_time_mapping_[i])
+    {
+      guard.orig_time[i].push_back(keyevt.time);
+      keyevt.time *= time_scale;
+    }
+  }
+  SwapVariantSounds();
+  guard.is_swapped = true;
+
+  RecordToSound(s);
+}
+
+void KeySoundPoolWithTime::SwapVariantSounds()
+{
+  for (auto &ii : variant_cache_)
+    ii.first->swap(*ii.second);
+}
+
+void KeySoundPoolWithTime::ClearVariantCache()
+{
+  for (auto &ii : variant_cache_)
+    delete ii.second;
+  variant_cache_.clear();
+  variant_pitch_ = variant_tempo_ = 1.0;
+}
+
+void KeySoundPoolWithTime::SetMemoryBudget(size_t budget_byte, float prefetch_ms)
+{
+  memory_budget_ = budget_byte;
+  prefetch_time_ = prefetch_ms;
+}
+
+size_t KeySoundPoolWithTime::get_resident_byte() const
+{
+  return resident_byte_;
+}
+
+Sound* KeySoundPoolWithTime::DecodeLazySound(size_t file_idx)
+{
+  const auto &ld = files_to_load_[file_idx];
+  ExtractedFile f(this);
+  Sound *s = new Sound();
+  if (!ExtractFile(ld, f) ||
+      !s->Load(f.p, f.len, rutil::GetExtension(ld.filename).c_str(),
+               get_mixer()->GetSoundInfo(), f.owner) ||
+      s->is_empty())
+  {
+    std::cerr << "Failed loading sound file: " << ld.filename
+      << " (" << ld.channel << ")" << std::endl;
+    delete s;
+    return nullptr;
+  }
+  if (is_rarely_used(ld.channel))
+    s->Compress();
+  return s;
+}
+
+void KeySoundPoolWithTime::SetLazySound(size_t channel, Sound *decoded)
+{
+  auto &ls = lazy_sounds_[channel];
+  if (!decoded)
+  {
+    ls.is_failed = true;
+    return;
+  }
+  // already loaded by Update() if it was needed before decoding is done.
+  // sound may be bound to a playing channel, so swap it while not mixing.
+  if (ls.sound->is_empty())
+  {
+    get_mixer()->LockMixing();
+    ls.sound->swap(*decoded);
+    get_mixer()->UnlockMixing();
+    resident_byte_ += ls.sound->get_memory_byte();
+  }
+  delete decoded;
+}
+
+bool KeySoundPoolWithTime::LoadLazySound(size_t channel)
+{
+  auto &ls = lazy_sounds_[channel];
+  if (!ls.sound || ls.is_failed) return false;
+  if (!ls.sound->is_empty()) return true;
+  SetLazySound(channel, DecodeLazySound(ls.file_idx));
+  return !ls.is_failed;
+}
+
+void KeySoundPoolWithTime::PrefetchLazySounds()
+{
+  if (memory_budget_ == 0 || lazy_sounds_.empty())
+    return;
+
+  // bind sounds decoded by prefetch thread.
+  std::vector<std::pair<size_t, Sound*> > decoded;
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    decoded.swap(prefetch_done_);
+  }
+  for (auto &ii : decoded)
+  {
+    lazy_sounds_[ii.first].is_queued = false;
+    SetLazySound(ii.first, ii.second);
+  }
+
+  // collect sounds triggered until end of prefetch window,
+  // including events of current Update() which are not processed yet.
+  std::vector<std::pair<float, size_t> > window;
+  const float prefetch_end = time_ + prefetch_time_;
+  for (size_t i = 0; i <= lane_count_; ++i)
+  {
+    const auto &mapping = lane_time_mapping_[i];
+    for (size_t j = lane_idx_[i];
+         j < mapping.size() && mapping[j].time <= prefetch_end; ++j)
+    {
+      const auto &keyevt = mapping[j];
+      if (keyevt.is_midi_channel || keyevt.channel >= lazy_sounds_.size())
+        continue;
+      auto &ls = lazy_sounds_[keyevt.channel];
+      ls.last_needed = std::max(ls.last_needed, keyevt.time);
+      window.emplace_back(keyevt.time, keyevt.channel);
+    }
+  }
+  std::sort(window.begin(), window.end());
+
+  // sounds in window are kept in order of trigger while they fit in budget,
+  // and queued to prefetch thread. sounds triggered right now are always
+  // kept and decoded here if not decoded yet, so no trigger is missed.
+  // later ones beyond budget are decoded as playhead comes closer.
+  std::vector<size_t> needed;
+  std::vector<bool> is_needed(lazy_sounds_.size(), false);
+  size_t needed_byte = 0;
+  size_t due_byte = 0;
+  bool is_queued = false;
+  for (auto &ii : window)
+  {
+    const size_t ch = ii.second;
+    if (is_needed[ch])
+      continue;
+    GetBoundChannel(ch);
+    auto &ls = lazy_sounds_[ch];
+    if (!ls.sound || ls.is_failed)
+      continue;
+    const bool is_due = ii.first <= time_;
+    const size_t byte = ls.sound->is_empty() ?
+      files_to_load_[ls.file_idx].byte_size : ls.sound->get_memory_byte();
+    if (!is_due && needed_byte + byte > memory_budget_)
+      break;
+    needed_byte += byte;
+    if (is_due)
+      due_byte += byte;
+    is_needed[ch] = true;
+    needed.push_back(ch);
+    if (!ls.sound->is_empty())
+      continue;
+    if (is_due)
+      LoadLazySound(ch);
+    else if (!ls.is_queued)
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mutex_);
+      prefetch_queue_.emplace_back(ch, ls.file_idx);
+      ls.is_queued = true;
+      is_queued = true;
+    }
+  }
+  if (is_queued)
+    prefetch_cond_.notify_one();
+  if (due_byte > memory_budget_ && !is_budget_warned_)
+  {
+    std::cerr << "Keysounds triggered at " << time_ << "ms exceed memory budget ("
+      << due_byte << " > " << memory_budget_ << " byte)" << std::endl;
+    is_budget_warned_ = true;
+  }
+  std::sort(needed.begin(), needed.end());
+  EvictLazySounds(needed);
+}
+
+void KeySoundPoolWithTime::RunPrefetchThread()
+{
+  std::unique_lock<std::mutex> lock(prefetch_mutex_);
+  while (true)
+  {
+    prefetch_cond_.wait(lock, [this]() {
+      return prefetch_stop_ || !prefetch_queue_.empty();
+    });
+    if (prefetch_stop_)
+      break;
+    const size_t channel = prefetch_queue_.front().first;
+    const size_t file_idx = prefetch_queue_.front().second;
+    prefetch_queue_.erase(prefetch_queue_.begin());
+
+    // decode without lock; bound later by Update().
+    lock.unlock();
+    Sound *s = DecodeLazySound(file_idx);
+    lock.lock();
+    prefetch_done_.emplace_back(channel, s);
+  }
+}
+
+void KeySoundPoolWithTime::EvictLazySounds(const std::vector<size_t> &needed)
+{
+  while (resident_byte_ > memory_budget_)
+  {
+    // least-recently-needed sound which is not playing nor prefetched.
+    // sounds are registered by loading thread, so search under loading lock.
+    size_t victim = lazy_sounds_.size();
+    loading_mutex_.lock();
+    for (size_t i = 0; i < lazy_sounds_.size(); ++i)
+    {
+      const auto &ls = lazy_sounds_[i];
+      if (!ls.sound || ls.sound->is_empty())
+        continue;
+      const Channel *ch = get_channel(i);
+      if (ch && ch->is_playing())
+        continue;
+      if (std::binary_search(needed.begin(), needed.end(), i))
+        continue;
+      if (victim == lazy_sounds_.size() ||
+          ls.last_needed < lazy_sounds_[victim].last_needed)
+        victim = i;
+    }
+    loading_mutex_.unlock();
+    if (victim == lazy_sounds_.size())
+      break;
+
+    // clearing also releases extracted data which the sound refers in place.
+    Sound *s = lazy_sounds_[victim].sound;
+    resident_byte_ -= std::min(resident_byte_, s->get_memory_byte());
+    get_mixer()->LockMixing();
+    s->Clear();
+    get_mixer()->UnlockMixing();
+  }
+}
+
+void KeySoundPoolWithTime::SetCompressThreshold(unsigned trigger_count)
+{
+  compress_threshold_ = trigger_count;
+}
+
+bool KeySoundPoolWithTime::is_rarely_used(size_t channel) const
+{
+  return compress_threshold_ > 0 && channel < trigger_count_.size() &&
+         trigger_count_[channel] <= compress_threshold_;
+}
+
+void KeySoundPoolWithTime::ClearLazySounds()
+{
+  if (prefetch_thread_.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mutex_);
+      prefetch_stop_ = true;
+    }
+    prefetch_cond_.notify_one();
+    prefetch_thread_.join();
+  }
+  prefetch_stop_ = false;
+  prefetch_queue_.clear();
+  for (auto &ii : prefetch_done_)
+    delete ii.second;
+  prefetch_done_.clear();
+
+  for (size_t i = 0; i < lazy_sounds_.size(); ++i)
+  {
+    if (!lazy_sounds_[i].sound)
+      continue;
+    UnbindSound(i);
+    delete lazy_sounds_[i].sound;
+  }
+  lazy_sounds_.clear();
+  resident_byte_ = 0;
+  is_budget_warned_ = false;
 }
 
 void KeySoundPoolWithTime::KeySoundProperty::Clear()
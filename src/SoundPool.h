@@ -2,6 +2,12 @@
 #define RMIXER_SOUNDPOOL_H
 
 #include "rparser.h"
+#include <map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 namespace rmixer
 {
@@ -10,6 +16,9 @@ class Mixer;
 class Sound;
 class Channel;
 class MidiChannel;
+class StreamEffector;
+class WAVWriter;
+struct SoundProbeInfo;
 
 constexpr size_t kMaxLaneCount = 256;
 
@@ -30,12 +39,18 @@ public:
   void StopMidi(uint8_t lane, uint8_t key);
 
   Mixer* get_mixer();
+  size_t get_pool_size() const;
   Channel* get_channel(size_t ch);
   MidiChannel* get_midi_channel(uint8_t ch);
   const Mixer* get_mixer() const;
   const Channel* get_channel(size_t ch) const;
   const MidiChannel* get_midi_channel(uint8_t ch) const;
 
+protected:
+  /* @brief lock a mixer channel for the sound. sound is not owned. */
+  bool BindSound(size_t channel, Sound *s);
+  void UnbindSound(size_t channel);
+
 private:
   Channel** channels_;
   size_t pool_size_;
@@ -46,34 +61,124 @@ class KeySoundPoolWithTime : public SoundPool
 {
 public:
   KeySoundPoolWithTime(Mixer *mixer, size_t pool_size);
+  virtual ~KeySoundPoolWithTime();
 
   /* @brief shortcut for load chart and whole sound files */
   void LoadFromChartAndSound(const rparser::Chart& c);
 
-  /* @brief only loads chart and prepare to load sound files */
+  /* @brief only loads chart and prepare to load sound files.
+   * sound files are queued by first use (largest-first for same time).
+   * files on disk are probed by their heads here, so total PCM size and
+   * last sound time are known before loading. archive entries are
+   * probed by loading thread instead, and nothing is extracted here. */
   void LoadFromChart(const rparser::Chart& c);
 
-  /* @brief load a sound files (for async method) */
+  /* @brief load a sound files (for async method)
+   * sounds are loaded in order of first use in the chart,
+   * and may be called from multiple loading threads. */
   void LoadRemainingSound();
 
+  /* @brief load all remaining sound files with worker threads.
+   * 0 thread_count means hardware concurrency. */
+  void LoadRemainingSoundParallel(unsigned thread_count);
+
+  /* @brief start loading remaining sound files in background threads
+   * and return immediately, so playback can begin while loading.
+   * files are loaded in order of first use to keep ahead of playhead,
+   * and Update() loads a sound triggered before loaders reach it.
+   * 0 thread_count means hardware concurrency. */
+  void StartLoading(unsigned thread_count = 0);
+
+  /* @brief stop background loading threads. files being loaded are
+   * finished, and remaining ones are loaded again by next StartLoading(). */
+  void StopLoading();
+
   double get_load_progress() const;
   bool is_loading_finished() const;
 
+  /* @brief every sound used before this time (ms) is loaded,
+   * so playback until this time won't wait for loading. */
+  float get_ready_time() const;
+
+  /* @brief PCM memory of sound files (in mixer format).
+   * estimated by probing for files not loaded yet (and in on-demand mode),
+   * and replaced with actual size as each file is loaded. */
+  size_t get_total_load_byte() const;
+
   void SetAutoPlay(bool autoplay);
   void MoveTo(float ms);
   void Update(float delta_ms);
   void SetVolume(float volume);
 
-  /* @brief Get last sound playing time. (not last object time!) */
+  /* @brief Get last sound playing time. (not last object time!)
+   * probed duration is used for sounds not loaded yet. */
   float GetLastSoundTime() const;
 
   /* @brief Create sound using mixer based on lane_time_mapping table.
+   * MIDI events are rendered offline with sample-accurate timing.
    * @warn RegisterToMixer() should be called first. */
   void RecordToSound(Sound &s);
 
+  /* @brief Same as RecordToSound(), but mixed PCM passes effector
+   * block-by-block so whole unprocessed sound is never allocated. */
+  void RecordToSound(Sound &s, StreamEffector &effector);
+
+  /* @brief Same as RecordToSound(), but mixed PCM is written to file
+   * block-by-block, so length of the mix is not limited by memory.
+   * @warn writer should be opened with mixer's sound format. */
+  bool RecordToWAV(WAVWriter &writer);
+
+  /* @brief Create pitch/tempo variant of the mix.
+   * Each keysound is effected once and cached, and events are re-timed,
+   * instead of effecting whole mixed sound.
+   * Same parameter as Sound::Effect(). */
+  void RecordToSound(Sound &s, double pitch, double tempo);
+
+  /* @brief release cached keysound variants */
+  void ClearVariantCache();
+
+  /* @brief decode keysounds on demand within memory budget (in byte).
+   * sounds are decoded by background thread before prefetch_ms of their
+   * trigger, and least-recently-needed sounds are evicted when budget is
+   * exceeded. sounds in prefetch window are kept in order of trigger only
+   * while they fit in budget, and a sound still not decoded at its trigger
+   * is decoded by Update(). budget is exceeded (and warned) only if sounds
+   * triggered at once don't fit in it.
+   * 0 means all sounds are decoded on loading (default).
+   * @warn should be called before LoadFromChart(). */
+  void SetMemoryBudget(size_t budget_byte, float prefetch_ms = 1000.f);
+
+  /* @brief decoded PCM memory of on-demand keysounds. */
+  size_t get_resident_byte() const;
+
+  /* @brief keep sounds triggered trigger_count times or less in chart
+   * compressed in memory (see Sound::Compress()). 0 to disable.
+   * @warn should be called before LoadFromChart(). */
+  void SetCompressThreshold(unsigned trigger_count);
+
 private:
+  bool GetMixingTimepoints(std::vector<float> &timepoints) const;
+  size_t GetRecordFrameCount() const;
+
+  /* @brief mix whole chart in blocks and pass each block to sink in order.
+   * if dst is given, it is allocated and blocks are mixed into it in place.
+   * returns false if there is nothing to record or sink returns false. */
+  typedef std::function<bool(const int8_t *p, size_t framecount)> RecordSink;
+  bool RecordBlocks(size_t framecount, const RecordSink &sink, Sound *dst = nullptr);
+
+  /* @brief queue remaining MIDI events to midi with sample timestamp,
+   * so recording needs no Update() call for MIDI events. */
+  void BeginOfflineMidi();
+  void EndOfflineMidi();
+  bool offline_midi_;
+
   struct KeySoundProperty;
   void SetLaneChannel(unsigned lane, KeySoundProperty *prop);
+  bool ClaimNextFile(size_t &file_idx);
+  void LoadFile(size_t file_idx);
+  void SetProbeInfo(size_t file_idx, const SoundProbeInfo &probe);
+  void LoadChannelNow(size_t channel);
+  Channel* GetBoundChannel(size_t channel);
 
   struct KeySoundProperty
   {
@@ -121,15 +226,100 @@ private:
     std::string filename;
     size_t channel;
     void *dir;
+    size_t byte_size;   /* PCM size, known after loading or probing */
+    float first_use;    /* first trigger time in chart */
   };
   std::vector<LoadFileDesc> files_to_load_;
+  std::vector<uint8_t> file_state_;
+  std::vector<size_t> channel_file_idx_;
+  size_t file_ready_idx_;   /* files before this index are all loaded */
+  size_t file_done_count_;
+  std::vector<float> probed_duration_;  /* duration of each channel from probe */
+  size_t total_load_byte_;
   size_t file_load_idx_;
   double loading_progress_;
   bool loading_finished_;
-  std::mutex loading_mutex_;
+  mutable std::mutex loading_mutex_;
+  std::condition_variable file_done_cond_;
+  std::mutex extract_mutex_;
+
+  // background loading threads
+  std::vector<std::thread> loader_threads_;
+  bool loader_stop_;
+
+  // song directory handles opened by pool, one per extracting thread.
+  // keysounds referring extracted data in place share their handle,
+  // so it is alive even after the song is closed.
+  struct DirectoryHandle
+  {
+    std::unique_ptr<rparser::Directory> dir;
+    std::mutex mutex;                     /* guards dir and refs */
+    std::map<std::string, size_t> refs;   /* owners of each extracted entry */
+  };
+  std::string dir_path_;
+  std::vector<std::shared_ptr<DirectoryHandle> > free_dirs_;
+  std::shared_ptr<DirectoryHandle> AcquireDirectory();
+  void ReleaseDirectory(const std::shared_ptr<DirectoryHandle> &handle);
+
+  // extracted file data. directory handle is held until this is destroyed,
+  // so the data is decoded before other thread uses the handle, and
+  // the entry is unloaded from handle when owner is no longer referred.
+  struct ExtractedFile
+  {
+    KeySoundPoolWithTime *pool;
+    std::shared_ptr<DirectoryHandle> handle;
+    const char *p;
+    size_t len;
+    std::shared_ptr<const void> owner;
+    ExtractedFile(KeySoundPoolWithTime *pool);
+    ~ExtractedFile();
+  };
+  bool ExtractFile(const LoadFileDesc &ld, ExtractedFile &f);
 
   // base volume of each channels
   float volume_base_;
+
+  // effected keysound cache for variant rendering
+  std::map<Sound*, Sound*> variant_cache_;
+  double variant_pitch_;
+  double variant_tempo_;
+  void SwapVariantSounds();
+
+  // on-demand keysound decoding related
+  struct LazySound
+  {
+    Sound *sound;       /* null if channel is not used */
+    size_t file_idx;    /* index of files_to_load_ */
+    float last_needed;  /* latest time when sound is triggered */
+    bool is_failed;     /* don't retry decoding failed sound */
+    bool is_queued;     /* requested to prefetch thread */
+  };
+  std::vector<LazySound> lazy_sounds_;
+  size_t memory_budget_;
+  size_t resident_byte_;
+  float prefetch_time_;
+  bool is_budget_warned_;
+  Sound* DecodeLazySound(size_t file_idx);
+  void SetLazySound(size_t channel, Sound *decoded);
+  bool LoadLazySound(size_t channel);
+  void PrefetchLazySounds();
+  void EvictLazySounds(const std::vector<size_t> &needed);
+  void ClearLazySounds();
+
+  // prefetch thread decodes sounds in prefetch window,
+  // so Update() only binds decoded sounds and evicts.
+  std::thread prefetch_thread_;
+  std::mutex prefetch_mutex_;
+  std::condition_variable prefetch_cond_;
+  std::vector<std::pair<size_t, size_t> > prefetch_queue_;  /* channel, file index */
+  std::vector<std::pair<size_t, Sound*> > prefetch_done_;   /* channel, decoded sound */
+  bool prefetch_stop_;
+  void RunPrefetchThread();
+
+  // trigger count of each channel, for choosing sounds to compress
+  std::vector<unsigned> trigger_count_;
+  unsigned compress_threshold_;
+  bool is_rarely_used(size_t channel) const;
 };
 
 }
@@ -1,8 +1,14 @@
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <math.h>
+#include <limits.h>
 #include <gtest/gtest.h>
 #include "Mixer.h"
 #include "SoundPool.h"
 #include "Sampler.h"
+#include "Decoder.h"
+#include "Encoder.h"
 #include "rparser.h"
 
 #define TEST_PATH std::string("../test/test/")
@@ -189,6 +195,63 @@ TEST(BASIC, RESAMPLER)
   }
 }
 
+TEST(BASIC, CHANNELMATRIX)
+{
+  // 1. stereo to mono : averaged
+  {
+    int16_t src[] = { 100, 300, -100, -301, 32767, 32767, -32768, -32768, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    int16_t dst[9];
+    MixChannel(dst, src, 9, ChannelMatrix::CreateDefault(2, 1));
+    EXPECT_EQ(200, dst[0]);
+    EXPECT_EQ(-201, dst[1]);
+    EXPECT_EQ(32767, dst[2]);
+    EXPECT_EQ(-32768, dst[3]);
+    EXPECT_EQ(9, dst[8]);
+  }
+
+  // 2. mono to stereo : duplicated
+  {
+    float src[] = { .1f, .2f, .3f, .4f, .5f };
+    float dst[10];
+    MixChannel(dst, src, 5, ChannelMatrix::CreateDefault(1, 2));
+    EXPECT_EQ(.1f, dst[0]);
+    EXPECT_EQ(.1f, dst[1]);
+    EXPECT_EQ(.5f, dst[8]);
+    EXPECT_EQ(.5f, dst[9]);
+  }
+
+  // 3. 5.1 to stereo : left / right image should be kept
+  {
+    float src[] = { 1.0f, 0, 0, 0, 0, 0 };
+    float dst[2];
+    MixChannel(dst, src, 1, ChannelMatrix::CreateDefault(6, 2));
+    EXPECT_GT(dst[0], 0.1f);
+    EXPECT_EQ(0, dst[1]);
+  }
+
+  // 4. custom matrix (swap L/R) with format conversion
+  {
+    Sound s;
+    s.AllocateFrame(SoundInfo(1, 16, 2, 44100), kPCMFrameSize);
+    int16_t *p = (int16_t*)s.get_ptr();
+    for (size_t i = 0; i < kPCMFrameSize; ++i)
+    {
+      p[i * 2] = 0x4000;
+      p[i * 2 + 1] = 0;
+    }
+    ChannelMatrix m(2, 2);
+    m.Set(0, 1, 1.0f);
+    m.Set(1, 0, 1.0f);
+    Sound out;
+    Sampler sampler(s, SoundInfo(1, 32, 2, 44100));
+    sampler.SetChannelMatrix(m);
+    ASSERT_TRUE(sampler.Resample(out));
+    EXPECT_EQ(kPCMFrameSize, out.get_frame_count());
+    EXPECT_EQ(0, ((int32_t*)out.get_ptr())[0]);
+    EXPECT_EQ(0x40000000, ((int32_t*)out.get_ptr())[1]);
+  }
+}
+
 TEST(BASIC, MIX)
 {
   // 1. signed and positive signal (should be clipped)
@@ -222,6 +285,61 @@ TEST(BASIC, MIX)
   // XXX: F16, F32 is not supported, so not tested now
 }
 
+TEST(BASIC, COMPRESS)
+{
+  /** compressed sound is decoded while mixing, with small error. */
+  Sound ref, s;
+  ASSERT_TRUE(ref.Load(TEST_PATH + "1-Loop-1-16.wav", SoundInfo(1, 16, 2, 44100)));
+  s.copy(ref);
+  ASSERT_TRUE(s.Compress());
+  EXPECT_TRUE(s.is_compressed());
+  EXPECT_EQ(ref.get_frame_count(), s.get_frame_count());
+  EXPECT_LT(s.get_memory_byte() * 3, ref.get_memory_byte());
+
+  // mix by length which is not aligned with block.
+  const size_t framecount = ref.get_frame_count();
+  std::vector<int16_t> a(framecount * 2), b(framecount * 2), c(framecount * 2);
+  size_t pos_a = 0, pos_b = 0;
+  while (pos_a < framecount)
+    ref.Mix((int8_t*)&a[pos_a * 2], &pos_a, 300);
+  while (pos_b < framecount)
+    s.Mix((int8_t*)&b[pos_b * 2], &pos_b, 300);
+  double err = 0, level = 0;
+  for (size_t i = 0; i < a.size(); ++i)
+  {
+    err += std::abs(a[i] - b[i]);
+    level += std::abs(a[i]);
+  }
+  EXPECT_LT(err, level * 0.1);
+
+  // rate mixing decodes window, which should have same result.
+  size_t pos_c = 0, mixed = 0;
+  uint32_t frac = 0;
+  while (mixed < framecount)
+    mixed += s.MixWithRate((int8_t*)&c[mixed * 2], &pos_c, &frac, 1ull << 32,
+                           300, 1.0f, false);
+  EXPECT_EQ(b, c);
+
+  // decompressed PCM is same as mixed one.
+  s.Decompress();
+  EXPECT_FALSE(s.is_compressed());
+  EXPECT_EQ(0, memcmp(s.get_ptr(), b.data(), b.size() * sizeof(int16_t)));
+
+  // compressed block in arena is given back when decompressed.
+  {
+    SoundArena arena;
+    Sound sa;
+    sa.copy(ref);
+    sa.SetArena(&arena);
+    ASSERT_TRUE(sa.Compress());
+    EXPECT_LE(sa.get_memory_byte(), arena.get_used_byte());
+    sa.Decompress();
+    EXPECT_EQ(0, arena.get_used_byte());
+    EXPECT_EQ(0, memcmp(sa.get_ptr(), b.data(), b.size() * sizeof(int16_t)));
+    sa.Clear();
+  }
+}
+
 // TODO: soundeffector test
 TEST(BASIC, SOUNDEFFECTOR)
 {
@@ -328,6 +446,228 @@ TEST(DECODER, WAV)
   }
 }
 
+TEST(DECODER, ARENA)
+{
+  /** sounds loaded into arena should equal to malloc'd ones. */
+  using namespace rmixer;
+  const auto wav_files = {
+    "1-Loop-1-16.wav",
+    "8k8bitpcm.wav",
+    "8kadpcm.wav",
+  };
+  SoundInfo sinfo(1, 16, 2, 44100);
+  SoundArena arena(1024 * 1024);
+  std::vector<std::unique_ptr<Sound> > sounds;
+  size_t total = 0;
+
+  for (const auto& wav_fn : wav_files)
+  {
+    Sound ref;
+    std::unique_ptr<Sound> s(new Sound());
+    s->SetArena(&arena);
+    ASSERT_TRUE(ref.Load(TEST_PATH + wav_fn));
+    ASSERT_TRUE(s->Load(TEST_PATH + wav_fn));
+    ASSERT_TRUE(ref.Resample(sinfo));
+    ASSERT_TRUE(s->Resample(sinfo));
+    ASSERT_EQ(ref.get_total_byte(), s->get_total_byte());
+    EXPECT_EQ(0, memcmp(ref.get_ptr(), s->get_ptr(), ref.get_total_byte()));
+    total += (s->get_total_byte() + 15) / 16 * 16;
+    sounds.push_back(std::move(s));
+  }
+
+  // decoded buffer replaced by resampled one leaves no garbage in arena.
+  EXPECT_EQ(total, arena.get_used_byte());
+
+  // releasing last buffer rollbacks arena.
+  total -= (sounds.back()->get_total_byte() + 15) / 16 * 16;
+  sounds.pop_back();
+  EXPECT_EQ(total, arena.get_used_byte());
+
+  // whole memory is released at once.
+  sounds.clear();
+  arena.Clear();
+  EXPECT_EQ(0u, arena.get_reserved_byte());
+}
+
+TEST(DECODER, BORROW)
+{
+  /** WAV with matching format is referenced in place, and copied on write. */
+  using namespace rmixer;
+  SoundInfo sinfo(1, 16, 1, 32000);
+  Sound ref, s;
+  rutil::FileData fd;
+  rutil::ReadFileData(TEST_PATH + "1-Loop-1-16.wav", fd);
+  ASSERT_TRUE(ref.Load((char*)fd.p, fd.len, "wav", sinfo));
+  ASSERT_TRUE(s.Load(TEST_PATH + "1-Loop-1-16.wav", sinfo));
+  EXPECT_FALSE(ref.is_borrowed());
+  EXPECT_TRUE(s.is_borrowed());
+  ASSERT_EQ(ref.get_total_byte(), s.get_total_byte());
+  const Sound &cs = s;
+  EXPECT_EQ(0, memcmp(ref.get_ptr(), cs.get_ptr(), ref.get_total_byte()));
+  EXPECT_TRUE(s.is_borrowed());
+
+  // requesting writable buffer makes private copy.
+  int8_t *p = s.get_ptr();
+  EXPECT_FALSE(s.is_borrowed());
+  EXPECT_EQ(0, memcmp(ref.get_ptr(), p, ref.get_total_byte()));
+
+  // resampled sound owns its buffer.
+  Sound s2;
+  ASSERT_TRUE(s2.Load(TEST_PATH + "1-Loop-1-16.wav", sinfo));
+  EXPECT_TRUE(s2.is_borrowed());
+  ASSERT_TRUE(s2.Resample(SoundInfo(1, 16, 2, 44100)));
+  EXPECT_FALSE(s2.is_borrowed());
+
+  // format mismatch is decoded as usual.
+  Sound s3;
+  ASSERT_TRUE(s3.Load(TEST_PATH + "8kadpcm.wav", SoundInfo(1, 16, 1, 8000)));
+  EXPECT_FALSE(s3.is_borrowed());
+
+  // in-memory data (e.g. extracted from archive) is kept alive by owner.
+  std::shared_ptr<rutil::FileData> mem = std::make_shared<rutil::FileData>();
+  rutil::ReadFileData(TEST_PATH + "1-Loop-1-16.wav", *mem);
+  ASSERT_FALSE(mem->IsEmpty());
+  Mixer mixer(sinfo, 4);
+  Sound *ms = mixer.CreateSound((char*)mem->p, mem->len, "1-Loop-1-16.wav", mem);
+  ASSERT_TRUE(ms);
+  EXPECT_TRUE(ms->is_borrowed());
+  mem.reset();
+  ASSERT_EQ(ref.get_total_byte(), ms->get_total_byte());
+  EXPECT_EQ(0, memcmp(ref.get_ptr(), ((const Sound*)ms)->get_ptr(), ref.get_total_byte()));
+}
+
+/* @brief restores default decoder thread count and removes written files,
+ * even if test fails in the middle. */
+struct DecoderTestGuard
+{
+  unsigned thread_count;
+  std::vector<std::string> files;
+  DecoderTestGuard() : thread_count(rmixer::Decoder::GetDefaultThreadCount()) {}
+  ~DecoderTestGuard()
+  {
+    rmixer::Decoder::SetDefaultThreadCount(thread_count);
+    for (const auto &f : files)
+      remove(f.c_str());
+  }
+};
+
+TEST(DECODER, PARALLEL)
+{
+  /** long stream decoded by multiple threads should be same as single-threaded one. */
+  using namespace rmixer;
+  DecoderTestGuard guard;
+  const SoundInfo sinfo(1, 16, 1, 44100);
+  const size_t framecount = 44100 * 30 * 4 + 123;
+  Sound src;
+  src.AllocateFrame(sinfo, framecount);
+  int16_t *p = (int16_t*)src.get_ptr();
+  for (size_t i = 0; i < framecount; ++i)
+    p[i] = (int16_t)((i * 31) & 0x7fff);
+
+  // WAV splits by byte offset, FLAC seeks to each range and decodes per frame.
+  for (const char *ext : { "wav", "flac" })
+  {
+    const std::string path = testing::TempDir() + "test_long." + ext;
+    guard.files.push_back(path);
+    ASSERT_TRUE(src.Save(path));
+
+    // decoded as raw, and as float (format conversion)
+    for (int use_format = 0; use_format < 2; ++use_format)
+    {
+      Sound s1, s4;
+      const SoundInfo finfo(2, 32, 1, 44100);
+      Decoder::SetDefaultThreadCount(1);
+      ASSERT_TRUE(use_format ? s1.Load(path, finfo) : s1.Load(path));
+      Decoder::SetDefaultThreadCount(4);
+      ASSERT_TRUE(use_format ? s4.Load(path, finfo) : s4.Load(path));
+      ASSERT_EQ(framecount, s4.get_frame_count());
+      ASSERT_EQ(s1.get_total_byte(), s4.get_total_byte());
+      EXPECT_EQ(0, memcmp(((const Sound&)s1).get_ptr(), ((const Sound&)s4).get_ptr(),
+                          s1.get_total_byte()));
+      if (!use_format)
+      {
+        // both formats are lossless.
+        EXPECT_EQ(0, memcmp(((const Sound&)src).get_ptr(), ((const Sound&)s4).get_ptr(),
+                            src.get_total_byte()));
+      }
+    }
+  }
+}
+
+TEST(DECODER, PROBE)
+{
+  /** probed information should be same as decoded one. */
+  using namespace rmixer;
+  const auto files = {
+    "1-Loop-1-16.wav",
+    "8k8bitpcm.wav",
+    "8kadpcm.wav",
+    "gtr-jazz.mp3",
+  };
+
+  for (const auto& fn : files)
+  {
+    Sound s;
+    SoundProbeInfo probe;
+    rutil::FileData fd;
+    rutil::ReadFileData(TEST_PATH + fn, fd);
+    ASSERT_TRUE(Sound::Probe((char*)fd.p, fd.len, rutil::GetExtension(fn).c_str(), probe));
+    ASSERT_TRUE(s.Load(TEST_PATH + fn));
+    EXPECT_EQ(s.get_soundinfo(), probe.info);
+    EXPECT_EQ(s.get_frame_count(), probe.frame_count);
+    EXPECT_EQ(s.get_total_byte(), probe.byte_size);
+    EXPECT_NEAR(s.get_duration(), probe.duration, 1.0f);
+
+    // probing file reads only head and tail; MP3 length is estimated.
+    SoundProbeInfo fprobe;
+    ASSERT_TRUE(Sound::Probe(TEST_PATH + fn, fprobe));
+    EXPECT_EQ(probe.info, fprobe.info);
+    EXPECT_NEAR((double)probe.frame_count, (double)fprobe.frame_count,
+                probe.frame_count * 0.02);
+  }
+
+  // header of long WAV is enough to get exact length.
+  {
+    const SoundInfo sinfo(1, 16, 2, 44100);
+    Sound s;
+    s.AllocateFrame(sinfo, 44100 * 10 + 7);
+    ASSERT_TRUE(s.Save(TEST_PATH + "test_probe.wav"));
+    SoundProbeInfo probe;
+    ASSERT_TRUE(Sound::Probe(TEST_PATH + "test_probe.wav", probe));
+    EXPECT_EQ(sinfo, probe.info);
+    EXPECT_EQ(s.get_frame_count(), probe.frame_count);
+    remove((TEST_PATH + "test_probe.wav").c_str());
+  }
+
+  // MP3 behind large ID3v2 tag (e.g. album art) and with ID3v1 tag.
+  {
+    SoundProbeInfo probe;
+    rutil::FileData fd;
+    rutil::ReadFileData(TEST_PATH + "gtr-jazz.mp3", fd);
+    ASSERT_TRUE(Sound::Probe((char*)fd.p, fd.len, "mp3", probe));
+    const size_t tag_size = 100000;
+    const uint8_t id3v2[10] = { 'I', 'D', '3', 3, 0, 0,
+      (tag_size >> 21) & 0x7F, (tag_size >> 14) & 0x7F,
+      (tag_size >> 7) & 0x7F, tag_size & 0x7F };
+    std::vector<char> id3v1(128, 0);
+    memcpy(id3v1.data(), "TAG", 3);
+    FILE *fp = fopen((TEST_PATH + "test_probe.mp3").c_str(), "wb");
+    ASSERT_TRUE(fp);
+    fwrite(id3v2, 1, sizeof(id3v2), fp);
+    fwrite(std::vector<char>(tag_size, 0).data(), 1, tag_size, fp);
+    fwrite(fd.p, 1, fd.len, fp);
+    fwrite(id3v1.data(), 1, id3v1.size(), fp);
+    fclose(fp);
+    SoundProbeInfo fprobe;
+    const bool r = Sound::Probe(TEST_PATH + "test_probe.mp3", fprobe);
+    remove((TEST_PATH + "test_probe.mp3").c_str());
+    ASSERT_TRUE(r);
+    EXPECT_EQ(probe.info, fprobe.info);
+    EXPECT_NEAR((double)probe.frame_count, (double)fprobe.frame_count,
+                probe.frame_count * 0.02);
+  }
+}
+
 TEST(ENCODER, WAV)
 {
   using namespace rmixer;
@@ -354,6 +694,74 @@ TEST(ENCODER, WAV)
   EXPECT_TRUE(s[2].Save(TEST_PATH + "test_wav_F32.wav", SoundInfo(2, 32, 2, 44100)));
 }
 
+TEST(ENCODER, WAV_STREAM)
+{
+  /** WAV written block-by-block should be read as same PCM. */
+  using namespace rmixer;
+  const SoundInfo sinfo(1, 16, 1, 32000);
+  Sound ref, s;
+  ASSERT_TRUE(ref.Load(TEST_PATH + "1-Loop-1-16.wav", sinfo));
+  const Sound &cref = ref;
+
+  WAVWriter writer;
+  writer.AddInfo("IART", "artist");
+  ASSERT_TRUE(writer.Open(TEST_PATH + "test_wav_stream.wav", sinfo));
+  const size_t blocksize = 999;   // odd size, to test small block gathering.
+  for (size_t i = 0; i < ref.get_total_byte(); i += blocksize)
+  {
+    ASSERT_TRUE(writer.Write(cref.get_ptr() + i,
+                             std::min(blocksize, ref.get_total_byte() - i)));
+  }
+  EXPECT_EQ(ref.get_total_byte(), writer.get_data_size());
+  ASSERT_TRUE(writer.Close());
+
+  ASSERT_TRUE(s.Load(TEST_PATH + "test_wav_stream.wav", sinfo));
+  ASSERT_EQ(ref.get_total_byte(), s.get_total_byte());
+  EXPECT_EQ(0, memcmp(cref.get_ptr(), ((const Sound&)s).get_ptr(), ref.get_total_byte()));
+  s.Clear();
+  remove((TEST_PATH + "test_wav_stream.wav").c_str());
+}
+
+TEST(ENCODER, WAV_RF64)
+{
+  /** WAV exceeding RIFF size limit is written as RF64 with ds64 chunk. */
+  using namespace rmixer;
+  const SoundInfo sinfo(1, 16, 2, 44100);
+  std::vector<int16_t> pcm(2000);
+  for (size_t i = 0; i < pcm.size(); ++i)
+    pcm[i] = (int16_t)(i * 7);
+  const size_t data_size = pcm.size() * sizeof(int16_t);
+
+  WAVWriter writer;
+  writer.SetMaxRiffSize(1000);
+  ASSERT_TRUE(writer.Open(TEST_PATH + "test_wav_rf64.wav", sinfo));
+  ASSERT_TRUE(writer.Write(pcm.data(), data_size));
+  ASSERT_TRUE(writer.Close());
+
+  rutil::FileData fd;
+  rutil::ReadFileData(TEST_PATH + "test_wav_rf64.wav", fd);
+  remove((TEST_PATH + "test_wav_rf64.wav").c_str());
+  ASSERT_EQ(80 + data_size, fd.len);
+  auto u32 = [&](size_t o) {
+    return (uint32_t)fd.p[o] | (uint32_t)fd.p[o + 1] << 8 |
+           (uint32_t)fd.p[o + 2] << 16 | (uint32_t)fd.p[o + 3] << 24;
+  };
+  auto u64 = [&](size_t o) { return (uint64_t)u32(o) | (uint64_t)u32(o + 4) << 32; };
+  EXPECT_EQ(0, memcmp(fd.p, "RF64", 4));
+  EXPECT_EQ(0xFFFFFFFFu, u32(4));
+  EXPECT_EQ(0, memcmp(fd.p + 8, "WAVE", 4));
+  EXPECT_EQ(0, memcmp(fd.p + 12, "ds64", 4));
+  EXPECT_EQ(28u, u32(16));
+  EXPECT_EQ(fd.len - 8, u64(20));         // RIFF size
+  EXPECT_EQ(data_size, u64(28));          // data size
+  EXPECT_EQ(pcm.size() / 2, u64(36));     // sample (frame) count
+  EXPECT_EQ(0u, u32(44));                 // table length
+  EXPECT_EQ(0, memcmp(fd.p + 48, "fmt ", 4));
+  EXPECT_EQ(0, memcmp(fd.p + 72, "data", 4));
+  EXPECT_EQ(0xFFFFFFFFu, u32(76));
+  EXPECT_EQ(0, memcmp(fd.p + 80, pcm.data(), data_size));
+}
+
 TEST(DECODER, OGG)
 {
   using namespace rmixer;
@@ -374,6 +782,47 @@ TEST(DECODER, OGG)
   EXPECT_TRUE(s.Save(TEST_PATH + "test_ogg_S16.wav", SoundInfo(1, 16, 2, 44100)));
 }
 
+TEST(DECODER, OGG_SIMD)
+{
+  /** SIMD interleaving of decoded vorbis PCM should equal scalar path. */
+  using namespace rmixer;
+  // mono stream with length not multiple of SIMD width,
+  // so last block is trimmed into odd tail frames.
+  const size_t kFrameCount = 44100 + 3;
+  const std::string mono_path = testing::TempDir() + "test_ogg_simd_mono.ogg";
+  {
+    const SoundInfo info(1, 16, 1, 44100);
+    Sound src;
+    int16_t *p = (int16_t*)malloc(GetByteFromFrame(kFrameCount, info));
+    for (size_t i = 0; i < kFrameCount; ++i)
+      p[i] = static_cast<int16_t>(sin(i * 0.0627) * 16000);
+    src.SetBuffer(info, kFrameCount, p);
+    ASSERT_TRUE(src.Save(mono_path));
+  }
+
+  for (const std::string &path : { TEST_PATH + "m09.ogg", mono_path })
+  {
+    Sound probe;
+    ASSERT_TRUE(probe.Load(path));
+    const uint8_t channels = probe.get_soundinfo().channels;
+    for (const SoundInfo &info : { SoundInfo(1, 16, channels, 44100),
+                                   SoundInfo(2, 32, channels, 44100) })
+    {
+      Sound s[2];
+      for (size_t k = 0; k < 2; ++k)
+      {
+        Sound::EnableSIMD(k == 0);
+        EXPECT_TRUE(s[k].Load(path, info));
+      }
+      Sound::EnableSIMD(true);
+      ASSERT_EQ(s[0].get_total_byte(), s[1].get_total_byte());
+      EXPECT_EQ(0, memcmp(s[0].get_ptr(), s[1].get_ptr(), s[0].get_total_byte()))
+        << path << ", " << (int)info.bitsize << "bit";
+    }
+  }
+  remove(mono_path.c_str());
+}
+
 TEST(ENCODER, OGG)
 {
   using namespace rmixer;
@@ -395,6 +844,56 @@ TEST(ENCODER, OGG)
   EXPECT_TRUE(s[1].Save(TEST_PATH + "test_ogg.ogg"));
 }
 
+TEST(ENCODER, OGG_SIMD)
+{
+  /** vorbis encoder gets same float input from S16, S32 and F32 source,
+   * whether SIMD deinterleaving is used or not. */
+  using namespace rmixer;
+  const size_t kFrameCount = 44100 + 5;  // tail isn't multiple of SIMD width
+  const std::string path = testing::TempDir() + "test_ogg_simd.ogg";
+
+  for (uint8_t channels : { 1, 2 })
+  {
+    Sound decoded[3][2];
+    for (size_t f = 0; f < 3; ++f)
+    {
+      // same signal in S16, S32 (s16 << 16) and F32 (s16 / 32768).
+      const SoundInfo info(f < 2 ? 1 : 2, f == 0 ? 16 : 32, channels, 44100);
+      for (size_t k = 0; k < 2; ++k)
+      {
+        Sound src;
+        int8_t *p = (int8_t*)malloc(GetByteFromFrame(kFrameCount, info));
+        for (size_t i = 0; i < kFrameCount * channels; ++i)
+        {
+          const int16_t v = static_cast<int16_t>(sin(i * 0.0627 + i % channels) * 16000);
+          if (f == 0) ((int16_t*)p)[i] = v;
+          else if (f == 1) ((int32_t*)p)[i] = (int32_t)v * 65536;
+          else ((float*)p)[i] = v / 32768.f;
+        }
+        src.SetBuffer(info, kFrameCount, p);
+        Sound::EnableSIMD(k == 0);
+        EXPECT_TRUE(src.Save(path));
+        Sound::EnableSIMD(true);
+        EXPECT_TRUE(decoded[f][k].Load(path, SoundInfo(1, 16, channels, 44100)));
+      }
+    }
+    remove(path.c_str());
+
+    const Sound &ref = decoded[0][0];
+    ASSERT_LE(kFrameCount, ref.get_frame_count());
+    EXPECT_LT(0.1f, ref.GetSoundLevel(0, kFrameCount * channels));
+    for (size_t f = 0; f < 3; ++f)
+    {
+      for (size_t k = 0; k < 2; ++k)
+      {
+        ASSERT_EQ(ref.get_total_byte(), decoded[f][k].get_total_byte());
+        EXPECT_EQ(0, memcmp(ref.get_ptr(), decoded[f][k].get_ptr(), ref.get_total_byte()))
+          << "format " << f << ", simd " << (k == 0);
+      }
+    }
+  }
+}
+
 TEST(DECODER, MP3)
 {
   using namespace rmixer;
@@ -412,6 +911,15 @@ TEST(DECODER, MP3)
 
   // just for test listing
   EXPECT_TRUE(s.Save(TEST_PATH + "test_mp3.wav"));
+
+  // decoded directly into float, keeping source channel and rate.
+  Sound sf;
+  ASSERT_TRUE(sf.Load(TEST_PATH + "gtr-jazz.mp3", SoundInfo(2, 32, 2, 48000)));
+  ASSERT_EQ(s.get_frame_count(), sf.get_frame_count());
+  const int16_t *p16 = (const int16_t*)((const Sound&)s).get_ptr();
+  const float *pf = (const float*)((const Sound&)sf).get_ptr();
+  for (size_t i = 0; i < s.get_sample_count(); i += 997)
+    EXPECT_NEAR(p16[i] / 32768.0f, pf[i], 1.0f / 16384);
 }
 
 TEST(DECODER, FLAC)
@@ -562,10 +1070,200 @@ TEST(MIXER, BMS)
     0.6
   ));
 
+  /* tempo variant rendered from re-timed events */
+  Sound s_tempo;
+  soundpool.MoveTo(0);
+  soundpool.RecordToSound(s_tempo, 1.0, 1.5);
+  EXPECT_NEAR(s.get_duration() * 1.5, s_tempo.get_duration(), 3000 * 1.5);
+  EXPECT_TRUE(s_tempo.Save(TEST_PATH + "test_bms_tempo.ogg", metadata, nullptr, 0.6));
+
   /* Cleanup */
   song.Close();
 }
 
+TEST(MIXER, BMS_ARCHIVE)
+{
+  /** keysounds in archive are referenced in place if they match mixer format,
+   *  and stay valid after the song is closed. */
+  using namespace rmixer;
+  rparser::Song song;
+  ASSERT_TRUE(song.Open(TEST_PATH + u8"人　身　事　故　で　停　止.zip"));
+  rparser::Chart *c = song.GetChart(0);
+  ASSERT_TRUE(c);
+  c->Update();
+
+  const size_t channel_count = 2048;
+  Mixer mixer(SoundInfo(1, 16, 2, 44100), channel_count);
+  KeySoundPoolWithTime soundpool(&mixer, channel_count);
+  soundpool.LoadFromChartAndSound(*c);
+  EXPECT_TRUE(soundpool.is_loading_finished());
+
+  size_t loaded = 0, borrowed = 0;
+  for (size_t i = 0; i < channel_count; ++i)
+  {
+    Channel *ch = soundpool.get_channel(i);
+    if (!ch || !ch->get_sound() || ch->get_sound()->is_empty())
+      continue;
+    loaded++;
+    if (ch->get_sound()->is_borrowed())
+      borrowed++;
+  }
+  EXPECT_GT(loaded, 0u);
+  EXPECT_GT(borrowed, 0u);
+
+  // referenced keysounds are still mixable without song directory.
+  song.Close();
+  Sound s;
+  soundpool.SetAutoPlay(true);
+  soundpool.RecordToSound(s);
+  EXPECT_GT(s.get_frame_count(), 0u);
+  EXPECT_GT(s.GetSoundLevel(0, s.get_sample_count()), 0.f);
+}
+
+TEST(MIXER, BMS_PARALLEL)
+{
+  /** loading with several threads gives the same keysounds as one thread. */
+  using namespace rmixer;
+  rparser::Song song;
+  ASSERT_TRUE(song.Open(TEST_PATH + u8"人　身　事　故　で　停　止.zip"));
+  rparser::Chart *c = song.GetChart(0);
+  ASSERT_TRUE(c);
+  c->Update();
+
+  const size_t channel_count = 2048;
+  Mixer mixer_single(SoundInfo(1, 16, 2, 44100), channel_count);
+  KeySoundPoolWithTime pool_single(&mixer_single, channel_count);
+  pool_single.LoadFromChart(*c);
+  pool_single.LoadRemainingSoundParallel(1);
+  EXPECT_TRUE(pool_single.is_loading_finished());
+
+  Mixer mixer_parallel(SoundInfo(1, 16, 2, 44100), channel_count);
+  KeySoundPoolWithTime pool_parallel(&mixer_parallel, channel_count);
+  pool_parallel.LoadFromChart(*c);
+  pool_parallel.LoadRemainingSoundParallel(4);
+  EXPECT_TRUE(pool_parallel.is_loading_finished());
+  EXPECT_EQ(pool_single.get_total_load_byte(), pool_parallel.get_total_load_byte());
+
+  size_t loaded = 0;
+  for (size_t i = 0; i < channel_count; ++i)
+  {
+    Channel *ch1 = pool_single.get_channel(i);
+    Channel *ch2 = pool_parallel.get_channel(i);
+    const Sound *s1 = ch1 ? ch1->get_sound() : nullptr;
+    const Sound *s2 = ch2 ? ch2->get_sound() : nullptr;
+    const bool is_loaded = s1 && !s1->is_empty();
+    ASSERT_EQ(is_loaded, s2 && !s2->is_empty());
+    if (!is_loaded)
+      continue;
+    loaded++;
+    EXPECT_EQ(s1->get_frame_count(), s2->get_frame_count());
+  }
+  EXPECT_GT(loaded, 0u);
+}
+
+TEST(MIXER, BMS_ASYNC_LOAD)
+{
+  /** playback starts while keysounds are loaded in background,
+   *  and no trigger is dropped by a sound not loaded yet. */
+  using namespace rmixer;
+  rparser::Song song;
+  ASSERT_TRUE(song.Open(TEST_PATH + u8"人　身　事　故　で　停　止.zip"));
+  rparser::Chart *c = song.GetChart(0);
+  ASSERT_TRUE(c);
+  c->Update();
+
+  const size_t channel_count = 2048;
+  const SoundInfo mixinfo(1, 16, 2, 44100);
+  const float step_ms = 20.f;
+  const size_t step_frame = GetFrameFromMilisecond((uint32_t)step_ms, mixinfo);
+  std::vector<int16_t> buf(step_frame * mixinfo.channels);
+
+  // count playing channels of each step for first seconds of chart.
+  auto count_playing = [&](KeySoundPoolWithTime &soundpool, Mixer &mixer) {
+    size_t playing = 0;
+    soundpool.SetAutoPlay(true);
+    for (float t = 0; t < 5000.f; t += step_ms)
+    {
+      soundpool.Update(step_ms);
+      for (size_t i = 0; i < channel_count; ++i)
+      {
+        Channel *ch = soundpool.get_channel(i);
+        if (ch && ch->is_playing())
+          playing++;
+      }
+      memset(buf.data(), 0, buf.size() * sizeof(int16_t));
+      mixer.MixAll((char*)buf.data(), step_frame);
+    }
+    return playing;
+  };
+
+  Mixer mixer_loaded(mixinfo, channel_count);
+  KeySoundPoolWithTime pool_loaded(&mixer_loaded, channel_count);
+  pool_loaded.LoadFromChartAndSound(*c);
+  const size_t playing_loaded = count_playing(pool_loaded, mixer_loaded);
+  EXPECT_GT(playing_loaded, 0u);
+
+  Mixer mixer_async(mixinfo, channel_count);
+  KeySoundPoolWithTime pool_async(&mixer_async, channel_count);
+  pool_async.LoadFromChart(*c);
+  pool_async.StartLoading(2);
+  EXPECT_EQ(playing_loaded, count_playing(pool_async, mixer_async));
+  pool_async.StopLoading();
+
+  // remaining sounds are loaded after restarting loader.
+  pool_async.StartLoading(2);
+  while (!pool_async.is_loading_finished())
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  pool_async.StopLoading();
+  EXPECT_EQ(pool_loaded.get_total_load_byte(), pool_async.get_total_load_byte());
+}
+
+TEST(MIXER, BMS_MEMORY_BUDGET)
+{
+  /** keysounds are decoded on demand within memory budget,
+   *  and every triggered keysound is resident when it is played. */
+  using namespace rmixer;
+  rparser::Song song;
+  ASSERT_TRUE(song.Open(TEST_PATH + u8"人　身　事　故　で　停　止.zip"));
+  rparser::Chart *c = song.GetChart(0);
+  ASSERT_TRUE(c);
+  c->Update();
+
+  const size_t channel_count = 2048;
+  const size_t budget = 512 * 1024;
+  const SoundInfo mixinfo(1, 16, 2, 44100);
+  Mixer mixer(mixinfo, channel_count);
+  KeySoundPoolWithTime soundpool(&mixer, channel_count);
+  soundpool.SetMemoryBudget(budget, 500.f);
+  soundpool.LoadFromChartAndSound(*c);
+  EXPECT_EQ(0u, soundpool.get_resident_byte());
+  ASSERT_GT(soundpool.get_total_load_byte(), budget);
+
+  // play in real-time steps with mixing, so finished sounds can be evicted.
+  const float step_ms = 20.f;
+  const size_t step_frame = GetFrameFromMilisecond((uint32_t)step_ms, mixinfo);
+  std::vector<int16_t> buf(step_frame * mixinfo.channels);
+  const float end_time = soundpool.GetLastSoundTime();
+  size_t missed = 0, max_resident = 0;
+  soundpool.SetAutoPlay(true);
+  for (float t = 0; t < end_time; t += step_ms)
+  {
+    soundpool.Update(step_ms);
+    for (size_t i = 0; i < channel_count; ++i)
+    {
+      Channel *ch = soundpool.get_channel(i);
+      if (ch && ch->is_playing() && ch->get_sound()->is_empty())
+        missed++;
+    }
+    max_resident = std::max(max_resident, soundpool.get_resident_byte());
+    memset(buf.data(), 0, buf.size() * sizeof(int16_t));
+    mixer.MixAll((char*)buf.data(), step_frame);
+  }
+  EXPECT_EQ(0u, missed);
+  EXPECT_GT(max_resident, 0u);
+  EXPECT_LT(max_resident, soundpool.get_total_load_byte());
+}
+
 TEST(MIXER, MIDI)
 {
   /** midi mixing test with VOS file. */
@@ -597,6 +1295,213 @@ TEST(MIXER, MIDI)
   song.Close();
 }
 
+TEST(MIXER, MIDI_FORMAT)
+{
+  /** midi rendered directly in 32bit / float should match 16bit output. */
+  using namespace rmixer;
+  const size_t kFrameCount = 4096;
+  const std::string cfg = TEST_PATH + "midi.cfg";
+  Midi midi_s16(SoundInfo(1, 16, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  Midi midi_s32(SoundInfo(1, 32, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  Midi midi_f32(SoundInfo(2, 32, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  ASSERT_TRUE(midi_s16.LoadFromStream());
+  ASSERT_TRUE(midi_s32.LoadFromStream());
+  ASSERT_TRUE(midi_f32.LoadFromStream());
+
+  std::vector<int16_t> out_s16(kFrameCount * 2);
+  std::vector<int32_t> out_s32(kFrameCount * 2);
+  std::vector<float> out_f32(kFrameCount * 2);
+  for (Midi *m : { &midi_s16, &midi_s32, &midi_f32 })
+    m->Play(0, 60);
+  midi_s16.GetMixedPCMData((char*)out_s16.data(), out_s16.size() * sizeof(int16_t));
+  midi_s32.GetMixedPCMData((char*)out_s32.data(), out_s32.size() * sizeof(int32_t));
+  midi_f32.GetMixedPCMData((char*)out_f32.data(), out_f32.size() * sizeof(float));
+
+  for (size_t i = 0; i < out_s16.size(); ++i)
+  {
+    EXPECT_EQ(out_s16[i], out_s32[i] >> 16);
+    EXPECT_NEAR(out_s16[i] / 32768.0f, out_f32[i], 1.0f / 32768);
+  }
+}
+
+/* @brief writes a one-sample GUS patch (looped sine, no envelope) and a
+ * timidity config using it for every program, so midi rendering can be
+ * checked without the instrument set of midi.cfg. returns config path. */
+static std::string write_test_midi_config()
+{
+  const std::string dir = testing::TempDir();
+  const size_t kPeriod = 100, kCycle = 10;
+  std::vector<uint8_t> pat(239 + 96, 0);
+  memcpy(pat.data(), "GF1PATCH110\0ID#000002", 22);
+  pat[82] = 1;                      // instruments
+  pat[151] = 1;                     // layers
+  pat[198] = 1;                     // samples
+  auto put = [&pat](size_t off, uint32_t v, size_t n) {
+    for (size_t i = 0; i < n; ++i) pat[off + i] = (uint8_t)(v >> (i * 8));
+  };
+  const size_t s = 239;
+  const uint32_t data_len = kPeriod * kCycle * 2;
+  put(s + 8, data_len, 4);          // data length
+  put(s + 12, 0, 4);                // loop start
+  put(s + 16, data_len, 4);         // loop end
+  put(s + 20, 44100, 2);            // sample rate
+  put(s + 22, 0, 4);                // low freq
+  put(s + 26, 0x7FFFFFFF, 4);       // high freq
+  put(s + 30, 441000, 4);           // root freq (mHz)
+  pat[s + 36] = 7;                  // center panning
+  pat[s + 55] = 1 << 0 | 1 << 2;    // MODES_16BIT | MODES_LOOPING
+  for (size_t i = 0; i < kPeriod * kCycle; ++i)
+  {
+    int16_t v = (int16_t)(16000 * sin(2 * M_PI * i / kPeriod));
+    pat.push_back((uint8_t)v);
+    pat.push_back((uint8_t)(v >> 8));
+  }
+  FILE *fp = fopen((dir + "test_tone.pat").c_str(), "wb");
+  if (!fp) return std::string();
+  fwrite(pat.data(), 1, pat.size(), fp);
+  fclose(fp);
+
+  const std::string cfg_path = dir + "test_tone.cfg";
+  fp = fopen(cfg_path.c_str(), "w");
+  if (!fp) return std::string();
+  fprintf(fp, "dir %s\nbank 0\n", dir.c_str());
+  for (int i = 0; i < 128; ++i)
+    fprintf(fp, "%d test_tone.pat\n", i);
+  fclose(fp);
+  return cfg_path;
+}
+
+TEST(MIXER, MIDI_QUEUE_EVENT)
+{
+  /** queued midi events should be rendered at exact frame. */
+  using namespace rmixer;
+  const size_t kNoteFrame = 1234;
+  const std::string cfg = write_test_midi_config();
+  ASSERT_FALSE(cfg.empty());
+  Midi midi(SoundInfo(1, 16, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  ASSERT_TRUE(midi.LoadFromStream());
+
+  midi.QueueEvents({ { kNoteFrame, 0, kMidiEventNoteOn, 60, 127 } });
+  std::vector<int16_t> out(4096 * 2);
+  midi.GetMixedPCMData((char*)out.data(), out.size() * sizeof(int16_t));
+  for (size_t i = 0; i < kNoteFrame * 2; ++i)
+    ASSERT_EQ(0, out[i]);
+
+  // note sounds right from its frame.
+  const size_t kAttackFrame = 32;
+  bool is_started = false;
+  for (size_t i = kNoteFrame * 2; i < (kNoteFrame + kAttackFrame) * 2; ++i)
+    is_started |= (out[i] != 0);
+  EXPECT_TRUE(is_started);
+  size_t nonzero = 0;
+  for (size_t i = kNoteFrame * 2; i < out.size(); ++i)
+    nonzero += (out[i] != 0);
+  EXPECT_GT(nonzero, (out.size() - kNoteFrame * 2) / 2);
+
+  // far event queued after stream has advanced is never reached (no overflow).
+  Midi far_midi(SoundInfo(1, 16, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  ASSERT_TRUE(far_midi.LoadFromStream());
+  far_midi.GetMixedPCMData((char*)out.data(), out.size() * sizeof(int16_t));
+  far_midi.QueueEvents({ { (size_t)INT_MAX, 0, kMidiEventNoteOn, 60, 127 } });
+  far_midi.GetMixedPCMData((char*)out.data(), out.size() * sizeof(int16_t));
+  for (size_t i = 0; i < out.size(); ++i)
+    ASSERT_EQ(0, out[i]);
+
+  remove((testing::TempDir() + "test_tone.pat").c_str());
+  remove(cfg.c_str());
+}
+
+TEST(MIXER, MIDI_SIMD)
+{
+  /** vectorized resampling and mixing of timidity should equal scalar path. */
+  using namespace rmixer;
+  const std::string cfg = write_test_midi_config();
+  ASSERT_FALSE(cfg.empty());
+  // hard-panned, centered and pitch-bent voices, starting at odd frames.
+  const std::vector<MidiEvent> events = {
+    { 0, 0, 5 /* ME_PAN */, 0, 0 },
+    { 0, 1, 5 /* ME_PAN */, 127, 0 },
+    { 0, 2, 5 /* ME_PAN */, 40, 0 },
+    { 3, 0, kMidiEventNoteOn, 60, 127 },
+    { 101, 1, kMidiEventNoteOn, 67, 90 },
+    { 517, 2, kMidiEventNoteOn, 72, 110 },
+    { 1001, 3, kMidiEventNoteOn, 48, 127 },
+    { 2003, 3, 8 /* ME_PITCHWHEEL */, 0x12, 0x50 },
+    { 3001, 0, kMidiEventNoteOff, 60, 0 },
+    { 4099, 1, kMidiEventNoteOff, 67, 0 },
+  };
+
+  for (uint8_t channels : { 1, 2 })
+  {
+    std::vector<int16_t> out[2];
+    for (size_t k = 0; k < 2; ++k)
+    {
+      Sound::EnableSIMD(k == 0);
+      Midi midi(SoundInfo(1, 16, channels, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+      if (midi.LoadFromStream())
+      {
+        midi.QueueEvents(events);
+        out[k].resize(8192 * channels);
+        midi.GetMixedPCMData((char*)out[k].data(), out[k].size() * sizeof(int16_t));
+      }
+    }
+    Sound::EnableSIMD(true);
+    ASSERT_FALSE(out[0].empty());
+    size_t nonzero = 0;
+    for (int16_t v : out[0])
+      nonzero += (v != 0);
+    EXPECT_GT(nonzero, out[0].size() / 2);
+    EXPECT_EQ(out[1], out[0]);
+  }
+
+  remove((testing::TempDir() + "test_tone.pat").c_str());
+  remove(cfg.c_str());
+}
+
+TEST(MIXER, MIDI_DIRECT_MIX)
+{
+  /** midi mixed into existing PCM data should equal rendered data added. */
+  using namespace rmixer;
+  const std::string cfg = TEST_PATH + "midi.cfg";
+  Midi midi_ref(SoundInfo(1, 16, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  Midi midi_mix(SoundInfo(1, 16, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+  ASSERT_TRUE(midi_ref.LoadFromStream());
+  ASSERT_TRUE(midi_mix.LoadFromStream());
+  midi_ref.Play(0, 60);
+  midi_mix.Play(0, 60);
+
+  std::vector<int16_t> ref(4096 * 2), out(4096 * 2, 100);
+  midi_ref.GetMixedPCMData((char*)ref.data(), ref.size() * sizeof(int16_t));
+  ASSERT_EQ(out.size() * sizeof(int16_t),
+    midi_mix.MixPCMData((char*)out.data(), out.size() * sizeof(int16_t), 0.5f));
+  for (size_t i = 0; i < out.size(); ++i)
+    EXPECT_EQ((int16_t)(100 + (int)(ref[i] * 0.5f)), out[i]);
+}
+
+TEST(MIXER, MIDI_MULTI_INSTANCE)
+{
+  /** midi instances own their config, so they can render concurrently. */
+  using namespace rmixer;
+  const std::string cfg = TEST_PATH + "midi.cfg";
+  std::vector<int16_t> out[4];
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&cfg, &out, t]() {
+      Midi midi(SoundInfo(1, 16, 2, 44100), kMidiDefMaxBufferByteSize, cfg.c_str());
+      if (!midi.LoadFromStream()) return;
+      midi.Play(0, 60);
+      out[t].resize(4096 * 2);
+      midi.GetMixedPCMData((char*)out[t].data(), out[t].size() * sizeof(int16_t));
+    });
+  }
+  for (auto &th : threads)
+    th.join();
+  ASSERT_FALSE(out[0].empty());
+  for (size_t t = 1; t < 4; ++t)
+    EXPECT_EQ(out[0], out[t]);
+}
+
 TEST(SAMPLER, PITCH)
 {
   // MUST precede MIXER.BMS test
@@ -622,6 +1527,145 @@ TEST(SAMPLER, TEMPO)
   ASSERT_TRUE(s.Save(TEST_PATH + "test_bms_resample2.ogg"));
 }
 
+TEST(SAMPLER, TEMPO_SIMD)
+{
+  // SIMD cross-correlation of tempo change should give same result as scalar path.
+  using namespace rmixer;
+  const size_t kFrameCount = 44100 * 10;
+
+  for (uint8_t is_signed : { 1, 2 })
+  {
+    SoundInfo info(is_signed, is_signed == 2 ? 32 : 16, 2, 44100);
+    for (double length : { 0.666, 1.5 })
+    {
+      Sound s[2];
+      for (size_t k = 0; k < 2; ++k)
+      {
+        int8_t *p = (int8_t*)malloc(GetByteFromFrame(kFrameCount, info));
+        for (size_t i = 0; i < kFrameCount; ++i)
+        {
+          double v = sin(i * 0.0627) * 8000 + sin(i * 0.0131) * 6000;
+          if (is_signed == 2)
+          {
+            ((float*)p)[i * 2] = static_cast<float>(v / 32768);
+            ((float*)p)[i * 2 + 1] = static_cast<float>(-v / 32768);
+          }
+          else
+          {
+            ((int16_t*)p)[i * 2] = static_cast<int16_t>(v);
+            ((int16_t*)p)[i * 2 + 1] = static_cast<int16_t>(-v);
+          }
+        }
+        s[k].SetBuffer(info, kFrameCount, p);
+        Sound::EnableSIMD(k == 0);
+        EXPECT_TRUE(s[k].Effect(1.0, length, 1.0));
+      }
+      Sound::EnableSIMD(true);
+      ASSERT_EQ(static_cast<size_t>(kFrameCount * length), s[0].get_frame_count());
+      ASSERT_EQ(s[1].get_frame_count(), s[0].get_frame_count());
+      EXPECT_EQ(0, memcmp(s[0].get_ptr(), s[1].get_ptr(),
+        GetByteFromFrame(s[0].get_frame_count(), info)));
+    }
+  }
+}
+
+TEST(SAMPLER, STREAM_EFFECTOR)
+{
+  using namespace rmixer;
+  const size_t kFrameCount = 44100;
+  SoundInfo info(1, 16, 2, 44100);
+  Sound src;
+  int16_t *p = (int16_t*)malloc(kFrameCount * 2 * sizeof(int16_t));
+  for (size_t i = 0; i < kFrameCount; ++i)
+    p[i * 2] = p[i * 2 + 1] = static_cast<int16_t>(sin(i * 0.0627) * 16000);
+  src.SetBuffer(info, kFrameCount, p);
+
+  // 1. push/pull block-by-block
+  for (auto effect : { std::make_pair(1.5, 1.0), std::make_pair(1.0, 0.666),
+                       std::make_pair(1.2, 1.2) })
+  {
+    StreamEffector effector(info);
+    effector.SetPitch(effect.first);
+    effector.SetTempo(effect.second);
+    Sound out;
+    out.AllocateFrame(info, kFrameCount * 2);
+    size_t in_frame = 0, out_frame = 0;
+    while (!effector.is_finished())
+    {
+      const size_t len = std::min((size_t)1000, kFrameCount - in_frame);
+      if (len > 0)
+        effector.Push(src.get_ptr() + src.GetByteFromFrame(in_frame), len);
+      else
+        effector.Flush();
+      in_frame += len;
+      out_frame += effector.Pull(out.get_ptr() + out.GetByteFromFrame(out_frame), 2000);
+    }
+    EXPECT_NEAR(kFrameCount * effect.second / effect.first, (double)out_frame, 2048);
+    EXPECT_NEAR(src.GetSoundLevel(4096, 4096), out.GetSoundLevel(4096, 4096), 0.05);
+  }
+
+  // 2. channel plays until effector output is drained
+  {
+    Mixer mixer(info, 4);
+    Sound out;
+    out.AllocateFrame(info, kFrameCount * 2);
+    Channel *ch = mixer.PlaySound(&src, false);
+    ASSERT_TRUE(ch);
+    ch->SetEffect(1.0, 1.5);
+    ch->Play();
+    mixer.MixAll((char*)out.get_ptr(), kFrameCount);
+    EXPECT_TRUE(ch->is_playing());
+    mixer.MixAll((char*)out.get_ptr() + out.GetByteFromFrame(kFrameCount), kFrameCount);
+    EXPECT_FALSE(ch->is_playing());
+    EXPECT_NEAR(src.GetSoundLevel(4096, 4096), out.GetSoundLevel(kFrameCount + 4096, 4096), 0.05);
+    ch->SetSound(nullptr);
+  }
+}
+
+TEST(SAMPLER, CHANNEL_RATE)
+{
+  using namespace rmixer;
+  const size_t kFrameCount = 4410;
+  SoundInfo info(1, 16, 2, 44100);
+  Sound src;
+  int16_t *p = (int16_t*)malloc(kFrameCount * 2 * sizeof(int16_t));
+  for (size_t i = 0; i < kFrameCount; ++i)
+    p[i * 2] = p[i * 2 + 1] = static_cast<int16_t>(sin(i * 0.0627) * 16000);
+  src.SetBuffer(info, kFrameCount, p);
+
+  for (bool cubic : { false, true })
+  {
+    Mixer mixer(info, 4);
+    Channel *ch = mixer.PlaySound(&src, false);
+    ASSERT_TRUE(ch);
+    ch->SetCubicInterpolation(cubic);
+
+    // one octave up: played in half duration
+    Sound out;
+    out.AllocateFrame(info, kFrameCount);
+    ch->SetKey(12);
+    EXPECT_DOUBLE_EQ(2.0, ch->get_playback_rate());
+    ch->Play();
+    mixer.MixAll((char*)out.get_ptr(), kFrameCount / 2 - 1);
+    EXPECT_TRUE(ch->is_playing());
+    mixer.MixAll((char*)out.get_ptr() + out.GetByteFromFrame(kFrameCount / 2 - 1), 1);
+    EXPECT_FALSE(ch->is_playing());
+    EXPECT_NEAR(src.GetSoundLevel(0, 1024), out.GetSoundLevel(0, 1024), 0.05);
+    EXPECT_EQ(0, *(int16_t*)(out.get_ptr() + out.GetByteFromFrame(kFrameCount / 2)));
+
+    // half speed: played in double duration
+    Sound out2;
+    out2.AllocateFrame(info, kFrameCount * 2);
+    ch->SetKey(0);
+    ch->SetSpeed(0.5f);
+    ch->Play();
+    mixer.MixAll((char*)out2.get_ptr(), kFrameCount * 2);
+    EXPECT_FALSE(ch->is_playing());
+    EXPECT_NEAR(src.GetSoundLevel(0, 1024), out2.GetSoundLevel(0, 2048), 0.05);
+    ch->SetSound(nullptr);
+  }
+}
+
 int main(int argc, char **argv)
 {
   ::testing::InitGoogleTest(&argc, argv);
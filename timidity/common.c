@@ -53,10 +53,15 @@ struct _PathList {
   struct _PathList *next;
 };
 
-static PathList *pathlist = NULL;
-
 /* This is meant to find and open files for reading */
-FILE *timi_openfile(const char *name)
+FILE *timi_openfile(PathList *pathlist, const char *name)
+{
+  return timi_openfile_path(pathlist, name, NULL);
+}
+
+/* Same as timi_openfile(), and stores the path actually opened into
+   'opened_path' (TIM_MAXPATH bytes) if it is not NULL. */
+FILE *timi_openfile_path(PathList *pathlist, const char *name, char *opened_path)
 {
   FILE *fp;
 
@@ -69,7 +74,14 @@ FILE *timi_openfile(const char *name)
   /* First try the given name */
   DEBUG_MSG("Trying to open %s\n", name);
   if ((fp = fopen(name, OPEN_MODE)) != NULL)
-    return fp;
+    {
+      if (opened_path)
+        {
+          strncpy(opened_path, name, TIM_MAXPATH - 1);
+          opened_path[TIM_MAXPATH - 1] = '\0';
+        }
+      return fp;
+    }
 
   if (!is_abspath(name))
   {
@@ -92,7 +104,11 @@ FILE *timi_openfile(const char *name)
 	strcat(current_filename, name);
 	DEBUG_MSG("Trying to open %s\n", current_filename);
 	if ((fp = fopen(current_filename, OPEN_MODE)) != NULL)
-	  return fp;
+	  {
+	    if (opened_path)
+	      strcpy(opened_path, current_filename);
+	    return fp;
+	  }
 	plp = plp->next;
     }
   }
@@ -115,7 +131,7 @@ void *timi_calloc(size_t count)
 }
 
 /* This adds a directory to the path list */
-int timi_add_pathlist(const char *s, size_t l)
+int timi_add_pathlist(PathList **pathlist, const char *s, size_t l)
 {
   PathList *plp = (PathList *) timi_malloc(sizeof(PathList));
   if (!plp) return -2;
@@ -124,16 +140,16 @@ int timi_add_pathlist(const char *s, size_t l)
     timi_free (plp);
     return -2;
   }
-  plp->next = pathlist;
-  pathlist = plp;
+  plp->next = *pathlist;
+  *pathlist = plp;
   strncpy(plp->path, s, l);
   plp->path[l] = 0;
   return 0;
 }
 
-void timi_free_pathlist(void)
+void timi_free_pathlist(PathList **pathlist)
 {
-    PathList *plp = pathlist;
+    PathList *plp = *pathlist;
     PathList *next;
 
     while (plp) {
@@ -142,5 +158,5 @@ void timi_free_pathlist(void)
 	timi_free(plp);
 	plp = next;
     }
-    pathlist = NULL;
+    *pathlist = NULL;
 }
@@ -31,12 +31,13 @@
 #ifndef TIMIDITY_COMMON_H
 #define TIMIDITY_COMMON_H
 
-extern FILE *timi_openfile(const char *name);
-
-/* pathlist funcs only to be used during mid_init/mid_exit */
+/* search paths are owned by MidConfig; pathlist funcs are only to be used
+   while loading/freeing config. */
 typedef struct _PathList PathList;
-extern int  timi_add_pathlist(const char *s, size_t len);
-extern void timi_free_pathlist(void);
+extern FILE *timi_openfile(PathList *pathlist, const char *name);
+extern FILE *timi_openfile_path(PathList *pathlist, const char *name, char *opened_path);
+extern int  timi_add_pathlist(PathList **pathlist, const char *s, size_t len);
+extern void timi_free_pathlist(PathList **pathlist);
 
 /* in case someone wants to compile with a different malloc() than stdlib */
 #define timi_malloc malloc
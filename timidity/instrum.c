@@ -40,6 +40,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #include "timidity_internal.h"
 #include "common.h"
@@ -62,6 +67,148 @@ static void free_instrument(MidInstrument *ip)
   timi_free(ip);
 }
 
+/* Process-wide instrument cache.
+   Instruments are shared between songs with same patch file, load
+   parameters and output rate, so a patch is loaded (and pre-resampled)
+   only once. Entries are refcounted by songs using them, and unused
+   entries are kept until mid_instrument_cache_clear() is called. */
+
+typedef struct _InstrumentCacheEntry InstrumentCacheEntry;
+struct _InstrumentCacheEntry
+{
+  char *path;
+  int percussion, panning, amp, note_to_use,
+      strip_loop, strip_envelope, strip_tail;
+  sint32 rate, control_ratio;
+  MidInstrument *ip;
+  int refcount;
+  InstrumentCacheEntry *next;
+};
+
+static InstrumentCacheEntry *instrument_cache = NULL;
+
+#if defined(_WIN32)
+static SRWLOCK instrument_cache_lock = SRWLOCK_INIT;
+#define LOCK_INSTRUMENT_CACHE()   AcquireSRWLockExclusive(&instrument_cache_lock)
+#define UNLOCK_INSTRUMENT_CACHE() ReleaseSRWLockExclusive(&instrument_cache_lock)
+#else
+static pthread_mutex_t instrument_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_INSTRUMENT_CACHE()   pthread_mutex_lock(&instrument_cache_lock)
+#define UNLOCK_INSTRUMENT_CACHE() pthread_mutex_unlock(&instrument_cache_lock)
+#endif
+
+static int cache_entry_match(const InstrumentCacheEntry *a,
+			     const InstrumentCacheEntry *b)
+{
+  return a->percussion == b->percussion &&
+	 a->panning == b->panning &&
+	 a->amp == b->amp &&
+	 a->note_to_use == b->note_to_use &&
+	 a->strip_loop == b->strip_loop &&
+	 a->strip_envelope == b->strip_envelope &&
+	 a->strip_tail == b->strip_tail &&
+	 a->rate == b->rate &&
+	 a->control_ratio == b->control_ratio &&
+	 !strcmp(a->path, b->path);
+}
+
+/* Returns cached instrument with its refcount increased, or NULL. */
+static MidInstrument *acquire_cached_instrument(const InstrumentCacheEntry *key)
+{
+  InstrumentCacheEntry *e;
+  MidInstrument *ip = NULL;
+  LOCK_INSTRUMENT_CACHE();
+  for (e = instrument_cache; e; e = e->next)
+    if (cache_entry_match(e, key))
+      {
+	e->refcount++;
+	ip = e->ip;
+	break;
+      }
+  UNLOCK_INSTRUMENT_CACHE();
+  return ip;
+}
+
+/* Register newly loaded instrument. If same instrument was registered
+   by other thread meanwhile, new one is freed and cached one is used. */
+static MidInstrument *register_cached_instrument(const InstrumentCacheEntry *key,
+						 MidInstrument *ip)
+{
+  InstrumentCacheEntry *e;
+  LOCK_INSTRUMENT_CACHE();
+  for (e = instrument_cache; e; e = e->next)
+    if (cache_entry_match(e, key))
+      {
+	e->refcount++;
+	UNLOCK_INSTRUMENT_CACHE();
+	free_instrument(ip);
+	return e->ip;
+      }
+  e = (InstrumentCacheEntry *) timi_calloc(sizeof(InstrumentCacheEntry));
+  if (e)
+    e->path = (char *) timi_malloc(strlen(key->path) + 1);
+  if (!e || !e->path)
+    {
+      /* not cached; instrument is owned by the song only */
+      UNLOCK_INSTRUMENT_CACHE();
+      timi_free(e);
+      return ip;
+    }
+  strcpy(e->path, key->path);
+  e->percussion = key->percussion;
+  e->panning = key->panning;
+  e->amp = key->amp;
+  e->note_to_use = key->note_to_use;
+  e->strip_loop = key->strip_loop;
+  e->strip_envelope = key->strip_envelope;
+  e->strip_tail = key->strip_tail;
+  e->rate = key->rate;
+  e->control_ratio = key->control_ratio;
+  e->ip = ip;
+  e->refcount = 1;
+  e->next = instrument_cache;
+  instrument_cache = e;
+  UNLOCK_INSTRUMENT_CACHE();
+  return ip;
+}
+
+static void release_instrument(MidInstrument *ip)
+{
+  InstrumentCacheEntry *e;
+  if (!ip) return;
+  LOCK_INSTRUMENT_CACHE();
+  for (e = instrument_cache; e; e = e->next)
+    if (e->ip == ip)
+      {
+	if (e->refcount > 0)
+	  e->refcount--;
+	UNLOCK_INSTRUMENT_CACHE();
+	return;
+      }
+  UNLOCK_INSTRUMENT_CACHE();
+  free_instrument(ip);
+}
+
+void mid_instrument_cache_clear(void)
+{
+  InstrumentCacheEntry **pe, *e;
+  LOCK_INSTRUMENT_CACHE();
+  pe = &instrument_cache;
+  while ((e = *pe) != NULL)
+    {
+      if (e->refcount == 0)
+	{
+	  *pe = e->next;
+	  free_instrument(e->ip);
+	  timi_free(e->path);
+	  timi_free(e);
+	}
+      else
+	pe = &e->next;
+    }
+  UNLOCK_INSTRUMENT_CACHE();
+}
+
 static void free_bank(MidSong *song, int dr, int b)
 {
   int i;
@@ -70,7 +217,7 @@ static void free_bank(MidSong *song, int dr, int b)
     if (bank->instrument[i])
       {
 	if (bank->instrument[i] != MAGIC_LOAD_INSTRUMENT)
-	  free_instrument(bank->instrument[i]);
+	  release_instrument(bank->instrument[i]);
 	bank->instrument[i] = NULL;
       }
 }
@@ -183,6 +330,8 @@ static void load_instrument(MidSong *song, const char *name,
   MidSample *sp;
   FILE *fp;
   char tmp[TMPSIZE];
+  char path[TIM_MAXPATH];
+  InstrumentCacheEntry key;
   int i,j;
   static const char *patch_ext[] = PATCH_EXT_LIST;
 
@@ -190,7 +339,7 @@ static void load_instrument(MidSong *song, const char *name,
   if (!name) return;
 
   /* Open patch file */
-  if ((fp=timi_openfile(name)) == NULL)
+  if ((fp=timi_openfile_path(song->pathlist, name, path)) == NULL)
     {
       /* Try with various extensions */
       for (i=0; patch_ext[i]; i++)
@@ -199,7 +348,7 @@ static void load_instrument(MidSong *song, const char *name,
 	    {
 	      strcpy(tmp, name);
 	      strcat(tmp, patch_ext[i]);
-	      if ((fp=timi_openfile(tmp)) != NULL)
+	      if ((fp=timi_openfile_path(song->pathlist, tmp, path)) != NULL)
 		break;
 	    }
 	}
@@ -211,7 +360,24 @@ static void load_instrument(MidSong *song, const char *name,
       return;
     }
 
-  DEBUG_MSG("Loading instrument %s\n", tmp);
+  /* Use cached one if same patch was loaded with same parameters */
+  key.path = path;
+  key.percussion = percussion;
+  key.panning = panning;
+  key.amp = amp;
+  key.note_to_use = note_to_use;
+  key.strip_loop = strip_loop;
+  key.strip_envelope = strip_envelope;
+  key.strip_tail = strip_tail;
+  key.rate = song->rate;
+  key.control_ratio = song->control_ratio;
+  if ((*out = acquire_cached_instrument(&key)) != NULL)
+    {
+      fclose(fp);
+      return;
+    }
+
+  DEBUG_MSG("Loading instrument %s\n", path);
 
   /* Read some headers and do cursory sanity checks. There are loads
      of magic offsets. This could be rewritten... */
@@ -523,6 +689,7 @@ static void load_instrument(MidSong *song, const char *name,
     }
 
   fclose(fp);
+  *out = register_cached_instrument(&key, ip);
   return;
 
 nomem:
@@ -629,6 +796,8 @@ void free_instruments(MidSong *song)
       if (song->drumset[i])
 	free_bank(song, 1, i);
     }
+  release_instrument(song->default_instrument);
+  song->default_instrument = NULL;
 }
 
 int set_default_instrument(MidSong *song, const char *name)
@@ -38,6 +38,9 @@
 #include <stdlib.h>
 
 #include "timidity_internal.h"
+#ifdef TIMI_USE_SSE2
+#include <emmintrin.h>
+#endif
 #include "instrum.h"
 #include "playmidi.h"
 #include "output.h"
@@ -193,6 +196,112 @@ static int update_signal(MidSong *song, int v)
 
 #define MIXATION(a)	*lp++ += (a)*s;
 
+/* Block mixers: add count samples with constant volume into lp.
+   Volumes are at most MAX_AMP_VALUE, so every product is exactly
+   representable as 16x16->32 bit multiplication. */
+
+#define VOLUME_FITS_INT16(a)	((a) >= -32768 && (a) <= 32767)
+
+static void mix_block_stereo(const sample_t *sp, sint32 *lp,
+			     final_volume_t left, final_volume_t right,
+			     int count)
+{
+  sample_t s;
+#ifdef TIMI_USE_SSE2
+  if (timi_simd_enabled && VOLUME_FITS_INT16(left) && VOLUME_FITS_INT16(right))
+    {
+      const __m128i vol = _mm_set_epi16((short)right, (short)left,
+					(short)right, (short)left,
+					(short)right, (short)left,
+					(short)right, (short)left);
+      for (; count >= 8; count -= 8, sp += 8, lp += 16)
+	{
+	  __m128i x = _mm_loadu_si128((const __m128i *)sp);
+	  __m128i d0 = _mm_unpacklo_epi16(x, x);
+	  __m128i d1 = _mm_unpackhi_epi16(x, x);
+	  __m128i lo0 = _mm_mullo_epi16(d0, vol), hi0 = _mm_mulhi_epi16(d0, vol);
+	  __m128i lo1 = _mm_mullo_epi16(d1, vol), hi1 = _mm_mulhi_epi16(d1, vol);
+	  __m128i *dst = (__m128i *)lp;
+	  _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst),
+					      _mm_unpacklo_epi16(lo0, hi0)));
+	  _mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1),
+						  _mm_unpackhi_epi16(lo0, hi0)));
+	  _mm_storeu_si128(dst + 2, _mm_add_epi32(_mm_loadu_si128(dst + 2),
+						  _mm_unpacklo_epi16(lo1, hi1)));
+	  _mm_storeu_si128(dst + 3, _mm_add_epi32(_mm_loadu_si128(dst + 3),
+						  _mm_unpackhi_epi16(lo1, hi1)));
+	}
+    }
+#endif
+  while (count--)
+    {
+      s = *sp++;
+      MIXATION(left);
+      MIXATION(right);
+    }
+}
+
+/* Mix into every other sample (hard-panned voice of stereo output). */
+static void mix_block_single(const sample_t *sp, sint32 *lp,
+			     final_volume_t left, int count)
+{
+  sample_t s;
+#ifdef TIMI_USE_SSE2
+  if (timi_simd_enabled && VOLUME_FITS_INT16(left))
+    {
+      /* Other channel is loaded and stored back with zero added;
+	 keep the last frame for the scalar loop so we never touch
+	 the slot after the final sample (lp may be odd-aligned). */
+      const __m128i vol = _mm_set1_epi16((short)left);
+      const __m128i zero = _mm_setzero_si128();
+      for (; count > 4; count -= 4, sp += 4, lp += 8)
+	{
+	  __m128i x = _mm_loadl_epi64((const __m128i *)sp);
+	  __m128i p = _mm_unpacklo_epi16(_mm_mullo_epi16(x, vol),
+					 _mm_mulhi_epi16(x, vol));
+	  __m128i *dst = (__m128i *)lp;
+	  _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst),
+					      _mm_unpacklo_epi32(p, zero)));
+	  _mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1),
+						  _mm_unpackhi_epi32(p, zero)));
+	}
+    }
+#endif
+  while (count--)
+    {
+      s = *sp++;
+      MIXATION(left);
+      lp++;
+    }
+}
+
+static void mix_block_mono(const sample_t *sp, sint32 *lp,
+			   final_volume_t left, int count)
+{
+  sample_t s;
+#ifdef TIMI_USE_SSE2
+  if (timi_simd_enabled && VOLUME_FITS_INT16(left))
+    {
+      const __m128i vol = _mm_set1_epi16((short)left);
+      for (; count >= 8; count -= 8, sp += 8, lp += 8)
+	{
+	  __m128i x = _mm_loadu_si128((const __m128i *)sp);
+	  __m128i lo = _mm_mullo_epi16(x, vol), hi = _mm_mulhi_epi16(x, vol);
+	  __m128i *dst = (__m128i *)lp;
+	  _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst),
+					      _mm_unpacklo_epi16(lo, hi)));
+	  _mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1),
+						  _mm_unpackhi_epi16(lo, hi)));
+	}
+    }
+#endif
+  while (count--)
+    {
+      s = *sp++;
+      MIXATION(left);
+    }
+}
+
 static void mix_mystery_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
 			       int count)
 {
@@ -201,7 +310,6 @@ static void mix_mystery_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     left=vp->left_mix, 
     right=vp->right_mix;
   int cc;
-  sample_t s;
 
   if (!(cc = vp->control_counter))
     {
@@ -216,12 +324,9 @@ static void mix_mystery_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     if (cc < count)
       {
 	count -= cc;
-	while (cc--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	    MIXATION(right);
-	  }
+	mix_block_stereo(sp, lp, left, right, cc);
+	sp += cc;
+	lp += cc * 2;
 	cc = song->control_ratio;
 	if (update_signal(song, v))
 	  return;	/* Envelope ran out */
@@ -231,12 +336,7 @@ static void mix_mystery_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     else
       {
 	vp->control_counter = cc - count;
-	while (count--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	    MIXATION(right);
-	  }
+	mix_block_stereo(sp, lp, left, right, count);
 	return;
       }
 }
@@ -248,7 +348,6 @@ static void mix_center_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
   final_volume_t 
     left=vp->left_mix;
   int cc;
-  sample_t s;
 
   if (!(cc = vp->control_counter))
     {
@@ -262,12 +361,9 @@ static void mix_center_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     if (cc < count)
       {
 	count -= cc;
-	while (cc--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	    MIXATION(left);
-	  }
+	mix_block_stereo(sp, lp, left, left, cc);
+	sp += cc;
+	lp += cc * 2;
 	cc = song->control_ratio;
 	if (update_signal(song, v))
 	  return;	/* Envelope ran out */
@@ -276,12 +372,7 @@ static void mix_center_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     else
       {
 	vp->control_counter = cc - count;
-	while (count--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	    MIXATION(left);
-	  }
+	mix_block_stereo(sp, lp, left, left, count);
 	return;
       }
 }
@@ -293,7 +384,6 @@ static void mix_single_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
   final_volume_t 
     left=vp->left_mix;
   int cc;
-  sample_t s;
 
   if (!(cc = vp->control_counter))
     {
@@ -307,12 +397,9 @@ static void mix_single_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     if (cc < count)
       {
 	count -= cc;
-	while (cc--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	    lp++;
-	  }
+	mix_block_single(sp, lp, left, cc);
+	sp += cc;
+	lp += cc * 2;
 	cc = song->control_ratio;
 	if (update_signal(song, v))
 	  return;	/* Envelope ran out */
@@ -321,12 +408,7 @@ static void mix_single_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     else
       {
 	vp->control_counter = cc - count;
-	while (count--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	    lp++;
-	  }
+	mix_block_single(sp, lp, left, count);
 	return;
       }
 }
@@ -338,7 +420,6 @@ static void mix_mono_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
   final_volume_t 
     left=vp->left_mix;
   int cc;
-  sample_t s;
 
   if (!(cc = vp->control_counter))
     {
@@ -352,11 +433,9 @@ static void mix_mono_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     if (cc < count)
       {
 	count -= cc;
-	while (cc--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	  }
+	mix_block_mono(sp, lp, left, cc);
+	sp += cc;
+	lp += cc;
 	cc = song->control_ratio;
 	if (update_signal(song, v))
 	  return;	/* Envelope ran out */
@@ -365,69 +444,31 @@ static void mix_mono_signal(MidSong *song, sample_t *sp, sint32 *lp, int v,
     else
       {
 	vp->control_counter = cc - count;
-	while (count--)
-	  {
-	    s = *sp++;
-	    MIXATION(left);
-	  }
+	mix_block_mono(sp, lp, left, count);
 	return;
       }
 }
 
 static void mix_mystery(MidSong *song, sample_t *sp, sint32 *lp, int v, int count)
 {
-  final_volume_t 
-    left = song->voice[v].left_mix, 
-    right = song->voice[v].right_mix;
-  sample_t s;
-
-  while (count--)
-    {
-      s = *sp++;
-      MIXATION(left);
-      MIXATION(right);
-    }
+  mix_block_stereo(sp, lp, song->voice[v].left_mix,
+		   song->voice[v].right_mix, count);
 }
 
 static void mix_center(MidSong *song, sample_t *sp, sint32 *lp, int v, int count)
 {
-  final_volume_t 
-    left = song->voice[v].left_mix;
-  sample_t s;
-
-  while (count--)
-    {
-      s = *sp++;
-      MIXATION(left);
-      MIXATION(left);
-    }
+  mix_block_stereo(sp, lp, song->voice[v].left_mix,
+		   song->voice[v].left_mix, count);
 }
 
 static void mix_single(MidSong *song, sample_t *sp, sint32 *lp, int v, int count)
 {
-  final_volume_t 
-    left = song->voice[v].left_mix;
-  sample_t s;
-
-  while (count--)
-    {
-      s = *sp++;
-      MIXATION(left);
-      lp++;
-    }
+  mix_block_single(sp, lp, song->voice[v].left_mix, count);
 }
 
 static void mix_mono(MidSong *song, sample_t *sp, sint32 *lp, int v, int count)
 {
-  final_volume_t 
-    left = song->voice[v].left_mix;
-  sample_t s;
-
-  while (count--)
-    {
-      s = *sp++;
-      MIXATION(left);
-    }
+  mix_block_mono(sp, lp, song->voice[v].left_mix, count);
 }
 
 /* Ramp a note out in c samples */
@@ -93,6 +93,102 @@ void timi_s32tou16(void *dp, sint32 *lp, sint32 c)
     }
 }
 
+/* Full scale of mixed data is 1<<(32-1-GUARD_BITS), same as 16-bit
+   conversion above; values out of it are clipped as well. */
+#define S32_FULL_SCALE (1<<(32-1-GUARD_BITS))
+
+void timi_s32tos32(void *dp, sint32 *lp, sint32 c)
+{
+  sint32 *sp=(sint32 *)(dp);
+  sint32 l;
+  while (c--)
+    {
+      l=*lp++;
+      if (l > S32_FULL_SCALE-1) l=S32_FULL_SCALE-1;
+      else if (l < -S32_FULL_SCALE) l=-S32_FULL_SCALE;
+      *sp++ = (sint32)((uint32)l << GUARD_BITS);
+    }
+}
+
+void timi_s32tof32(void *dp, sint32 *lp, sint32 c)
+{
+  float *fp=(float *)(dp);
+  sint32 l;
+  while (c--)
+    {
+      l=*lp++;
+      if (l > S32_FULL_SCALE) l=S32_FULL_SCALE;
+      else if (l < -S32_FULL_SCALE) l=-S32_FULL_SCALE;
+      *fp++ = (float)l * (1.0f / S32_FULL_SCALE);
+    }
+}
+
+/* Mixing functions -- These add the sint32 data in *lp, scaled by
+   volume, into the native-endian data already in *dp, with clipping */
+
+void timi_s32mixs8(void *dp, sint32 *lp, sint32 c, float volume)
+{
+  sint8 *cp=(sint8 *)(dp);
+  sint32 l;
+  while (c--)
+    {
+      l=(*lp++)>>(32-8-GUARD_BITS);
+      if (l>127) l=127;
+      else if (l<-128) l=-128;
+      l=*cp + (sint32)(l * volume);
+      if (l>127) l=127;
+      else if (l<-128) l=-128;
+      *cp++ = (sint8) (l);
+    }
+}
+
+void timi_s32mixs16(void *dp, sint32 *lp, sint32 c, float volume)
+{
+  sint16 *sp=(sint16 *)(dp);
+  sint32 l;
+  while (c--)
+    {
+      l=(*lp++)>>(32-16-GUARD_BITS);
+      if (l > 32767) l=32767;
+      else if (l<-32768) l=-32768;
+      l=*sp + (sint32)(l * volume);
+      if (l > 32767) l=32767;
+      else if (l<-32768) l=-32768;
+      *sp++ = (sint16)(l);
+    }
+}
+
+void timi_s32mixs32(void *dp, sint32 *lp, sint32 c, float volume)
+{
+  sint32 *sp=(sint32 *)(dp);
+  sint32 l;
+  double d;
+  while (c--)
+    {
+      l=*lp++;
+      if (l > S32_FULL_SCALE-1) l=S32_FULL_SCALE-1;
+      else if (l < -S32_FULL_SCALE) l=-S32_FULL_SCALE;
+      d=(double)*sp + (double)((sint32)((uint32)l << GUARD_BITS)) * volume;
+      if (d > 2147483647.0) d=2147483647.0;
+      else if (d < -2147483648.0) d=-2147483648.0;
+      *sp++ = (sint32)(d);
+    }
+}
+
+void timi_s32mixf32(void *dp, sint32 *lp, sint32 c, float volume)
+{
+  float *fp=(float *)(dp);
+  sint32 l;
+  volume *= (1.0f / S32_FULL_SCALE);
+  while (c--)
+    {
+      l=*lp++;
+      if (l > S32_FULL_SCALE) l=S32_FULL_SCALE;
+      else if (l < -S32_FULL_SCALE) l=-S32_FULL_SCALE;
+      *fp++ += (float)l * volume;
+    }
+}
+
 void timi_s32tos16x(void *dp, sint32 *lp, sint32 c)
 {
   sint16 *sp=(sint16 *)(dp);
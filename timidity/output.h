@@ -36,6 +36,8 @@
 #define PE_MONO 	0x01  /* versus stereo */
 #define PE_SIGNED	0x02  /* versus unsigned */
 #define PE_16BIT 	0x04  /* versus 8-bit */
+#define PE_32BIT 	0x08  /* versus 8/16-bit */
+#define PE_FLOAT 	0x10  /* versus integer (32-bit only) */
 
 /* Conversion functions -- These overwrite the sint32 data in *lp with
    data in another format */
@@ -48,6 +50,17 @@ extern void timi_s32tou8(void *dp, sint32 *lp, sint32 c);
 extern void timi_s32tos16(void *dp, sint32 *lp, sint32 c);
 extern void timi_s32tou16(void *dp, sint32 *lp, sint32 c);
 
+/* 32-bit signed and float, native byte order */
+extern void timi_s32tos32(void *dp, sint32 *lp, sint32 c);
+extern void timi_s32tof32(void *dp, sint32 *lp, sint32 c);
+
+/* Mixing functions -- These add the sint32 data in *lp, scaled by
+   volume, into the data in *dp (signed or float, native byte order) */
+extern void timi_s32mixs8(void *dp, sint32 *lp, sint32 c, float volume);
+extern void timi_s32mixs16(void *dp, sint32 *lp, sint32 c, float volume);
+extern void timi_s32mixs32(void *dp, sint32 *lp, sint32 c, float volume);
+extern void timi_s32mixf32(void *dp, sint32 *lp, sint32 c, float volume);
+
 /* byte-exchanged 16-bit */
 extern void timi_s32tos16x(void *dp, sint32 *lp, sint32 c);
 extern void timi_s32tou16x(void *dp, sint32 *lp, sint32 c);
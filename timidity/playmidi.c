@@ -40,6 +40,7 @@
 
 #include "timidity_internal.h"
 #include "timidity_realtime.h"  // extern decl
+#include "common.h"
 #include "instrum.h"
 #include "playmidi.h"
 #include "output.h"
@@ -54,8 +55,69 @@ static void adjust_amplification(MidSong *song)
 static void reset_voices(MidSong *song)
 {
   int i;
-  for (i=0; i<MID_MAX_VOICES; i++)
-    song->voice[i].status=VOICE_FREE;
+  for (i=0; i<song->voices; i++)
+    {
+      song->voice[i].status=VOICE_FREE;
+      song->voice[i].listed=0;
+    }
+  song->active_voices=0;
+}
+
+/* Register voice to the active list so do_compute_data() mixes it.
+   Voices are dropped from the list there, once they become free. */
+static void activate_voice(MidSong *song, int i)
+{
+  if (song->voice[i].listed)
+    return;
+  song->voice[i].listed=1;
+  song->active_voice[song->active_voices++]=i;
+}
+
+int mid_song_set_polyphony(MidSong *song, int voices)
+{
+  MidVoice *voice;
+  int *active_voice;
+  int i, j, keep;
+
+  if (voices < 1 || voices > MID_MAX_VOICES)
+    {
+      DEBUG_MSG("Bad polyphony %d (max %d)\n", voices, MID_MAX_VOICES);
+      return -1;
+    }
+  if (voices == song->voices && song->voice)
+    return 0;
+
+  voice = (MidVoice *) timi_calloc(voices * sizeof(MidVoice));
+  active_voice = (int *) timi_calloc(voices * sizeof(int));
+  if (!voice || !active_voice)
+    {
+      timi_free(voice);
+      timi_free(active_voice);
+      return -1;
+    }
+
+  /* keep sounding voices which fit in new limit */
+  keep = (song->voices < voices) ? song->voices : voices;
+  if (song->voice && keep > 0)
+    memcpy(voice, song->voice, keep * sizeof(MidVoice));
+  for (i = 0, j = 0; i < song->active_voices; i++)
+    {
+      if (song->active_voice[i] < keep)
+	active_voice[j++] = song->active_voice[i];
+    }
+
+  timi_free(song->voice);
+  timi_free(song->active_voice);
+  song->voice = voice;
+  song->active_voice = active_voice;
+  song->voices = voices;
+  song->active_voices = j;
+  return 0;
+}
+
+int mid_song_get_polyphony(MidSong *song)
+{
+  return song->voices;
 }
 
 /* Process the Reset All Controllers event */
@@ -287,6 +349,7 @@ static void start_note(MidSong *song, MidEvent *e, int i)
     }
 
   song->voice[i].status = VOICE_ON;
+  activate_voice(song, i);
   song->voice[i].channel = e->channel;
   song->voice[i].note = e->a;
   song->voice[i].velocity = e->b;
@@ -601,14 +664,21 @@ static void skip_to(MidSong *song, sint32 until_time)
 
 static void do_compute_data(MidSong *song, sint32 count)
 {
-  int i;
+  int i, v, j = 0;
   memset(song->common_buffer, 0,
 	 (song->encoding & PE_MONO) ? (count * 4) : (count * 8));
-  for (i = 0; i < song->voices; i++)
+  for (i = 0; i < song->active_voices; i++)
     {
-      if(song->voice[i].status != VOICE_FREE)
-	mix_voice(song, song->common_buffer, i, count);
+      v = song->active_voice[i];
+      if(song->voice[v].status != VOICE_FREE)
+	mix_voice(song, song->common_buffer, v, count);
+      /* compact out voices which are finished */
+      if(song->voice[v].status != VOICE_FREE)
+	song->active_voice[j++] = v;
+      else
+	song->voice[v].listed = 0;
     }
+  song->active_voices = j;
   song->current_sample += count;
 }
 
@@ -628,7 +698,10 @@ static void compute_data(MidSong *song, sint8 **stream, sint32 count)
     if (block > song->buffer_size)
       block = song->buffer_size;
     do_compute_data(song, block);
-    song->write(*stream, song->common_buffer, channels * block);
+    if (song->mixing)
+      song->mix(*stream, song->common_buffer, channels * block, song->mix_volume);
+    else
+      song->write(*stream, song->common_buffer, channels * block);
     *stream += song->bytes_per_sample * block;
     count -= block;
   }
@@ -784,6 +857,19 @@ size_t mid_song_read_wave(MidSong *song, sint8 *ptr, size_t size)
   return samples * song->bytes_per_sample;
 }
 
+size_t mid_song_mix_wave(MidSong *song, sint8 *ptr, size_t size, float volume)
+{
+  size_t r;
+
+  if (!song->mix)
+    return 0;
+  song->mixing = 1;
+  song->mix_volume = volume;
+  r = mid_song_read_wave(song, ptr, size);
+  song->mixing = 0;
+  return r;
+}
+
 void mid_song_set_volume(MidSong *song, int volume)
 {
   int i;
@@ -803,6 +889,34 @@ void mid_song_set_volume(MidSong *song, int volume)
       }
 }
 
+int mid_song_queue_events(MidSong *song, const MidEvent *events, sint32 count)
+{
+  MidEvent *list;
+  sint32 i;
+
+  list = (MidEvent *) timi_calloc((count + 1) * sizeof(MidEvent));
+  if (!list)
+    return -1;
+  for (i = 0; i < count; i++)
+    {
+      list[i] = events[i];
+      /* clamp after adding offset, so far event is never reached
+         instead of overflow */
+      if (list[i].time > INT_MAX - 1 - song->current_sample)
+        list[i].time = INT_MAX - 1;
+      else
+        list[i].time += song->current_sample;
+    }
+  /* never reached, so stream keeps playing after queued events */
+  list[count].time = INT_MAX;
+  list[count].type = ME_EOT;
+
+  timi_free(song->events);
+  song->events = list;
+  song->current_event = list;
+  return 0;
+}
+
 /** extension for exporting streaming api */
 static inline void intercept_event(MidSong* song, MidEvent* e, MidEvent** backup)
 {
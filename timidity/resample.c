@@ -42,16 +42,78 @@
 #include "playmidi.h"
 #include "tables.h"
 #include "resample.h"
+#ifdef TIMI_USE_SSE2
+#include <string.h>
+#include <emmintrin.h>
+#endif
 
 #define PRECALC_LOOP_COUNT(start, end, incr) (((end) - (start) + (incr) - 1) / (incr))
 
+/* Linear interpolation of count samples with fixed increment.
+   Updates *ofsp and returns the next destination pointer. */
+static sample_t *rs_linear(sample_t *dest, const sample_t *src,
+			   sint32 *ofsp, sint32 incr, sint32 count)
+{
+  sample_t v1, v2;
+  sint32 ofs = *ofsp;
+
+#ifdef TIMI_USE_SSE2
+  /* Each lane loads src[i] and src[i+1] as one 32-bit word and
+     computes (v2-v1)*frac as v2*frac + v1*(-frac) with pmaddwd,
+     which is exact for 16-bit samples and FRACTION_BITS <= 15. */
+  if (count >= 8 && timi_simd_enabled)
+    {
+      const __m128i fmask = _mm_set1_epi32(FRACTION_MASK);
+      const __m128i incr4 = _mm_set1_epi32(incr * 4);
+      __m128i vofs;
+      sint32 o[4];
+      int k;
+
+      for (k = 0; k < 4; k++)
+	o[k] = ofs + incr * k;
+      vofs = _mm_loadu_si128((const __m128i *)o);
+
+      for (; count >= 4; count -= 4, dest += 4)
+	{
+	  __m128i w, frac, coef, delta, base;
+	  uint32 pair[4];
+	  _mm_storeu_si128((__m128i *)o, vofs);
+	  for (k = 0; k < 4; k++)
+	    memcpy(&pair[k], src + (o[k] >> FRACTION_BITS), sizeof(uint32));
+	  w = _mm_loadu_si128((const __m128i *)pair);
+	  frac = _mm_and_si128(vofs, fmask);
+	  /* (-frac) in low half (pairs with v1), frac in high half (v2) */
+	  coef = _mm_or_si128(_mm_slli_epi32(frac, 16),
+			      _mm_and_si128(_mm_sub_epi32(_mm_setzero_si128(), frac),
+					    _mm_set1_epi32(0xFFFF)));
+	  delta = _mm_srai_epi32(_mm_madd_epi16(w, coef), FRACTION_BITS);
+	  base = _mm_srai_epi32(_mm_slli_epi32(w, 16), 16);
+	  w = _mm_add_epi32(base, delta);
+	  /* results are between v1 and v2, so packing never saturates */
+	  _mm_storel_epi64((__m128i *)dest, _mm_packs_epi32(w, w));
+	  vofs = _mm_add_epi32(vofs, incr4);
+	}
+      _mm_storeu_si128((__m128i *)o, vofs);
+      ofs = o[0];
+    }
+#endif
+  while (count--)
+    {
+      v1 = src[ofs >> FRACTION_BITS];
+      v2 = src[(ofs >> FRACTION_BITS)+1];
+      *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
+      ofs += incr;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+
 /*************** resampling with fixed increment *****************/
 
 static sample_t *rs_plain(MidSong *song, int v, sint32 *countptr)
 {
   /* Play sample until end, then free the voice. */
 
-  sample_t v1, v2;
   MidVoice 
     *vp=&(song->voice[v]);
   sample_t 
@@ -62,7 +124,7 @@ static sample_t *rs_plain(MidSong *song, int v, sint32 *countptr)
     incr=vp->sample_increment,
     le=vp->sample->data_length,
     count=*countptr;
-  sint32 i, j;
+  sint32 i;
 
   if (incr<0) incr = -incr; /* In case we're coming out of a bidir loop */
 
@@ -77,13 +139,7 @@ static sample_t *rs_plain(MidSong *song, int v, sint32 *countptr)
     }
   else count -= i;
 
-  for (j = 0; j < i; j++)
-    {
-      v1 = src[ofs >> FRACTION_BITS];
-      v2 = src[(ofs >> FRACTION_BITS)+1];
-      *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-      ofs += incr;
-    }
+  dest = rs_linear(dest, src, &ofs, incr, i);
 
   if (ofs >= le)
     {
@@ -101,7 +157,6 @@ static sample_t *rs_loop(MidSong *song, MidVoice *vp, sint32 count)
 {
   /* Play sample until end-of-loop, skip back and continue. */
 
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
@@ -110,7 +165,7 @@ static sample_t *rs_loop(MidSong *song, MidVoice *vp, sint32 count)
   sample_t
     *dest=song->resample_buffer,
     *src=vp->sample->data;
-  sint32 i, j;
+  sint32 i;
 
   while (count)
     {
@@ -124,13 +179,7 @@ static sample_t *rs_loop(MidSong *song, MidVoice *vp, sint32 count)
 	  count = 0;
 	}
       else count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = rs_linear(dest, src, &ofs, incr, i);
     }
 
   vp->sample_offset=ofs; /* Update offset */
@@ -139,7 +188,6 @@ static sample_t *rs_loop(MidSong *song, MidVoice *vp, sint32 count)
 
 static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
 {
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
@@ -151,7 +199,7 @@ static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
   sint32
     le2 = le<<1,
     ls2 = ls<<1,
-    i, j;
+    i;
   /* Play normally until inside the loop region */
 
   if (incr > 0 && ofs < ls)
@@ -166,13 +214,7 @@ static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	  count = 0;
 	}
       else count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = rs_linear(dest, src, &ofs, incr, i);
     }
 
   /* Then do the bidirectional looping */
@@ -186,13 +228,7 @@ static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	  count = 0;
 	}
       else count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = rs_linear(dest, src, &ofs, incr, i);
       if (ofs>=le)
 	{
 	  /* fold the overshoot back in */
@@ -339,7 +375,6 @@ static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
 {
   /* Play sample until end-of-loop, skip back and continue. */
 
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
@@ -350,7 +385,7 @@ static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
     *src=vp->sample->data;
   int 
     cc=vp->vibrato_control_counter;
-  sint32 i, j;
+  sint32 i;
   int
     vibflag=0;
 
@@ -370,13 +405,7 @@ static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
 	}
       else cc -= i;
       count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = rs_linear(dest, src, &ofs, incr, i);
       if(vibflag)
 	{
 	  cc = vp->vibrato_control_ratio;
@@ -393,7 +422,6 @@ static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
 
 static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
 {
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
@@ -407,7 +435,7 @@ static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
   sint32
     le2=le<<1,
     ls2=ls<<1,
-    i, j;
+    i;
   int
     vibflag = 0;
 
@@ -423,13 +451,7 @@ static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	}
       else cc -= i;
       count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = rs_linear(dest, src, &ofs, incr, i);
       if (vibflag)
 	{
 	  cc = vp->vibrato_control_ratio;
@@ -451,13 +473,7 @@ static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	}
       else cc -= i;
       count -= i;
-      while (i--)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = rs_linear(dest, src, &ofs, incr, i);
       if (vibflag)
 	{
 	  cc = vp->vibrato_control_ratio;
@@ -50,9 +50,8 @@
 
 #include "ospaths.h"
 
-static MidToneBank *master_tonebank[128], *master_drumset[128];
-
-static char def_instr_name[256] = "";
+/* configuration used by mid_init() and the non-config song constructors */
+static MidConfig *default_config = NULL;
 
 #define MAXWORDS 10
 #define MAX_RCFCOUNT 50
@@ -89,12 +88,32 @@ static char *timi_fgets(char *s, int size, FILE *fp)
     return (num_read != 0)? s : NULL;
 }
 
-static FILE **rcf_fp;
+/* Reentrant strtok() replacement, as strtok_r() is not available everywhere. */
+
+static char *timi_strtok(char *s, const char *delim, char **saveptr)
+{
+    char *end;
+
+    if (s == NULL)
+	s = *saveptr;
+    s += strspn(s, delim);
+    if (*s == '\0')
+    {
+	*saveptr = s;
+	return NULL;
+    }
+    end = s + strcspn(s, delim);
+    if (*end != '\0')
+	*end++ = '\0';
+    *saveptr = end;
+    return s;
+}
 
-static int read_config_file(const char *name, int rcf_count)
+static int read_config_file(MidConfig *config, const char *name, int rcf_count)
 {
+  FILE *fp;
   char  tmp[TIM_MAXPATH];
-  char *w[MAXWORDS], *cp;
+  char *w[MAXWORDS], *cp, *tokp;
   MidToneBank *bank;
   int i, j, k, line, r, words;
 
@@ -104,24 +123,24 @@ static int read_config_file(const char *name, int rcf_count)
     return -1;
   }
 
-  if (!(rcf_fp[rcf_count]=timi_openfile(name)))
+  if (!(fp=timi_openfile(config->pathlist, name)))
     return -1;
 
   bank = NULL;
   line = 0;
   r = -1; /* start by assuming failure, */
 
-  while (timi_fgets(tmp, sizeof(tmp), rcf_fp[rcf_count]))
+  while (timi_fgets(tmp, sizeof(tmp), fp))
   {
     line++;
     words=0;
-    w[0]=strtok(tmp, " \t\240");
+    w[0]=timi_strtok(tmp, " \t\240", &tokp);
     if (!w[0]) continue;
 
     /* Originally the TiMidity++ extensions were prefixed like this */
     if (strcmp(w[0], "#extension") == 0)
     {
-      w[0]=strtok(NULL, " \t\240");
+      w[0]=timi_strtok(NULL, " \t\240", &tokp);
       if (!w[0]) continue;
     }
 
@@ -130,7 +149,7 @@ static int read_config_file(const char *name, int rcf_count)
 
     while (w[words] && *w[words] != '#') {
       if (++words == MAXWORDS) break;
-      w[words]=strtok(NULL, " \t\240");
+      w[words]=timi_strtok(NULL, " \t\240", &tokp);
     }
 
     /* TiMidity++ adds a number of extensions to the config file format.
@@ -219,7 +238,7 @@ static int read_config_file(const char *name, int rcf_count)
 	goto fail;
       }
       for (i=1; i<words; i++) {
-	if (timi_add_pathlist(w[i], strlen(w[i])) < 0)
+	if (timi_add_pathlist(&config->pathlist, w[i], strlen(w[i])) < 0)
 	  goto fail;
       }
     }
@@ -232,7 +251,7 @@ static int read_config_file(const char *name, int rcf_count)
       }
       for (i=1; i<words; i++)
       {
-	r = read_config_file(w[i], rcf_count + 1);
+	r = read_config_file(config, w[i], rcf_count + 1);
 	if (r != 0)
 	  goto fail;
       }
@@ -246,8 +265,8 @@ static int read_config_file(const char *name, int rcf_count)
 		name, line);
 	goto fail;
       }
-      strncpy(def_instr_name, w[1], 255);
-      def_instr_name[255]='\0';
+      strncpy(config->def_instr_name, w[1], 255);
+      config->def_instr_name[255]='\0';
     }
     else if (!strcmp(w[0], "drumset"))
     {
@@ -263,14 +282,14 @@ static int read_config_file(const char *name, int rcf_count)
 		name, line);
 	goto fail;
       }
-      if (!master_drumset[i])
+      if (!config->drumset[i])
       {
-	master_drumset[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
-	if (!master_drumset[i]) goto fail;
-	master_drumset[i]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
-	if (!master_drumset[i]->tone) goto fail;
+	config->drumset[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
+	if (!config->drumset[i]) goto fail;
+	config->drumset[i]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
+	if (!config->drumset[i]->tone) goto fail;
       }
-      bank=master_drumset[i];
+      bank=config->drumset[i];
     }
     else if (!strcmp(w[0], "bank"))
     {
@@ -286,14 +305,14 @@ static int read_config_file(const char *name, int rcf_count)
 		name, line);
 	goto fail;
       }
-      if (!master_tonebank[i])
+      if (!config->tonebank[i])
       {
-	master_tonebank[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
-	if (!master_tonebank[i]) goto fail;
-	master_tonebank[i]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
-	if (!master_tonebank[i]->tone) goto fail;
+	config->tonebank[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
+	if (!config->tonebank[i]) goto fail;
+	config->tonebank[i]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
+	if (!config->tonebank[i]->tone) goto fail;
       }
-      bank=master_tonebank[i];
+      bank=config->tonebank[i];
     }
     else
     {
@@ -409,92 +428,136 @@ static int read_config_file(const char *name, int rcf_count)
 
   r = 0; /* we're good. */
 fail:
-  fclose(rcf_fp[rcf_count]);
-  rcf_fp[rcf_count] = NULL;
+  fclose(fp);
   return r;
 }
 
-static int init_alloc_banks (void)
+MidConfig *mid_config_new(void)
 {
   /* Allocate memory for the standard tonebank and drumset */
-  master_tonebank[0] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
-  if (!master_tonebank[0]) goto _nomem;
-  master_tonebank[0]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
-  if (!master_tonebank[0]->tone) goto _nomem;
+  MidConfig *config = (MidConfig *) timi_calloc(sizeof(MidConfig));
+  if (!config) goto _nomem;
 
-  master_drumset[0] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
-  if (!master_drumset[0]) goto _nomem;
-  master_drumset[0]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
-  if (!master_drumset[0]->tone) goto _nomem;
+  config->tonebank[0] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
+  if (!config->tonebank[0]) goto _nomem;
+  config->tonebank[0]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
+  if (!config->tonebank[0]->tone) goto _nomem;
 
-  return 0;
+  config->drumset[0] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
+  if (!config->drumset[0]) goto _nomem;
+  config->drumset[0]->tone = (MidToneBankElement *) timi_calloc(128 * sizeof(MidToneBankElement));
+  if (!config->drumset[0]->tone) goto _nomem;
+
+  return config;
 _nomem:
   DEBUG_MSG("Out of memory\n");
-  mid_exit ();
-  return -2;
+  mid_config_free (config);
+  return NULL;
 }
 
-static int init_begin_config(const char *cf)
+static int config_load(const char *cf, MidConfig **out)
 {
+  MidConfig *config;
   const char *p;
+  int rc;
+
+  *out = NULL;
+  config = mid_config_new();
+  if (!config)
+    return -2;
 
-  rcf_fp = (FILE **) timi_calloc(MAX_RCFCOUNT * sizeof(FILE*));
-  if (!rcf_fp)
-      return -2;
+  if (cf == NULL || *cf == '\0')
+    cf = TIMIDITY_CFG;
   p = get_last_dirsep(cf);
-  if (p != NULL)
-      return timi_add_pathlist(cf, p - cf + 1); /* including DIRSEP */
+  if (p != NULL &&
+      timi_add_pathlist(&config->pathlist, cf, p - cf + 1) != 0) /* including DIRSEP */
+  {
+    mid_config_free(config);
+    return -2;
+  }
 
+  rc = read_config_file(config, cf, 0);
+  if (rc != 0)
+  {
+    mid_config_free(config);
+    return rc;
+  }
+  *out = config;
   return 0;
 }
 
-static int init_with_config(const char *cf)
+MidConfig *mid_config_load(const char *config_file)
 {
-  int rc;
+  MidConfig *config;
+  config_load(config_file, &config);
+  return config;
+}
 
-  rc = init_begin_config(cf);
-  if (rc != 0) {
-      mid_exit ();
-      return rc;
-  }
-  rc = read_config_file(cf, 0);
-  if (rc != 0)
-      mid_exit ();
-  else {
-      timi_free(rcf_fp);
-      rcf_fp = NULL;
+void mid_config_free(MidConfig *config)
+{
+  int i, j;
+
+  if (!config) return;
+
+  for (i = 0; i < 128; i++) {
+    if (config->tonebank[i]) {
+      MidToneBankElement *e = config->tonebank[i]->tone;
+      if (e != NULL) {
+	for (j = 0; j < 128; j++) {
+	  timi_free(e[j].name);
+	}
+	timi_free(e);
+      }
+      timi_free(config->tonebank[i]);
+    }
+    if (config->drumset[i]) {
+      MidToneBankElement *e = config->drumset[i]->tone;
+      if (e != NULL) {
+	for (j = 0; j < 128; j++) {
+	  timi_free(e[j].name);
+	}
+	timi_free(e);
+      }
+      timi_free(config->drumset[i]);
+    }
   }
-  return rc;
+
+  timi_free_pathlist(&config->pathlist);
+  timi_free(config);
 }
 
 int mid_init_no_config(void)
 {
-  master_tonebank[0] = NULL;
-  master_drumset[0] = NULL;
-  rcf_fp = NULL;
-
-  return init_alloc_banks();
+  MidConfig *config = mid_config_new();
+  if (!config)
+    return -2;
+  mid_exit();
+  default_config = config;
+  return 0;
 }
 
 int mid_init(const char *config_file)
 {
-  int rc = mid_init_no_config();
+  MidConfig *config;
+  int rc = config_load(config_file, &config);
   if (rc != 0)
-      return rc;
-
-  if (config_file == NULL || *config_file == '\0')
-      return init_with_config(TIMIDITY_CFG);
-
-  return init_with_config(config_file);
+    return rc;
+  mid_exit();
+  default_config = config;
+  return 0;
 }
 
-static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **out)
+static void do_song_load(MidConfig *config, MidIStream *stream, MidSongOptions *options, MidSong **out)
 {
   MidSong *song;
   int i;
 
   *out = NULL;
   if (!stream) return;
+  if (!config) {
+    DEBUG_MSG("No configuration loaded\n");
+    return;
+  }
 
   if (options->rate < MIN_OUTPUT_RATE || options->rate > MAX_OUTPUT_RATE) {
     DEBUG_MSG("Bad sample rate %d\n",options->rate);
@@ -510,7 +573,9 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   case MID_AUDIO_S16LSB:
   case MID_AUDIO_S16MSB:
   case MID_AUDIO_U16LSB:
-  case MID_AUDIO_U16MSB: break; /* supported */
+  case MID_AUDIO_U16MSB:
+  case MID_AUDIO_S32:
+  case MID_AUDIO_F32: break; /* supported */
   default:
     DEBUG_MSG("Bad audio format 0x%x\n",options->format);
     return;
@@ -519,28 +584,33 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   /* Allocate memory for the song */
   song = (MidSong *)timi_calloc(sizeof(MidSong));
   if (!song) return;
+  song->pathlist = config->pathlist;
 
   for (i = 0; i < 128; i++) {
-    if (master_tonebank[i]) {
+    if (config->tonebank[i]) {
       song->tonebank[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
       if (!song->tonebank[i]) goto fail;
-      song->tonebank[i]->tone = master_tonebank[i]->tone;
+      song->tonebank[i]->tone = config->tonebank[i]->tone;
     }
-    if (master_drumset[i]) {
+    if (config->drumset[i]) {
       song->drumset[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
       if (!song->drumset[i]) goto fail;
-      song->drumset[i]->tone = master_drumset[i]->tone;
+      song->drumset[i]->tone = config->drumset[i]->tone;
     }
   }
 
   song->amplification = DEFAULT_AMPLIFICATION;
-  song->voices = DEFAULT_VOICES;
+  if (mid_song_set_polyphony(song, DEFAULT_VOICES) < 0) goto fail;
   song->drumchannels = DEFAULT_DRUMCHANNELS;
 
   song->rate = options->rate;
   song->encoding = 0;
   if (options->format & 0x0010)
       song->encoding |= PE_16BIT;
+  if (options->format & 0x0020)
+      song->encoding |= PE_32BIT;
+  if (options->format & 0x0100)
+      song->encoding |= PE_FLOAT;
   if (options->format & 0x8000)
       song->encoding |= PE_SIGNED;
   if (options->channels == 1)
@@ -548,15 +618,22 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   switch (options->format) {
   case MID_AUDIO_S8:
     song->write = timi_s32tos8;
+    song->mix = timi_s32mixs8;
     break;
   case MID_AUDIO_U8:
     song->write = timi_s32tou8;
     break;
   case MID_AUDIO_S16LSB:
     song->write = timi_s32tos16l;
+#if !defined(WORDS_BIGENDIAN)
+    song->mix = timi_s32mixs16;
+#endif
     break;
   case MID_AUDIO_S16MSB:
     song->write = timi_s32tos16b;
+#if defined(WORDS_BIGENDIAN)
+    song->mix = timi_s32mixs16;
+#endif
     break;
   case MID_AUDIO_U16LSB:
     song->write = timi_s32tou16l;
@@ -564,6 +641,14 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   case MID_AUDIO_U16MSB:
     song->write = timi_s32tou16b;
     break;
+  case MID_AUDIO_S32:
+    song->write = timi_s32tos32;
+    song->mix = timi_s32mixs32;
+    break;
+  case MID_AUDIO_F32:
+    song->write = timi_s32tof32;
+    song->mix = timi_s32mixf32;
+    break;
   }
 
   song->buffer_size = options->buffer_size;
@@ -575,6 +660,8 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   song->bytes_per_sample = 2;
   if (song->encoding & PE_16BIT)
     song->bytes_per_sample *= 2;
+  else if (song->encoding & PE_32BIT)
+    song->bytes_per_sample *= 4;
   if (song->encoding & PE_MONO)
     song->bytes_per_sample /= 2;
 
@@ -597,8 +684,8 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   song->default_instrument = NULL;
   song->default_program = DEFAULT_PROGRAM;
 
-  if (*def_instr_name)
-    set_default_instrument(song, def_instr_name);
+  if (*config->def_instr_name)
+    set_default_instrument(song, config->def_instr_name);
 
   load_missing_instruments(song);
 
@@ -609,18 +696,27 @@ fail: mid_song_free (song);
   }
 }
 
-MidSong *mid_song_load(MidIStream *stream, MidSongOptions *options)
+MidSong *mid_song_load_with_config(MidConfig *config, MidIStream *stream, MidSongOptions *options)
 {
   MidSong *song;
-  do_song_load(stream, options, &song);
+  do_song_load(config, stream, options, &song);
   return song;
 }
 
-MidSong* mid_song_for_stream(MidSongOptions *options)
+MidSong *mid_song_load(MidIStream *stream, MidSongOptions *options)
+{
+  return mid_song_load_with_config(default_config, stream, options);
+}
+
+MidSong* mid_song_for_stream_with_config(MidConfig *config, MidSongOptions *options)
 {
   MidSong *song;
   int i;
-  
+
+  if (!config) {
+    DEBUG_MSG("No configuration loaded\n");
+    return 0;
+  }
   if (options->rate < MIN_OUTPUT_RATE || options->rate > MAX_OUTPUT_RATE) {
     DEBUG_MSG("Bad sample rate %d\n",options->rate);
     return 0;
@@ -635,7 +731,9 @@ MidSong* mid_song_for_stream(MidSongOptions *options)
   case MID_AUDIO_S16LSB:
   case MID_AUDIO_S16MSB:
   case MID_AUDIO_U16LSB:
-  case MID_AUDIO_U16MSB: break; /* supported */
+  case MID_AUDIO_U16MSB:
+  case MID_AUDIO_S32:
+  case MID_AUDIO_F32: break; /* supported */
   default:
     DEBUG_MSG("Bad audio format 0x%x\n",options->format);
     return 0;
@@ -644,28 +742,33 @@ MidSong* mid_song_for_stream(MidSongOptions *options)
   /* Allocate memory for the song */
   song = (MidSong *)timi_calloc(sizeof(MidSong));
   if (!song) return 0;
+  song->pathlist = config->pathlist;
 
   for (i = 0; i < 128; i++) {
-    if (master_tonebank[i]) {
+    if (config->tonebank[i]) {
       song->tonebank[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
       if (!song->tonebank[i]) goto fail;
-      song->tonebank[i]->tone = master_tonebank[i]->tone;
+      song->tonebank[i]->tone = config->tonebank[i]->tone;
     }
-    if (master_drumset[i]) {
+    if (config->drumset[i]) {
       song->drumset[i] = (MidToneBank *) timi_calloc(sizeof(MidToneBank));
       if (!song->drumset[i]) goto fail;
-      song->drumset[i]->tone = master_drumset[i]->tone;
+      song->drumset[i]->tone = config->drumset[i]->tone;
     }
   }
 
   song->amplification = DEFAULT_AMPLIFICATION;
-  song->voices = DEFAULT_VOICES;
+  if (mid_song_set_polyphony(song, DEFAULT_VOICES) < 0) goto fail;
   song->drumchannels = DEFAULT_DRUMCHANNELS;
 
   song->rate = options->rate;
   song->encoding = 0;
   if (options->format & 0x0010)
       song->encoding |= PE_16BIT;
+  if (options->format & 0x0020)
+      song->encoding |= PE_32BIT;
+  if (options->format & 0x0100)
+      song->encoding |= PE_FLOAT;
   if (options->format & 0x8000)
       song->encoding |= PE_SIGNED;
   if (options->channels == 1)
@@ -673,15 +776,22 @@ MidSong* mid_song_for_stream(MidSongOptions *options)
   switch (options->format) {
   case MID_AUDIO_S8:
     song->write = timi_s32tos8;
+    song->mix = timi_s32mixs8;
     break;
   case MID_AUDIO_U8:
     song->write = timi_s32tou8;
     break;
   case MID_AUDIO_S16LSB:
     song->write = timi_s32tos16l;
+#if !defined(WORDS_BIGENDIAN)
+    song->mix = timi_s32mixs16;
+#endif
     break;
   case MID_AUDIO_S16MSB:
     song->write = timi_s32tos16b;
+#if defined(WORDS_BIGENDIAN)
+    song->mix = timi_s32mixs16;
+#endif
     break;
   case MID_AUDIO_U16LSB:
     song->write = timi_s32tou16l;
@@ -689,6 +799,14 @@ MidSong* mid_song_for_stream(MidSongOptions *options)
   case MID_AUDIO_U16MSB:
     song->write = timi_s32tou16b;
     break;
+  case MID_AUDIO_S32:
+    song->write = timi_s32tos32;
+    song->mix = timi_s32mixs32;
+    break;
+  case MID_AUDIO_F32:
+    song->write = timi_s32tof32;
+    song->mix = timi_s32mixf32;
+    break;
   }
 
   song->buffer_size = options->buffer_size;
@@ -700,6 +818,8 @@ MidSong* mid_song_for_stream(MidSongOptions *options)
   song->bytes_per_sample = 2;
   if (song->encoding & PE_16BIT)
     song->bytes_per_sample *= 2;
+  else if (song->encoding & PE_32BIT)
+    song->bytes_per_sample *= 4;
   if (song->encoding & PE_MONO)
     song->bytes_per_sample /= 2;
 
@@ -720,8 +840,8 @@ MidSong* mid_song_for_stream(MidSongOptions *options)
   song->default_instrument = NULL;
   song->default_program = DEFAULT_PROGRAM;
 
-  if (*def_instr_name)
-    set_default_instrument(song, def_instr_name);
+  if (*config->def_instr_name)
+    set_default_instrument(song, config->def_instr_name);
 
   // as no note had been used, we need to designate all instruments to be loaded.
   for (i = 0; i < 128; ++i)
@@ -743,6 +863,11 @@ fail:
   }
 }
 
+MidSong* mid_song_for_stream(MidSongOptions *options)
+{
+  return mid_song_for_stream_with_config(default_config, options);
+}
+
 void mid_song_free(MidSong *song)
 {
   int i;
@@ -759,6 +884,8 @@ void mid_song_free(MidSong *song)
   timi_free(song->common_buffer);
   timi_free(song->resample_buffer);
   timi_free(song->events);
+  timi_free(song->voice);
+  timi_free(song->active_voice);
 
   for (i = 0; i < MID_META_MAX; i++) {
     timi_free(song->meta_data[i]);
@@ -769,43 +896,8 @@ void mid_song_free(MidSong *song)
 
 void mid_exit(void)
 {
-  int i, j;
-
-  if (rcf_fp) {
-    for (i = 0; i < MAX_RCFCOUNT; i++) {
-      if (rcf_fp[i])
-	fclose(rcf_fp[i]);
-    }
-    timi_free(rcf_fp);
-    rcf_fp = NULL;
-  }
-
-  for (i = 0; i < 128; i++) {
-    if (master_tonebank[i]) {
-      MidToneBankElement *e = master_tonebank[i]->tone;
-      if (e != NULL) {
-	for (j = 0; j < 128; j++) {
-	  timi_free(e[j].name);
-	}
-	timi_free(e);
-      }
-      timi_free(master_tonebank[i]);
-      master_tonebank[i] = NULL;
-    }
-    if (master_drumset[i]) {
-      MidToneBankElement *e = master_drumset[i]->tone;
-      if (e != NULL) {
-	for (j = 0; j < 128; j++) {
-	  timi_free(e[j].name);
-	}
-	timi_free(e);
-      }
-      timi_free(master_drumset[i]);
-      master_drumset[i] = NULL;
-    }
-  }
-
-  timi_free_pathlist();
+  mid_config_free(default_config);
+  default_config = NULL;
 }
 
 long mid_get_version (void)
@@ -813,6 +905,19 @@ long mid_get_version (void)
   return LIBTIMIDITY_VERSION;
 }
 
+#ifdef TIMI_USE_SSE2
+int timi_simd_enabled = 1;
+#endif
+
+void mid_set_simd (int enable)
+{
+#ifdef TIMI_USE_SSE2
+  timi_simd_enabled = enable;
+#else
+  (void) enable;
+#endif
+}
+
 /* ===== for libtimidity <= 0.2.x compatibility =====
  */
 MidDLSPatches *mid_dlspatches_load (MidIStream *stream)
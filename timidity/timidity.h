@@ -62,6 +62,8 @@ extern "C" {
 #define MID_AUDIO_S16MSB  0x9010  /* As above, but big-endian byte order */
 #define MID_AUDIO_U16     MID_AUDIO_U16LSB
 #define MID_AUDIO_S16     MID_AUDIO_S16LSB
+#define MID_AUDIO_S32     0x8020  /* Signed 32-bit samples, native byte order */
+#define MID_AUDIO_F32     0x8120  /* 32-bit float samples, native byte order */
 
 /* Core Library Types
  */
@@ -87,6 +89,7 @@ extern "C" {
   typedef struct _MidIStream MidIStream;
   typedef struct _MidDLSPatches MidDLSPatches;
   typedef struct _MidSong MidSong;
+  typedef struct _MidConfig MidConfig;
 
   typedef struct _MidSongOptions MidSongOptions;
   struct _MidSongOptions
@@ -158,6 +161,31 @@ extern "C" {
  */
   TIMI_EXPORT extern void mid_exit (void);
 
+/* Create an empty configuration context, or load one from a
+ * configuration file (NULL for default). Songs created with a
+ * context only read from it, so a context can be shared between
+ * threads, but it must outlive all songs created with it.
+ * Returns NULL on failure.
+ */
+  TIMI_EXPORT extern MidConfig *mid_config_new (void);
+  TIMI_EXPORT extern MidConfig *mid_config_load (const char *config_file);
+
+/* Free configuration context
+ */
+  TIMI_EXPORT extern void mid_config_free (MidConfig *config);
+
+/* Free cached instruments which are not used by any song.
+ * Instruments are cached across songs (and mid_init/mid_exit)
+ * by patch file path and output rate.
+ */
+  TIMI_EXPORT extern void mid_instrument_cache_clear (void);
+
+/* Enable or disable SIMD resampling and mixing (enabled by default
+ * if compiled in). Output is same either way; scalar code is kept
+ * as reference.
+ */
+  TIMI_EXPORT extern void mid_set_simd (int enable);
+
 
 /* Input Stream Functions
  * ======================
@@ -227,6 +255,12 @@ extern "C" {
   TIMI_EXPORT extern MidSong *mid_song_load (MidIStream *stream,
                                              MidSongOptions *options);
 
+/* Load MIDI song using specified configuration context
+ */
+  TIMI_EXPORT extern MidSong *mid_song_load_with_config (MidConfig *config,
+                                                         MidIStream *stream,
+                                                         MidSongOptions *options);
+
 /* Load MIDI song with specified DLS patches
  * No longer supported:  Always returns NULL.
  */
@@ -238,6 +272,15 @@ extern "C" {
  */
   TIMI_EXPORT extern void mid_song_set_volume (MidSong *song, int volume);
 
+/* Set maximum count of simultaneously playing voices (1 ~ 1024).
+ * Voices over new limit are dropped. Returns 0 on success, -1 on failure.
+ */
+  TIMI_EXPORT extern int mid_song_set_polyphony (MidSong *song, int voices);
+
+/* Get maximum count of simultaneously playing voices
+ */
+  TIMI_EXPORT extern int mid_song_get_polyphony (MidSong *song);
+
 /* Seek song to the start position and initialize conversion
  */
   TIMI_EXPORT extern void mid_song_start (MidSong *song);
@@ -246,6 +289,12 @@ extern "C" {
  */
   TIMI_EXPORT extern size_t mid_song_read_wave (MidSong *song, sint8 *ptr, size_t size);
 
+/* Same as mid_song_read_wave, but adds WAVE data scaled by volume into
+ * ptr instead of overwriting it. Only signed and float formats in native
+ * byte order are supported; returns 0 for other formats.
+ */
+  TIMI_EXPORT extern size_t mid_song_mix_wave (MidSong *song, sint8 *ptr, size_t size, float volume);
+
 /* Seek song to specified offset in milliseconds
  */
   TIMI_EXPORT extern void mid_song_seek (MidSong *song, uint32 ms);
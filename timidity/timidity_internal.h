@@ -127,8 +127,18 @@ extern sint32 XCHG_LONG (sint32);
 
 #define MID_VIBRATO_SAMPLE_INCREMENTS 32
 
-/* Maximum polyphony. */
-#define MID_MAX_VOICES	48
+/* SIMD paths of resampling and mixing loops. Results are bit-identical
+   to the scalar code. Define TIMI_NO_SIMD to disable, or turn off at
+   runtime with mid_set_simd(). */
+#if !defined(TIMI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TIMI_USE_SSE2 1
+#define timi_simd_enabled TIMI_NAMESPACE(timi_simd_enabled)
+extern int timi_simd_enabled;
+#endif
+
+/* Upper limit of configurable polyphony. */
+#define MID_MAX_VOICES	1024
 
 typedef sint16 sample_t;
 typedef sint32 final_volume_t;
@@ -165,6 +175,7 @@ typedef struct _MidVoice MidVoice;
 struct _MidVoice
 {
   uint8 status, channel, note, velocity;
+  uint8 listed; /* registered in song's active voice list */
   MidSample *sample;
   sint32
     orig_frequency, frequency,
@@ -218,9 +229,19 @@ struct _MidEventList
   struct _MidEventList *next;
 };
 
+/* Parsed configuration: tone bank definitions and patch search paths.
+   Songs borrow it, so it must outlive every song created with it. */
+struct _MidConfig
+{
+  MidToneBank *tonebank[128], *drumset[128];
+  char def_instr_name[256];
+  struct _PathList *pathlist;
+};
+
 struct _MidSong
 {
   int oom; /* malloc() failed */
+  struct _PathList *pathlist; /* borrowed from MidConfig */
   int playing;
   sint32 rate;
   sint32 encoding;
@@ -232,6 +253,9 @@ struct _MidSong
   MidInstrument *default_instrument;
   int default_program;
   void (*write) (void *dp, sint32 *lp, sint32 c);
+  void (*mix) (void *dp, sint32 *lp, sint32 c, float volume); /* NULL if unsupported */
+  int mixing;                   /* mid_song_mix_wave() in progress */
+  float mix_volume;
   int buffer_size;
   sample_t *resample_buffer;
   sint32 *common_buffer;
@@ -241,8 +265,11 @@ struct _MidSong
   sint32 sample_increment;
   sint32 sample_correction;
   MidChannel channel[16];
-  MidVoice voice[MID_MAX_VOICES];
+  MidVoice *voice;
   int voices;
+  /* indices of voices which may be sounding; only these are mixed. */
+  int *active_voice;
+  int active_voices;
   sint32 drumchannels;
   sint32 control_ratio;
   sint32 lost_notes;
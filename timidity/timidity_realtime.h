@@ -25,6 +25,13 @@ TIMI_EXPORT extern void tone_bank_export(MidSong *song, MidEvent *e);
 TIMI_EXPORT extern void EOT_export(MidSong *song, MidEvent *e);
 TIMI_EXPORT extern void send_event(MidSong *song, MidEvent *e);
 TIMI_EXPORT extern MidSong* mid_song_for_stream(MidSongOptions *options);
+TIMI_EXPORT extern MidSong* mid_song_for_stream_with_config(MidConfig *config, MidSongOptions *options);
+
+/* Replace pending events of stream song with events sorted by time.
+ * Event time is sample offset from current playing position, and events
+ * are processed sample-accurately by mid_song_read_wave().
+ * Passing zero count clears pending events. Returns 0 on success. */
+TIMI_EXPORT extern int mid_song_queue_events(MidSong *song, const MidEvent *events, sint32 count);
 
 #ifdef __cplusplus
 }